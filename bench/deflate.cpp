@@ -0,0 +1,159 @@
+//Compares crunch's deflate encoder with lodepng's own, on pngs given on the command line
+//or on a generated 1024x1024 page of sprites. Build with `make bench` in linux/.
+//
+//   usage: deflate_bench [-r runs] [page.png...]
+//
+//For every image it prints the time and size of the deflate stage alone, run over the
+//raw rgba pixels, and of a whole png encode, for lodepng and for each level.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../crunch/deflate.hpp"
+#include "../crunch/lodepng.h"
+
+using namespace std;
+
+struct Image
+{
+    string name;
+    unsigned width;
+    unsigned height;
+    vector<unsigned char> pixels;
+};
+
+//Sprite-like rects of gradients and flat color on a transparent page, from a fixed seed
+static Image GeneratePage()
+{
+    Image image = { "generated", 1024, 1024, vector<unsigned char>(1024 * 1024 * 4, 0) };
+    uint32_t seed = 12345;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return seed >> 8;
+    };
+
+    for (int sprite = 0; sprite < 400; ++sprite)
+    {
+        int w = 8 + next() % 96;
+        int h = 8 + next() % 96;
+        int x0 = next() % (image.width - w);
+        int y0 = next() % (image.height - h);
+        uint32_t color = next();
+        bool flat = next() % 3 == 0;
+        for (int y = 0; y < h; ++y)
+        {
+            for (int x = 0; x < w; ++x)
+            {
+                unsigned char* p = &image.pixels[((y0 + y) * image.width + x0 + x) * 4];
+                p[0] = static_cast<unsigned char>(flat ? color : (color & 0xff) + x * 2);
+                p[1] = static_cast<unsigned char>(flat ? color >> 8 : ((color >> 8) & 0xff) + y * 2);
+                p[2] = static_cast<unsigned char>(color >> 16);
+                p[3] = (x + y) % 17 == 0 ? 0 : 255;
+            }
+        }
+    }
+    return image;
+}
+
+//Best of several runs, in milliseconds
+static double Time(int runs, const function<size_t()>& func, size_t& size)
+{
+    double best = 1e30;
+    for (int run = 0; run < runs; ++run)
+    {
+        auto start = chrono::steady_clock::now();
+        size = func();
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        best = min(best, elapsed.count());
+    }
+    return best;
+}
+
+static void Report(const string& encoder, double deflateTime, size_t deflateSize, double pngTime, size_t pngSize)
+{
+    cout << '\t' << left << setw(10) << encoder << right << fixed << setprecision(2);
+    cout << setw(10) << deflateTime << " ms" << setw(12) << deflateSize << " bytes";
+    cout << setw(10) << pngTime << " ms" << setw(12) << pngSize << " bytes" << endl;
+}
+
+static void Bench(const Image& image, int runs)
+{
+    cout << image.name << " (" << image.width << " x " << image.height << ")" << endl;
+    cout << '\t' << left << setw(10) << "encoder" << right << setw(13) << "deflate" << setw(18) << "" << setw(13) << "png" << endl;
+
+    //Level 0 stands for lodepng's own encoder
+    for (int level = 0; level <= DEFLATE_MAX_LEVEL; ++level)
+    {
+        LodePNGCompressSettings settings;
+        lodepng_compress_settings_init(&settings);
+        if (level > 0)
+            UseDeflate(settings, level);
+
+        size_t deflateSize = 0;
+        double deflateTime = Time(runs, [&]()
+        {
+            unsigned char* out = nullptr;
+            size_t size = 0;
+            //lodepng_deflate is always lodepng's encoder, custom_deflate is only used by the png encoder
+            if (level > 0)
+                Deflate(&out, &size, image.pixels.data(), image.pixels.size(), &settings);
+            else
+                lodepng_deflate(&out, &size, image.pixels.data(), image.pixels.size(), &settings);
+            free(out);
+            return size;
+        }, deflateSize);
+
+        size_t pngSize = 0;
+        double pngTime = Time(runs, [&]()
+        {
+            LodePNGState state;
+            lodepng_state_init(&state);
+            state.encoder.zlibsettings = settings;
+            unsigned char* out = nullptr;
+            size_t size = 0;
+            lodepng_encode(&out, &size, image.pixels.data(), image.width, image.height, &state);
+            lodepng_state_cleanup(&state);
+            free(out);
+            return size;
+        }, pngSize);
+
+        Report(level == 0 ? "lodepng" : "level " + to_string(level), deflateTime, deflateSize, pngTime, pngSize);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int runs = 3;
+    vector<Image> images;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            runs = max(1, atoi(argv[++i]));
+            continue;
+        }
+
+        Image image = { argv[i], 0, 0, {} };
+        unsigned error = lodepng::decode(image.pixels, image.width, image.height, argv[i]);
+        if (error)
+        {
+            cerr << "failed to load png: " << argv[i] << " (" << lodepng_error_text(error) << ")" << endl;
+            return EXIT_FAILURE;
+        }
+        images.push_back(move(image));
+    }
+    if (images.empty())
+        images.push_back(GeneratePage());
+
+    for (const Image& image : images)
+        Bench(image, runs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,232 @@
+#include "arena.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+//Every allocation is preceded by its size, so the most recent one can grow in place
+static const size_t headerSize = 16;
+static const size_t chunkSize = 4 << 20;
+
+struct Chunk
+{
+    uint8_t* memory;
+    size_t size;
+    size_t used;
+    size_t last;    //offset of the most recent allocation's header
+};
+
+//The chunks past the ones in use are spares left over from earlier scopes
+struct Arena
+{
+    vector<Chunk> chunks;
+    size_t active = 0;
+};
+
+static mutex arenaLock;
+static vector<Arena*> arenas;
+static vector<Arena*> idleArenas;
+
+//Arenas are handed out to threads as they first need one and go back to the pool when a
+//thread ends, so they outlive the threads that filled them
+struct ArenaLease
+{
+    Arena* arena = nullptr;
+    int scopes = 0;
+
+    Arena* Get()
+    {
+        if (!arena)
+        {
+            lock_guard<mutex> guard(arenaLock);
+            if (idleArenas.empty())
+            {
+                arenas.push_back(new Arena());
+                idleArenas.push_back(arenas.back());
+            }
+            arena = idleArenas.back();
+            idleArenas.pop_back();
+        }
+        return arena;
+    }
+
+    ~ArenaLease()
+    {
+        if (arena)
+        {
+            lock_guard<mutex> guard(arenaLock);
+            idleArenas.push_back(arena);
+        }
+    }
+};
+
+static thread_local ArenaLease lease;
+
+static size_t& SizeOf(void* ptr)
+{
+    return *reinterpret_cast<size_t*>(reinterpret_cast<uint8_t*>(ptr) - headerSize);
+}
+
+static Chunk* FindChunk(Arena* arena, const void* ptr)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(ptr);
+    for (size_t i = arena->active; i-- > 0;)
+    {
+        Chunk& chunk = arena->chunks[i];
+        if (p >= chunk.memory && p < chunk.memory + chunk.size)
+            return &chunk;
+    }
+    return nullptr;
+}
+
+void* ArenaAllocate(size_t size)
+{
+    if (lease.scopes == 0)
+        return malloc(size);
+
+    Arena* arena = lease.Get();
+    size_t needed = headerSize + ((size + 15) & ~static_cast<size_t>(15));
+    if (arena->active == 0 || arena->chunks[arena->active - 1].used + needed > arena->chunks[arena->active - 1].size)
+    {
+        if (arena->active < arena->chunks.size() && needed <= arena->chunks[arena->active].size)
+            ++arena->active;
+        else
+        {
+            //Big buffers get a chunk of their own, so they don't waste the rest of a shared one
+            Chunk chunk = { nullptr, max(needed, chunkSize), 0, 0 };
+            chunk.memory = reinterpret_cast<uint8_t*>(malloc(chunk.size));
+            if (!chunk.memory)
+                return nullptr;
+            arena->chunks.insert(arena->chunks.begin() + arena->active++, chunk);
+        }
+    }
+
+    Chunk& chunk = arena->chunks[arena->active - 1];
+    chunk.last = chunk.used;
+    chunk.used += needed;
+    void* ptr = chunk.memory + chunk.last + headerSize;
+    SizeOf(ptr) = size;
+    return ptr;
+}
+
+void* ArenaReallocate(void* ptr, size_t size)
+{
+    if (!ptr)
+        return ArenaAllocate(size);
+    Chunk* chunk = lease.scopes > 0 ? FindChunk(lease.Get(), ptr) : nullptr;
+    if (!chunk)
+        return realloc(ptr, size);
+
+    //The most recent allocation just moves the end of its chunk
+    size_t offset = reinterpret_cast<uint8_t*>(ptr) - chunk->memory - headerSize;
+    size_t needed = headerSize + ((size + 15) & ~static_cast<size_t>(15));
+    if (offset == chunk->last && chunk->last + needed <= chunk->size)
+    {
+        chunk->used = chunk->last + needed;
+        SizeOf(ptr) = size;
+        return ptr;
+    }
+
+    void* moved = ArenaAllocate(size);
+    if (moved)
+        memcpy(moved, ptr, min(SizeOf(ptr), size));
+    return moved;
+}
+
+void ArenaFree(void* ptr)
+{
+    if (!ptr)
+        return;
+    Chunk* chunk = lease.scopes > 0 ? FindChunk(lease.Get(), ptr) : nullptr;
+    if (!chunk)
+    {
+        free(ptr);
+        return;
+    }
+
+    //Scratch buffers are often freed right after they're used, which gives them back
+    size_t offset = reinterpret_cast<uint8_t*>(ptr) - chunk->memory - headerSize;
+    if (offset == chunk->last)
+        chunk->used = chunk->last;
+}
+
+bool InArena()
+{
+    return lease.scopes > 0;
+}
+
+void ReleaseArenas()
+{
+    lock_guard<mutex> guard(arenaLock);
+    for (Arena* arena : arenas)
+    {
+        for (Chunk& chunk : arena->chunks)
+            free(chunk.memory);
+        arena->chunks.clear();
+        arena->active = 0;
+    }
+}
+
+ArenaScope::ArenaScope(bool enabled)
+    : enabled(enabled), active(0), used(0), last(0)
+{
+    if (!enabled)
+        return;
+
+    ++lease.scopes;
+    Arena* arena = lease.Get();
+    active = arena->active;
+    if (active > 0)
+    {
+        used = arena->chunks[active - 1].used;
+        last = arena->chunks[active - 1].last;
+    }
+}
+
+//Chunks emptied by the rewind are kept for the next scope, except the ones sized for a
+//single big buffer
+ArenaScope::~ArenaScope()
+{
+    if (!enabled)
+        return;
+
+    --lease.scopes;
+    Arena* arena = lease.Get();
+    for (size_t i = arena->active; i-- > active;)
+    {
+        Chunk& chunk = arena->chunks[i];
+        chunk.used = 0;
+        chunk.last = 0;
+        if (chunk.size > chunkSize)
+        {
+            free(chunk.memory);
+            arena->chunks.erase(arena->chunks.begin() + i);
+        }
+    }
+    arena->active = active;
+    if (active > 0)
+    {
+        arena->chunks[active - 1].used = used;
+        arena->chunks[active - 1].last = last;
+    }
+}
+
+//Lodepng's own allocators are compiled out, so it decodes into the arenas too
+void* lodepng_malloc(size_t size)
+{
+    return ArenaAllocate(size);
+}
+
+void* lodepng_realloc(void* ptr, size_t new_size)
+{
+    return ArenaReallocate(ptr, new_size);
+}
+
+void lodepng_free(void* ptr)
+{
+    ArenaFree(ptr);
+}
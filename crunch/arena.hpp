@@ -0,0 +1,32 @@
+#ifndef arena_hpp
+#define arena_hpp
+
+#include <cstddef>
+
+// Bump allocators for the scratch memory sprites are decoded with. Inside an ArenaScope
+// each thread allocates from chunks of its own arena, with no locking and nothing handed
+// back one at a time: freeing only rewinds the thread's most recent allocation, and the
+// scope rewinds everything allocated in it once it ends, so nothing may point into the
+// arena after that. Outside a scope these are malloc, realloc and free.
+void* ArenaAllocate(size_t size);
+void* ArenaReallocate(void* ptr, size_t size);
+void ArenaFree(void* ptr);
+
+// Whether allocations on this thread currently come from its arena
+bool InArena();
+
+// Frees every chunk of every arena, spares included. No scope may be open on any thread.
+void ReleaseArenas();
+
+struct ArenaScope
+{
+    bool enabled;
+    size_t active;  //where the arena was up to when the scope started
+    size_t used;
+    size_t last;
+
+    ArenaScope(bool enabled);
+    ~ArenaScope();
+};
+
+#endif
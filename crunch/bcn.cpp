@@ -0,0 +1,744 @@
+#include "bcn.hpp"
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+using namespace std;
+
+//The pixels of a block that are encoded together
+struct Subset
+{
+    int count;
+    int index[16];
+};
+
+static void Unpack(const uint32_t* pixels, int px[16][4])
+{
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < 4; ++c)
+            px[i][c] = (pixels[i] >> (c * 8)) & 0xff;
+}
+
+static float Clamp255(float v)
+{
+    return v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v);
+}
+
+//Fits a line through the pixels of a subset along their principal axis. lo and hi
+//receive the pixels' extremes along it. Returns the squared distance of the pixels
+//from the line, which is how badly a pair of endpoints can represent them.
+static float FitLine(const int px[16][4], const Subset& subset, int channels, float lo[4], float hi[4])
+{
+    float mean[4] = {};
+    for (int i = 0; i < subset.count; ++i)
+        for (int c = 0; c < channels; ++c)
+            mean[c] += px[subset.index[i]][c];
+    for (int c = 0; c < channels; ++c)
+        mean[c] /= subset.count;
+
+    float cov[4][4] = {};
+    for (int i = 0; i < subset.count; ++i)
+    {
+        float d[4];
+        for (int c = 0; c < channels; ++c)
+            d[c] = px[subset.index[i]][c] - mean[c];
+        for (int a = 0; a < channels; ++a)
+            for (int b = a; b < channels; ++b)
+                cov[a][b] += d[a] * d[b];
+    }
+
+    float total = 0.0f;
+    int widest = 0;
+    for (int a = 0; a < channels; ++a)
+    {
+        total += cov[a][a];
+        for (int b = 0; b < a; ++b)
+            cov[a][b] = cov[b][a];
+        if (cov[a][a] > cov[widest][widest])
+            widest = a;
+    }
+
+    //Power iteration, starting from the channel that varies the most
+    float axis[4] = {};
+    for (int c = 0; c < channels; ++c)
+        axis[c] = cov[widest][c];
+    for (int iter = 0; iter < 6; ++iter)
+    {
+        float next[4] = {};
+        float scale = 0.0f;
+        for (int a = 0; a < channels; ++a)
+        {
+            for (int b = 0; b < channels; ++b)
+                next[a] += cov[a][b] * axis[b];
+            scale = max(scale, fabsf(next[a]));
+        }
+        if (scale < 1e-6f)
+            break;
+        for (int c = 0; c < channels; ++c)
+            axis[c] = next[c] / scale;
+    }
+
+    float length = 0.0f;
+    for (int c = 0; c < channels; ++c)
+        length += axis[c] * axis[c];
+    if (length < 1e-12f)
+    {
+        for (int c = 0; c < channels; ++c)
+            lo[c] = hi[c] = mean[c];
+        return 0.0f;
+    }
+    length = sqrtf(length);
+    for (int c = 0; c < channels; ++c)
+        axis[c] /= length;
+
+    float tMin = 0.0f, tMax = 0.0f, along = 0.0f;
+    for (int i = 0; i < subset.count; ++i)
+    {
+        float t = 0.0f;
+        for (int c = 0; c < channels; ++c)
+            t += (px[subset.index[i]][c] - mean[c]) * axis[c];
+        tMin = min(tMin, t);
+        tMax = max(tMax, t);
+        along += t * t;
+    }
+
+    for (int c = 0; c < channels; ++c)
+    {
+        lo[c] = Clamp255(mean[c] + tMin * axis[c]);
+        hi[c] = Clamp255(mean[c] + tMax * axis[c]);
+    }
+    return max(0.0f, total - along);
+}
+
+//Solves for the two endpoints that best reproduce the subset's pixels, given how much
+//of the first endpoint each pixel's index blends in
+static bool LeastSquares(const int px[16][4], const Subset& subset, int channels, const uint8_t* indices, const float* weights, float e0[4], float e1[4])
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[4] = {}, bx[4] = {};
+    for (int i = 0; i < subset.count; ++i)
+    {
+        int j = subset.index[i];
+        float a = weights[indices[j]];
+        float b = 1.0f - a;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < channels; ++c)
+        {
+            ax[c] += a * px[j][c];
+            bx[c] += b * px[j][c];
+        }
+    }
+
+    float det = aa * bb - ab * ab;
+    if (fabsf(det) < 1e-6f)
+        return false;
+
+    for (int c = 0; c < channels; ++c)
+    {
+        e0[c] = Clamp255((ax[c] * bb - bx[c] * ab) / det);
+        e1[c] = Clamp255((bx[c] * aa - ax[c] * ab) / det);
+    }
+    return true;
+}
+
+//Writes values into a block starting from its least significant bit
+struct BitWriter
+{
+    uint8_t* out;
+    int pos;
+
+    void Write(uint32_t value, int bits)
+    {
+        for (int i = 0; i < bits; ++i, ++pos)
+            out[pos >> 3] |= ((value >> i) & 1) << (pos & 7);
+    }
+};
+
+//BC1
+
+static int Expand5(int v) { return (v << 3) | (v >> 2); }
+static int Expand6(int v) { return (v << 2) | (v >> 4); }
+
+static uint16_t Quantize565(const float c[4])
+{
+    int r = min(31, static_cast<int>(c[0] * 31.0f / 255.0f + 0.5f));
+    int g = min(63, static_cast<int>(c[1] * 63.0f / 255.0f + 0.5f));
+    int b = min(31, static_cast<int>(c[2] * 31.0f / 255.0f + 0.5f));
+    return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+}
+
+//Decoded colors of a BC1 block, the fourth is transparent black in three color mode
+static void Bc1Palette(uint16_t c0, uint16_t c1, bool fourColor, int pal[4][3])
+{
+    pal[0][0] = Expand5(c0 >> 11);
+    pal[0][1] = Expand6((c0 >> 5) & 63);
+    pal[0][2] = Expand5(c0 & 31);
+    pal[1][0] = Expand5(c1 >> 11);
+    pal[1][1] = Expand6((c1 >> 5) & 63);
+    pal[1][2] = Expand5(c1 & 31);
+    for (int c = 0; c < 3; ++c)
+    {
+        if (fourColor)
+        {
+            pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+            pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+        }
+        else
+        {
+            pal[2][c] = (pal[0][c] + pal[1][c]) / 2;
+            pal[3][c] = 0;
+        }
+    }
+}
+
+static int Bc1Assign(const int px[16][4], const Subset& subset, const int pal[4][3], int entries, uint8_t* indices)
+{
+    int error = 0;
+    for (int i = 0; i < subset.count; ++i)
+    {
+        const int* p = px[subset.index[i]];
+        int best = INT_MAX;
+        for (int e = 0; e < entries; ++e)
+        {
+            int dr = p[0] - pal[e][0], dg = p[1] - pal[e][1], db = p[2] - pal[e][2];
+            int d = dr * dr + dg * dg + db * db;
+            if (d < best)
+            {
+                best = d;
+                indices[subset.index[i]] = static_cast<uint8_t>(e);
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+//Endpoint pairs that come closest to each 8 bit value in a solid block, through the
+//first interpolated color in four color mode or the midpoint in three color mode
+struct SingleColorTables
+{
+    uint8_t match5[256][2];
+    uint8_t match6[256][2];
+    uint8_t half5[256][2];
+    uint8_t half6[256][2];
+
+    SingleColorTables()
+    {
+        Build(match5, 5, true);
+        Build(match6, 6, true);
+        Build(half5, 5, false);
+        Build(half6, 6, false);
+    }
+
+    static void Build(uint8_t table[256][2], int bits, bool fourColor)
+    {
+        int count = 1 << bits;
+        for (int v = 0; v < 256; ++v)
+        {
+            int best = INT_MAX;
+            for (int a = 0; a < count; ++a)
+            {
+                for (int b = 0; b < count; ++b)
+                {
+                    int ea = bits == 5 ? Expand5(a) : Expand6(a);
+                    int eb = bits == 5 ? Expand5(b) : Expand6(b);
+                    int c = fourColor ? (2 * ea + eb) / 3 : (ea + eb) / 2;
+
+                    //Prefer endpoints close together, they hold up better to decoder rounding
+                    int error = abs(c - v) * 1024 + abs(ea - eb);
+                    if (error < best)
+                    {
+                        best = error;
+                        table[v][0] = static_cast<uint8_t>(a);
+                        table[v][1] = static_cast<uint8_t>(b);
+                    }
+                }
+            }
+        }
+    }
+};
+
+struct Bc1Fit
+{
+    uint16_t c0;
+    uint16_t c1;
+    uint8_t indices[16];
+    int error;
+};
+
+static void Bc1FitColors(const int px[16][4], const Subset& subset, bool fourColor, Bc1Fit& best)
+{
+    int entries = fourColor ? 4 : 3;
+    int pal[4][3];
+
+    bool solid = true;
+    const int* first = px[subset.index[0]];
+    for (int i = 1; i < subset.count && solid; ++i)
+    {
+        const int* p = px[subset.index[i]];
+        solid = p[0] == first[0] && p[1] == first[1] && p[2] == first[2];
+    }
+
+    if (solid)
+    {
+        static const SingleColorTables tables;
+        const uint8_t (*m5)[2] = fourColor ? tables.match5 : tables.half5;
+        const uint8_t (*m6)[2] = fourColor ? tables.match6 : tables.half6;
+        best.c0 = static_cast<uint16_t>((m5[first[0]][0] << 11) | (m6[first[1]][0] << 5) | m5[first[2]][0]);
+        best.c1 = static_cast<uint16_t>((m5[first[0]][1] << 11) | (m6[first[1]][1] << 5) | m5[first[2]][1]);
+        Bc1Palette(best.c0, best.c1, fourColor, pal);
+        best.error = Bc1Assign(px, subset, pal, entries, best.indices);
+        return;
+    }
+
+    static const float weights4[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+    static const float weights3[3] = { 1.0f, 0.0f, 0.5f };
+
+    float lo[4], hi[4];
+    FitLine(px, subset, 3, lo, hi);
+
+    best.error = INT_MAX;
+    for (int iter = 0; iter < 3; ++iter)
+    {
+        Bc1Fit trial;
+        trial.c0 = Quantize565(hi);
+        trial.c1 = Quantize565(lo);
+        Bc1Palette(trial.c0, trial.c1, fourColor, pal);
+        trial.error = Bc1Assign(px, subset, pal, entries, trial.indices);
+
+        if (trial.error < best.error)
+            best = trial;
+        if (best.error == 0 || !LeastSquares(px, subset, 3, trial.indices, fourColor ? weights4 : weights3, hi, lo))
+            break;
+    }
+}
+
+static void Bc1Block(uint8_t* out, const int px[16][4], bool alpha)
+{
+    Subset opaque;
+    opaque.count = 0;
+    for (int i = 0; i < 16; ++i)
+        if (!alpha || px[i][3] >= 128)
+            opaque.index[opaque.count++] = i;
+
+    bool fourColor = opaque.count == 16;
+    uint8_t indices[16];
+    uint16_t c0 = 0, c1 = 0;
+    memset(indices, 3, sizeof(indices));
+
+    if (opaque.count > 0)
+    {
+        Bc1Fit fit;
+        Bc1FitColors(px, opaque, fourColor, fit);
+        c0 = fit.c0;
+        c1 = fit.c1;
+        for (int i = 0; i < opaque.count; ++i)
+            indices[opaque.index[i]] = fit.indices[opaque.index[i]];
+    }
+
+    //The endpoint order is what tells decoders which mode the block uses
+    if (fourColor)
+    {
+        if (c0 < c1)
+        {
+            swap(c0, c1);
+            for (int i = 0; i < 16; ++i)
+                indices[i] ^= 1;
+        }
+        else if (c0 == c1)
+            memset(indices, 0, sizeof(indices));
+    }
+    else if (c0 > c1)
+    {
+        swap(c0, c1);
+        for (int i = 0; i < 16; ++i)
+            if (indices[i] < 2)
+                indices[i] ^= 1;
+    }
+
+    uint32_t bits = 0;
+    for (int i = 0; i < 16; ++i)
+        bits |= static_cast<uint32_t>(indices[i]) << (i * 2);
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    for (int i = 0; i < 4; ++i)
+        out[4 + i] = (bits >> (i * 8)) & 0xff;
+}
+
+void EncodeBC1(uint8_t* out, const uint32_t* pixels, bool alpha)
+{
+    int px[16][4];
+    Unpack(pixels, px);
+    Bc1Block(out, px, alpha);
+}
+
+//BC3
+
+static int AlphaAssign(const int px[16][4], const int pal[8], uint8_t* indices)
+{
+    int error = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int best = INT_MAX;
+        for (int e = 0; e < 8; ++e)
+        {
+            int d = abs(px[i][3] - pal[e]);
+            if (d < best)
+            {
+                best = d;
+                indices[i] = static_cast<uint8_t>(e);
+            }
+        }
+        error += best * best;
+    }
+    return error;
+}
+
+static void AlphaBlock(uint8_t* out, const int px[16][4])
+{
+    int lo = 255, hi = 0, innerLo = 255, innerHi = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int a = px[i][3];
+        lo = min(lo, a);
+        hi = max(hi, a);
+        if (a != 0 && a != 255)
+        {
+            innerLo = min(innerLo, a);
+            innerHi = max(innerHi, a);
+        }
+    }
+
+    memset(out, 0, 8);
+    if (lo == hi)
+    {
+        out[0] = out[1] = static_cast<uint8_t>(lo);
+        return;
+    }
+
+    //Try both eight interpolated values and six with explicit 0 and 255
+    int pal[8];
+    uint8_t indices[16], bestIndices[16];
+    int bestError = INT_MAX;
+    int a0 = 0, a1 = 0;
+
+    pal[0] = hi;
+    pal[1] = lo;
+    for (int i = 2; i < 8; ++i)
+        pal[i] = ((8 - i) * hi + (i - 1) * lo) / 7;
+    bestError = AlphaAssign(px, pal, bestIndices);
+    a0 = hi;
+    a1 = lo;
+
+    if (innerLo > innerHi)
+        innerLo = innerHi = lo;
+    pal[0] = innerLo;
+    pal[1] = innerHi;
+    for (int i = 2; i < 6; ++i)
+        pal[i] = ((6 - i) * innerLo + (i - 1) * innerHi) / 5;
+    pal[6] = 0;
+    pal[7] = 255;
+    int error = AlphaAssign(px, pal, indices);
+    if (error < bestError)
+    {
+        memcpy(bestIndices, indices, sizeof(indices));
+        a0 = innerLo;
+        a1 = innerHi;
+    }
+
+    uint64_t bits = 0;
+    for (int i = 0; i < 16; ++i)
+        bits |= static_cast<uint64_t>(bestIndices[i]) << (i * 3);
+
+    out[0] = static_cast<uint8_t>(a0);
+    out[1] = static_cast<uint8_t>(a1);
+    for (int i = 0; i < 6; ++i)
+        out[2 + i] = (bits >> (i * 8)) & 0xff;
+}
+
+void EncodeBC3(uint8_t* out, const uint32_t* pixels)
+{
+    int px[16][4];
+    Unpack(pixels, px);
+    AlphaBlock(out, px);
+    Bc1Block(out + 8, px, false);
+}
+
+//BC7
+
+static const int bc7Weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+static const int bc7Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+//Two subset partitions, bit i is set if pixel i belongs to the second subset
+static const uint16_t bc7Partitions2[64] =
+{
+    0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80, 0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8, 0xff00, 0xfff0, 0xf000,
+    0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce, 0x088c, 0x3110, 0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c,
+    0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696, 0xa55a, 0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660,
+    0x0272, 0x04e4, 0x4e40, 0x2720, 0xc936, 0x936c, 0x39c6, 0x639c, 0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22
+};
+
+//The pixel of the second subset whose index is stored without its top bit
+static const uint8_t bc7Anchors2[64] =
+{
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+    15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+     6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15
+};
+
+struct Bc7Mode
+{
+    int channels;       //3 when alpha is always opaque
+    int colorBits;      //endpoint bits per channel, not counting the p-bit
+    bool sharedPBit;    //one p-bit per subset instead of one per endpoint
+    int indexBits;
+};
+
+static const Bc7Mode bc7Mode1 = { 3, 6, true, 3 };
+static const Bc7Mode bc7Mode6 = { 4, 7, false, 4 };
+
+struct Bc7Fit
+{
+    int q[2][4];
+    int p[2];
+    uint8_t indices[16];
+    int error;
+};
+
+static int Bc7Unquantize(int q, int p, int bits)
+{
+    int v = ((q << 1) | p) << (7 - bits);
+    return v | (v >> (bits + 1));
+}
+
+static int Bc7Assign(const int px[16][4], const Subset& subset, const Bc7Mode& mode, Bc7Fit& fit)
+{
+    const int* weights = mode.indexBits == 3 ? bc7Weights3 : bc7Weights4;
+    int entries = 1 << mode.indexBits;
+
+    int e[2][4];
+    for (int j = 0; j < 2; ++j)
+        for (int c = 0; c < 4; ++c)
+            e[j][c] = c < mode.channels ? Bc7Unquantize(fit.q[j][c], fit.p[j], mode.colorBits) : 255;
+
+    int pal[16][4];
+    for (int i = 0; i < entries; ++i)
+        for (int c = 0; c < 4; ++c)
+            pal[i][c] = ((64 - weights[i]) * e[0][c] + weights[i] * e[1][c] + 32) >> 6;
+
+    fit.error = 0;
+    for (int i = 0; i < subset.count; ++i)
+    {
+        const int* p = px[subset.index[i]];
+        int best = INT_MAX;
+        for (int k = 0; k < entries; ++k)
+        {
+            int d = 0;
+            for (int c = 0; c < 4; ++c)
+                d += (p[c] - pal[k][c]) * (p[c] - pal[k][c]);
+            if (d < best)
+            {
+                best = d;
+                fit.indices[subset.index[i]] = static_cast<uint8_t>(k);
+            }
+        }
+        fit.error += best;
+    }
+    return fit.error;
+}
+
+//Quantizes the endpoints for each combination of p-bits and keeps the best
+static void Bc7Quantize(const int px[16][4], const Subset& subset, const Bc7Mode& mode, const float e[2][4], Bc7Fit& best)
+{
+    int maxQ = (1 << mode.colorBits) - 1;
+    float scale = static_cast<float>((2 << mode.colorBits) - 1) / 255.0f;
+
+    //Opaque pixels need both p-bits set to keep alpha at exactly 255
+    bool opaque = mode.channels == 4;
+    for (int i = 0; i < subset.count && opaque; ++i)
+        opaque = px[subset.index[i]][3] == 255;
+
+    best.error = INT_MAX;
+    for (int pb = opaque ? 3 : 0; pb < (mode.sharedPBit ? 2 : 4); ++pb)
+    {
+        Bc7Fit trial;
+        trial.p[0] = pb & 1;
+        trial.p[1] = mode.sharedPBit ? pb & 1 : pb >> 1;
+
+        for (int j = 0; j < 2; ++j)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                trial.q[j][c] = 0;
+                if (c >= mode.channels)
+                    continue;
+
+                //Round without the p-bit, then check the neighbours once it's added back
+                int q = static_cast<int>((e[j][c] * scale - trial.p[j]) * 0.5f + 0.5f);
+                int bestDiff = INT_MAX;
+                for (int k = max(0, q - 1); k <= min(maxQ, q + 1); ++k)
+                {
+                    int diff = abs(Bc7Unquantize(k, trial.p[j], mode.colorBits) - static_cast<int>(e[j][c] + 0.5f));
+                    if (diff < bestDiff)
+                    {
+                        bestDiff = diff;
+                        trial.q[j][c] = k;
+                    }
+                }
+            }
+        }
+
+        if (Bc7Assign(px, subset, mode, trial) < best.error)
+            best = trial;
+    }
+}
+
+static void Bc7FitSubset(const int px[16][4], const Subset& subset, const Bc7Mode& mode, Bc7Fit& best)
+{
+    const int* weights = mode.indexBits == 3 ? bc7Weights3 : bc7Weights4;
+    float blend[16];
+    for (int i = 0; i < (1 << mode.indexBits); ++i)
+        blend[i] = 1.0f - weights[i] / 64.0f;
+
+    float e[2][4];
+    FitLine(px, subset, mode.channels, e[0], e[1]);
+
+    best.error = INT_MAX;
+    for (int iter = 0; iter < 3; ++iter)
+    {
+        Bc7Fit trial;
+        Bc7Quantize(px, subset, mode, e, trial);
+
+        if (trial.error < best.error)
+            best = trial;
+        if (best.error == 0 || !LeastSquares(px, subset, mode.channels, trial.indices, blend, e[0], e[1]))
+            break;
+    }
+}
+
+//The anchor pixel of each subset has its index stored without the top bit, so swap the
+//endpoints if that bit would be set
+static void Bc7FixAnchor(Bc7Fit& fit, const Subset& subset, int anchor, int indexBits)
+{
+    int last = (1 << indexBits) - 1;
+    if (fit.indices[anchor] <= last >> 1)
+        return;
+
+    for (int c = 0; c < 4; ++c)
+        swap(fit.q[0][c], fit.q[1][c]);
+    swap(fit.p[0], fit.p[1]);
+    for (int i = 0; i < subset.count; ++i)
+        fit.indices[subset.index[i]] = static_cast<uint8_t>(last - fit.indices[subset.index[i]]);
+}
+
+static void Bc7Partition(int partition, Subset subsets[2])
+{
+    subsets[0].count = 0;
+    subsets[1].count = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        Subset& s = subsets[(bc7Partitions2[partition] >> i) & 1];
+        s.index[s.count++] = i;
+    }
+}
+
+void EncodeBC7(uint8_t* out, const uint32_t* pixels)
+{
+    int px[16][4];
+    Unpack(pixels, px);
+
+    Subset all;
+    all.count = 16;
+    for (int i = 0; i < 16; ++i)
+        all.index[i] = i;
+
+    Bc7Fit single;
+    Bc7FitSubset(px, all, bc7Mode6, single);
+
+    bool opaque = true;
+    for (int i = 0; i < 16 && opaque; ++i)
+        opaque = px[i][3] == 255;
+
+    //Opaque blocks mixing two gradients can do better split into two subsets. Rank the
+    //partitions by how well a line fits each half and only encode the most promising.
+    int bestPartition = -1;
+    Bc7Fit pair[2];
+    if (opaque && single.error > 16 * 8)
+    {
+        float scores[64];
+        int order[64];
+        for (int p = 0; p < 64; ++p)
+        {
+            Subset subsets[2];
+            float lo[4], hi[4];
+            Bc7Partition(p, subsets);
+            scores[p] = FitLine(px, subsets[0], 3, lo, hi) + FitLine(px, subsets[1], 3, lo, hi);
+            order[p] = p;
+        }
+        partial_sort(order, order + 4, order + 64, [&](int a, int b) { return scores[a] < scores[b]; });
+
+        int bestError = single.error;
+        for (int k = 0; k < 4; ++k)
+        {
+            Subset subsets[2];
+            Bc7Fit fits[2];
+            Bc7Partition(order[k], subsets);
+            Bc7FitSubset(px, subsets[0], bc7Mode1, fits[0]);
+            Bc7FitSubset(px, subsets[1], bc7Mode1, fits[1]);
+
+            if (fits[0].error + fits[1].error < bestError)
+            {
+                bestError = fits[0].error + fits[1].error;
+                bestPartition = order[k];
+                pair[0] = fits[0];
+                pair[1] = fits[1];
+            }
+        }
+    }
+
+    memset(out, 0, 16);
+    BitWriter writer = { out, 0 };
+
+    if (bestPartition < 0)
+    {
+        Bc7FixAnchor(single, all, 0, 4);
+
+        writer.Write(1 << 6, 7);
+        for (int c = 0; c < 4; ++c)
+            for (int j = 0; j < 2; ++j)
+                writer.Write(single.q[j][c], 7);
+        writer.Write(single.p[0], 1);
+        writer.Write(single.p[1], 1);
+        for (int i = 0; i < 16; ++i)
+            writer.Write(single.indices[i], i == 0 ? 3 : 4);
+    }
+    else
+    {
+        Subset subsets[2];
+        int anchor = bc7Anchors2[bestPartition];
+        Bc7Partition(bestPartition, subsets);
+        Bc7FixAnchor(pair[0], subsets[0], 0, 3);
+        Bc7FixAnchor(pair[1], subsets[1], anchor, 3);
+
+        writer.Write(1 << 1, 2);
+        writer.Write(bestPartition, 6);
+        for (int c = 0; c < 3; ++c)
+            for (int s = 0; s < 2; ++s)
+                for (int j = 0; j < 2; ++j)
+                    writer.Write(pair[s].q[j][c], 6);
+        writer.Write(pair[0].p[0], 1);
+        writer.Write(pair[1].p[0], 1);
+        for (int i = 0; i < 16; ++i)
+        {
+            int s = (bc7Partitions2[bestPartition] >> i) & 1;
+            writer.Write(pair[s].indices[i], i == 0 || i == anchor ? 2 : 3);
+        }
+    }
+}
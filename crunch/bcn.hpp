@@ -0,0 +1,19 @@
+#ifndef bcn_hpp
+#define bcn_hpp
+
+#include <cstdint>
+
+// Block compressors for a single 4x4 block. Pixels are 16 packed RGBA values in row
+// order (the same layout as Bitmap::data), out receives the encoded block.
+
+// 8 byte BC1 block. With alpha set, blocks holding pixels under half alpha use the
+// three color mode and make those pixels fully transparent.
+void EncodeBC1(uint8_t* out, const uint32_t* pixels, bool alpha);
+
+// 16 byte BC3 block: BC1 style colors with an interpolated alpha block
+void EncodeBC3(uint8_t* out, const uint32_t* pixels);
+
+// 16 byte BC7 block using mode 6, or mode 1 for opaque blocks it fits better
+void EncodeBC7(uint8_t* out, const uint32_t* pixels);
+
+#endif
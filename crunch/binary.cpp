@@ -92,6 +92,18 @@ void WriteShort(ofstream& bin, int16_t value)
     bin.put(static_cast<uint8_t>((value >> 8) & 0xff));
 }
 
+void WriteInt(ofstream& bin, int32_t value)
+{
+    WriteShort(bin, static_cast<int16_t>(value & 0xffff));
+    WriteShort(bin, static_cast<int16_t>((value >> 16) & 0xffff));
+}
+
+void WriteLong(ofstream& bin, int64_t value)
+{
+    WriteInt(bin, static_cast<int32_t>(value & 0xffffffff));
+    WriteInt(bin, static_cast<int32_t>((value >> 32) & 0xffffffff));
+}
+
 void WriteByte(ofstream& bin, char value)
 {
     bin.write(&value, 1);
@@ -40,6 +40,8 @@ void WriteStringPrefixed(ofstream &bin, const string &value);
 void WriteString7BitPrefixed(ofstream &bin, const string &value);
 void WriteStringFixedLength(ofstream& bin, const string& value, int length);
 void WriteShort(ofstream &bin, int16_t value);
+void WriteInt(ofstream &bin, int32_t value);
+void WriteLong(ofstream &bin, int64_t value);
 void WriteByte(ofstream &bin, char value);
 string ReadString(ifstream &bin);
 int16_t ReadShort(ifstream &bin);
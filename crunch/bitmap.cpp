@@ -29,13 +29,191 @@
 #define LODEPNG_NO_COMPILE_CPP
 #include "lodepng.h"
 #include <algorithm>
+#include <iterator>
 #include "hash.hpp"
 #include "time.hpp"
+#include "deflate.hpp"
+#include "inflate.hpp"
+#include "simd.hpp"
+#include "arena.hpp"
 
 using namespace std;
 
-Bitmap::Bitmap(const string& file, const string& name, bool premultiply, bool trim, bool verbose)
-    : frameIndex(0), name(name), label(""), loopDirection(0), duration(0), palette(nullptr), paletteSize(0), paletteSlot(0)
+ColorStats::ColorStats()
+    : alpha(false), transparent(false), keyColor(0), opaqueBlack(false), complete(true)
+{
+}
+
+void ColorStats::Add(const uint32_t* pixels, size_t count)
+{
+    Add(pixels, static_cast<int>(count), 1, count);
+}
+
+//Rows are stride pixels apart, so trimmed views can be gathered without a copy
+void ColorStats::Add(const uint32_t* pixels, int width, int height, size_t stride)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    ColorStats stats;
+
+    //Open addressing set of the distinct colors, only needs to hold one more than a palette
+    uint32_t table[512];
+    bool used[512] = {};
+
+    uint32_t last = ~pixels[0];
+    bool done = false;
+    for (int y = 0; y < height && !done; ++y)
+    {
+        const uint32_t* row = pixels + y * stride;
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t c = row[x];
+
+            //Runs of the same color can't tell us anything new
+            if (c == last)
+                continue;
+            last = c;
+
+            uint32_t a = c >> 24;
+            if (a == 0)
+            {
+                if (!stats.transparent)
+                {
+                    stats.transparent = true;
+                    stats.keyColor = c;
+                }
+                else if (c != stats.keyColor)
+                    stats.alpha = true;
+            }
+            else if (a != 255)
+                stats.alpha = true;
+            else if (c == 0xff000000)
+                stats.opaqueBlack = true;
+
+            if (stats.complete)
+            {
+                size_t slot = (c * 0x9e3779b1u) >> 23;
+                while (used[slot] && table[slot] != c)
+                    slot = (slot + 1) & 511;
+
+                if (!used[slot])
+                {
+                    used[slot] = true;
+                    table[slot] = c;
+                    stats.colors.push_back(c);
+
+                    if (stats.colors.size() > 256)
+                    {
+                        stats.complete = false;
+                        stats.colors.clear();
+                    }
+                }
+            }
+            else if (stats.alpha)
+            {
+                done = true;
+                break;
+            }
+        }
+    }
+
+    //A color key only works if no opaque pixel has the same rgb
+    if (stats.transparent && !stats.alpha)
+    {
+        uint32_t opaqueKey = stats.keyColor | 0xff000000;
+        if (stats.complete)
+            stats.alpha = find(stats.colors.begin(), stats.colors.end(), opaqueKey) != stats.colors.end();
+        else
+        {
+            for (int y = 0; y < height && !stats.alpha; ++y)
+                stats.alpha = find(pixels + y * stride, pixels + y * stride + width, opaqueKey) != pixels + y * stride + width;
+        }
+    }
+
+    sort(stats.colors.begin(), stats.colors.end());
+    Merge(stats);
+}
+
+void ColorStats::Merge(const ColorStats& other)
+{
+    //If only one side has a color key, the other side's opaque pixels must not use it
+    if (transparent != other.transparent)
+    {
+        const ColorStats& keyed = transparent ? *this : other;
+        const ColorStats& opaque = transparent ? other : *this;
+        if (keyed.keyColor == 0 ? opaque.opaqueBlack : (!opaque.complete || binary_search(opaque.colors.begin(), opaque.colors.end(), keyed.keyColor | 0xff000000)))
+            alpha = true;
+    }
+    else if (transparent && keyColor != other.keyColor)
+        alpha = true;
+
+    alpha = alpha || other.alpha;
+    opaqueBlack = opaqueBlack || other.opaqueBlack;
+    if (!transparent && other.transparent)
+    {
+        transparent = true;
+        keyColor = other.keyColor;
+    }
+
+    //Colors are kept sorted so merging is a single pass
+    if (complete && other.complete)
+    {
+        vector<uint32_t> merged;
+        merged.reserve(colors.size() + other.colors.size());
+        set_union(colors.begin(), colors.end(), other.colors.begin(), other.colors.end(), back_inserter(merged));
+        colors.swap(merged);
+    }
+    if (!complete || !other.complete || colors.size() > 256)
+    {
+        complete = false;
+        colors.clear();
+    }
+}
+
+//Makes the same choice as lodepng's auto_choose_color would (greyscale modes are
+//disabled in our copy of lodepng), so the encoder can skip its own analysis
+void ColorStats::ChooseMode(LodePNGColorMode* mode, size_t pixelCount) const
+{
+    bool key = transparent && !alpha;
+    bool needAlpha = alpha;
+
+    //Too few pixels to justify a tRNS chunk
+    if (key && pixelCount <= 16)
+    {
+        key = false;
+        needAlpha = true;
+    }
+
+    size_t n = colors.size();
+    bool paletteOk = complete && n != 0 && pixelCount >= n * 2;
+
+    lodepng_palette_clear(mode);
+    mode->key_defined = 0;
+    if (paletteOk)
+    {
+        for (uint32_t c : colors)
+            lodepng_palette_add(mode, c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff, c >> 24);
+
+        mode->colortype = LCT_PALETTE;
+        mode->bitdepth = n <= 2 ? 1 : (n <= 4 ? 2 : (n <= 16 ? 4 : 8));
+    }
+    else
+    {
+        mode->colortype = needAlpha ? LCT_RGBA : LCT_RGB;
+        mode->bitdepth = 8;
+        if (key)
+        {
+            mode->key_defined = 1;
+            mode->key_r = keyColor & 0xff;
+            mode->key_g = (keyColor >> 8) & 0xff;
+            mode->key_b = (keyColor >> 16) & 0xff;
+        }
+    }
+}
+
+Bitmap::Bitmap(const string& file, Interned name, bool premultiply, int maskChannel, bool trim, bool verbose)
+    : frameIndex(0), name(name), loopDirection(0), duration(0), palette(nullptr), paletteSize(0), paletteSlot(0), bitDepth(8), mask(false), channel(0), transform(0), decoded(nullptr), pitch(0), spillOffset(-1)
 {
     LodePNGState state;
     unsigned char* png = NULL;
@@ -51,27 +229,28 @@ Bitmap::Bitmap(const string& file, const string& name, bool premultiply, bool tr
         ::exit(EXIT_FAILURE);
     }
 
-    if (!DecodePng(&state, png, size, premultiply, trim, verbose))
+    if (!DecodePng(&state, png, size, premultiply, maskChannel, trim, verbose))
     {
         cerr << "failed to load png: " << file << endl;
         ::exit(EXIT_FAILURE);
     }
 
+    ArenaFree(png);
     lodepng_state_cleanup(&state);
 }
 
-Bitmap::Bitmap(int frameIndex, const string& name, const string& label, int loopDirection, int duration, LodePNGState* state, unsigned char* png, size_t size, bool premultiply, bool trim, bool verbose)
-    : frameIndex(frameIndex), name(name), label(label), loopDirection(loopDirection), duration(duration), palette(nullptr), paletteSize(0), paletteSlot(0)
+Bitmap::Bitmap(int frameIndex, Interned name, Interned label, int loopDirection, int duration, LodePNGState* state, unsigned char* png, size_t size, bool premultiply, int maskChannel, bool trim, bool verbose)
+    : frameIndex(frameIndex), name(name), label(label), loopDirection(loopDirection), duration(duration), palette(nullptr), paletteSize(0), paletteSlot(0), bitDepth(8), mask(false), channel(0), transform(0), decoded(nullptr), pitch(0), spillOffset(-1)
 {
-    if (!DecodePng(state, png, size, premultiply, trim, verbose))
+    if (!DecodePng(state, png, size, premultiply, maskChannel, trim, verbose))
     {
 		cerr << "failed to load png: " << name << endl;
 		::exit(EXIT_FAILURE);
 	}
 }
 
-Bitmap::Bitmap(int width, int height, uint32_t * palette, int paletteSize)
-    : frameIndex(0), name(""), label(""), loopDirection(0), duration(0), width(width), height(height), palette(nullptr), paletteSize(paletteSize), paletteSlot(0)
+Bitmap::Bitmap(int width, int height, uint32_t * palette, int paletteSize, int bitDepth, bool mask)
+    : frameIndex(0), loopDirection(0), duration(0), width(width), height(height), palette(nullptr), paletteSize(paletteSize), paletteSlot(0), bitDepth(bitDepth), mask(mask), channel(0), transform(0), decoded(nullptr), pitch(0), spillOffset(-1)
 {
     if (this->paletteSize > 0)
     {
@@ -87,19 +266,198 @@ Bitmap::Bitmap(int width, int height, uint32_t * palette, int paletteSize)
             exit(EXIT_FAILURE);
         }
 
-        data = reinterpret_cast<uint8_t*>(calloc(width * height, sizeof(uint8_t)));
+        data = reinterpret_cast<uint8_t*>(calloc(Stride() * height, sizeof(uint8_t)));
     }
+    else if (mask)
+        data = reinterpret_cast<uint8_t*>(calloc(width * height, sizeof(uint8_t)));
     else
         data = reinterpret_cast<uint8_t*>(calloc(width * height, sizeof(uint32_t)));
 }
 
-bool Bitmap::DecodePng(LodePNGState *state, unsigned char* png, size_t size, bool premultiply, bool trim, bool verbose)
+//A sprite known only by its size, so pages can be laid out without decoding anything
+Bitmap::Bitmap(Interned name, int frameIndex, int width, int height)
+    : frameIndex(frameIndex), name(name), loopDirection(0), duration(0), width(width), height(height), frameX(0), frameY(0), frameW(width), frameH(height), data(nullptr), palette(nullptr), hashValue(0), paletteSize(0), paletteSlot(0), bitDepth(8), mask(false), channel(0), transform(0), decoded(nullptr), pitch(0), spillOffset(-1)
+{
+}
+
+size_t Bitmap::Stride() const
+{
+    return pitch ? pitch : RowBytes();
+}
+
+//Bytes the pixels of a row take, without the rest of a view's decoded row
+size_t Bitmap::RowBytes() const
+{
+    if (paletteSize > 0)
+        return bitDepth == 4 ? (width + 1) / 2 : width;
+    return mask ? width : static_cast<size_t>(width) * 4;
+}
+
+//Memory the pixels hold, all of the decoded image for a view
+size_t Bitmap::PixelBytes() const
+{
+    if (!data)
+        return 0;
+    return decoded ? pitch * frameH : RowBytes() * height;
+}
+
+void Bitmap::FreePixels()
+{
+    free(decoded ? decoded : data);
+    data = nullptr;
+    decoded = nullptr;
+    pitch = 0;
+}
+
+//A view's rows copied next to each other
+static uint8_t* PackRows(const uint8_t* data, size_t pitch, size_t rowBytes, int height)
+{
+    uint8_t* pixels = reinterpret_cast<uint8_t*>(malloc(rowBytes * height));
+    for (int y = 0; y < height; ++y)
+        memcpy(pixels + y * rowBytes, data + y * pitch, rowBytes);
+    return pixels;
+}
+
+//Views using less than half of their decoded image get their own copy of their pixels,
+//so the rest of it can be freed
+void Bitmap::Compact()
+{
+    if (!decoded || RowBytes() * height * 2 >= pitch * frameH)
+        return;
+
+    uint8_t* pixels = PackRows(data, pitch, RowBytes(), height);
+    free(decoded);
+    data = pixels;
+    decoded = nullptr;
+    pitch = 0;
+}
+
+//The loader's arena is rewound once the sprite is decoded, so the pixels kept move to the
+//heap first. Views Compact would copy out anyway are compacted on the way.
+void Bitmap::LeaveArena()
+{
+    if (decoded && RowBytes() * height * 2 < pitch * frameH)
+    {
+        data = PackRows(data, pitch, RowBytes(), height);
+        decoded = nullptr;
+        pitch = 0;
+        return;
+    }
+
+    uint8_t* base = decoded ? decoded : data;
+    uint8_t* pixels = reinterpret_cast<uint8_t*>(malloc(PixelBytes()));
+    memcpy(pixels, base, PixelBytes());
+    data = pixels + (data - base);
+    if (decoded)
+        decoded = pixels;
+}
+
+static bool premultiplyRounded = false;
+
+void SetPremultiplyRounding(bool rounded)
+{
+    premultiplyRounded = rounded;
+}
+
+//Visibility tests for the pixels of a row, picked at compile time so the trim scan has
+//no per pixel branching on the format. First returns the first visible pixel in
+//[from, to) or to, Last the last one or from - 1.
+struct RgbaPixels
+{
+    static int First(const uint8_t* row, int from, int to)
+    {
+        return from + static_cast<int>(FindVisible(reinterpret_cast<const uint32_t*>(row) + from, to - from));
+    }
+    static int Last(const uint8_t* row, int from, int to)
+    {
+        const uint32_t* pixels = reinterpret_cast<const uint32_t*>(row);
+        while (to > from && !(pixels[to - 1] >> 24))
+            --to;
+        return to - 1;
+    }
+};
+
+struct BytePixels
+{
+    static int First(const uint8_t* row, int from, int to)
+    {
+        return from + static_cast<int>(FindNonZero(row + from, to - from));
+    }
+    static int Last(const uint8_t* row, int from, int to)
+    {
+        while (to > from && !row[to - 1])
+            --to;
+        return to - 1;
+    }
+};
+
+struct NibblePixels
+{
+    static bool Visible(const uint8_t* row, int x)
+    {
+        return ((row[x >> 1] >> ((x & 1) ? 0 : 4)) & 0x0f) != 0;
+    }
+    static int First(const uint8_t* row, int from, int to)
+    {
+        while (from < to && !Visible(row, from))
+            ++from;
+        return from;
+    }
+    static int Last(const uint8_t* row, int from, int to)
+    {
+        while (to > from && !Visible(row, to - 1))
+            --to;
+        return to - 1;
+    }
+};
+
+//Finds the bounds of the visible pixels working in from the edges: rows from the top
+//and bottom, then each row in between only as far as the bounds found so far, so an
+//opaque sprite stops after a handful of pixels. Returns false, leaving the bounds at
+//the whole bitmap, if nothing is visible.
+template <typename Pixels>
+static bool FindBounds(const uint8_t* pixels, size_t stride, int w, int h, int& minX, int& minY, int& maxX, int& maxY)
+{
+    int top = 0;
+    while (top < h && Pixels::First(pixels + top * stride, 0, w) == w)
+        ++top;
+    if (top == h)
+        return false;
+
+    int bottom = h - 1;
+    while (Pixels::First(pixels + bottom * stride, 0, w) == w)
+        --bottom;
+
+    int left = w;
+    int right = -1;
+    for (int y = top; y <= bottom && (left > 0 || right < w - 1); ++y)
+    {
+        const uint8_t* row = pixels + y * stride;
+        left = Pixels::First(row, 0, left);
+        right = max(right, Pixels::Last(row, max(right + 1, left), w));
+    }
+
+    minX = left;
+    minY = top;
+    maxX = right;
+    maxY = bottom;
+    return true;
+}
+
+bool Bitmap::DecodePng(LodePNGState *state, unsigned char* png, size_t size, bool premultiply, int maskChannel, bool trim, bool verbose)
 {
     unsigned char* buffer;
     unsigned int pw, ph;
     int result;
 
+    //Size the inflate buffer from the header so it never has to grow
+    size_t expected = 0;
+    if (!lodepng_inspect(&pw, &ph, state, png, size) && state->info_png.interlace_method == 0)
+        expected = ph * (1 + (static_cast<size_t>(pw) * lodepng_get_bpp(&state->info_png.color) + 7) / 8);
+    UseInflate(state->decoder.zlibsettings, &expected);
+
     result = lodepng_decode(&buffer, &pw, &ph, state, png, size);
+    state->decoder.zlibsettings.custom_context = nullptr;
 
     if (result)
     {
@@ -120,85 +478,115 @@ bool Bitmap::DecodePng(LodePNGState *state, unsigned char* png, size_t size, boo
 
         memcpy(palette, color->palette, paletteSize * sizeof(uint32_t));
 
-        if (color->bitdepth == 4)
-        {
-            LodePNGColorMode mode = lodepng_color_mode_make(LCT_PALETTE, 8);
-            mode.palettesize = paletteSize;
-            mode.palette = color->palette;
-
-            int bpp = lodepng_get_bpp(&mode);
-            data = reinterpret_cast<uint8_t*>(calloc((w * h * bpp + 7) / 8, sizeof(uint8_t)));
+        //Pixels that fit in 4 bits stay packed two to a byte, with each row padded out to a
+        //whole byte. Lodepng leaves low bit depth rows unpadded.
+        size_t stride = (w + 1) / 2;
+        unsigned bits = color->bitdepth;
+        bool narrow = bits < 8;
+        if (!narrow)
+            narrow = all_of(buffer, buffer + static_cast<size_t>(w) * h, [](uint8_t index) { return index < 16; });
 
-            lodepng_convert(data, buffer, &mode, &state->info_raw, w, h);
+        if (narrow)
+        {
+            uint8_t* packed = reinterpret_cast<uint8_t*>(ArenaAllocate(stride * h));
+            memset(packed, 0, stride * h);
+            vector<uint8_t> line(w);
+            for (int y = 0; y < h; ++y)
+            {
+                uint8_t* row = packed + y * stride;
+                if (bits == 4)
+                    CopyNibbles(row, 0, buffer, static_cast<size_t>(y) * w, w);
+                else if (bits == 8)
+                    PackNibbles(row, buffer + static_cast<size_t>(y) * w, w);
+                else
+                {
+                    //1 and 2 bit pixels are widened to 4
+                    size_t bit = static_cast<size_t>(y) * w * bits;
+                    for (int x = 0; x < w; ++x, bit += bits)
+                        line[x] = (buffer[bit >> 3] >> (8 - bits - (bit & 7))) & ((1 << bits) - 1);
+                    PackNibbles(row, line.data(), w);
+                }
+            }
 
-            free(buffer);
-            buffer = data;
+            ArenaFree(buffer);
+            buffer = packed;
+            bitDepth = 4;
         }
-
-        free(png);
     }
     else
     {
         //Premultiply all the pixels by their alpha
         if (premultiply)
-        {
-            int count = w * h;
-            uint32_t c, a, r, g, b;
-            float m;
-            for (int i = 0; i < count; ++i)
-            {
-                c = reinterpret_cast<uint32_t*>(buffer)[i];
-                a = c >> 24;
-                m = static_cast<float>(a) / 255.0f;
-                r = static_cast<uint32_t>((c & 0xff) * m);
-                g = static_cast<uint32_t>(((c >> 8) & 0xff) * m);
-                b = static_cast<uint32_t>(((c >> 16) & 0xff) * m);
-                reinterpret_cast<uint32_t*>(buffer)[i] = (a << 24) | (b << 16) | (g << 8) | r;
-            }
-        }
+            Premultiply(reinterpret_cast<uint32_t*>(buffer), static_cast<size_t>(w) * h, premultiplyRounded);
     }
 
-    //TODO: skip if all corners contain opaque pixels?
-
-    //Get pixel bounds
-    int minX = w - 1;
-    int minY = h - 1;
-    int maxX = 0;
-    int maxY = 0;
-    if (trim)
+    //Masks keep a single channel, so they take a byte per pixel like indexed bitmaps do
+    if (maskChannel >= 0)
     {
-        for (int y = 0; y < h; ++y)
+        int count = w * h;
+        uint8_t* values = reinterpret_cast<uint8_t*>(ArenaAllocate(count));
+        int shift = maskChannel * 8;
+
+        if (isIndexed && bitDepth == 4)
         {
-            for (int x = 0; x < w; ++x)
-            {
-                int index = y * w + x;
-                uint32_t p = (isIndexed ? reinterpret_cast<uint8_t*>(buffer)[index] : reinterpret_cast<uint32_t*>(buffer)[index]);
-                uint8_t a = (isIndexed ? p != 0 : p >> 24);
+            uint8_t* indices = reinterpret_cast<uint8_t*>(ArenaAllocate(count));
+            for (int y = 0; y < h; ++y)
+                UnpackNibbles(indices + y * w, buffer + y * ((w + 1) / 2), w);
+            ArenaFree(buffer);
+            buffer = indices;
+            bitDepth = 8;
+        }
 
-                if (a)
-                {
-                    minX = min(x, minX);
-                    minY = min(y, minY);
-                    maxX = max(x, maxX);
-                    maxY = max(y, maxY);
-                }
+        if (isIndexed)
+        {
+            //Look the channel up once per palette entry, premultiplying it like rgba pixels
+            uint8_t table[256] = {};
+            for (int i = 0; i < paletteSize; ++i)
+            {
+                uint32_t c = palette[i];
+                if (premultiply && maskChannel != 3)
+                    Premultiply(&c, 1, premultiplyRounded);
+                table[i] = static_cast<uint8_t>(c >> shift);
             }
+            for (int i = 0; i < count; ++i)
+                values[i] = table[buffer[i]];
+
+            free(palette);
+            palette = nullptr;
+            paletteSize = 0;
+            isIndexed = false;
         }
-        if (maxX < minX || maxY < minY)
+        else
         {
-            minX = 0;
-            minY = 0;
-            maxX = w - 1;
-            maxY = h - 1;
-            if (verbose) cout << "image is completely transparent!" << endl;
+            const uint32_t* pixels = reinterpret_cast<const uint32_t*>(buffer);
+            for (int i = 0; i < count; ++i)
+                values[i] = static_cast<uint8_t>(pixels[i] >> shift);
         }
+
+        ArenaFree(buffer);
+        buffer = values;
+        mask = true;
     }
-    else
+    bool isByte = isIndexed || mask;
+    bool isNibble = isIndexed && bitDepth == 4;
+    size_t stride = isNibble ? (w + 1) / 2 : w;
+
+    //Get pixel bounds
+    int minX = 0;
+    int minY = 0;
+    int maxX = w - 1;
+    int maxY = h - 1;
+    if (trim)
     {
-        minX = 0;
-        minY = 0;
-        maxX = w - 1;
-        maxY = h - 1;
+        bool visible;
+        if (isNibble)
+            visible = FindBounds<NibblePixels>(buffer, stride, w, h, minX, minY, maxX, maxY);
+        else if (isByte)
+            visible = FindBounds<BytePixels>(buffer, stride, w, h, minX, minY, maxX, maxY);
+        else
+            visible = FindBounds<RgbaPixels>(buffer, stride * 4, w, h, minX, minY, maxX, maxY);
+        if (!visible && verbose)
+            cout << "image is completely transparent!" << endl;
     }
 
     //Calculate our trimmed size
@@ -214,48 +602,93 @@ bool Bitmap::DecodePng(LodePNGState *state, unsigned char* png, size_t size, boo
         frameY = 0;
         data = buffer;
     }
+    else if (!isNibble)
+    {
+        //Trimmed sprites look into the decoded image rather than copying out of it, until
+        //Compact decides the rest of it is worth freeing
+        size_t pixelSize = isByte ? 1 : 4;
+        frameX = -minX;
+        frameY = -minY;
+        data = buffer + (minY * stride + minX) * pixelSize;
+        decoded = buffer;
+        pitch = stride * pixelSize;
+    }
     else
     {
         //Create the trimmed image data
-        data = reinterpret_cast<uint8_t*>(calloc(width * height, isIndexed ? sizeof(uint8_t) : sizeof(uint32_t)));
+        data = reinterpret_cast<uint8_t*>(ArenaAllocate(Stride() * height));
+        memset(data, 0, Stride() * height);
         frameX = -minX;
         frameY = -minY;
 
-        //Copy trimmed pixels over to the trimmed pixel array
+        //4 bit rows can start mid byte, so their trimmed pixels are copied out
         for (int y = minY; y <= maxY; ++y)
-        {
-            for (int x = minX; x <= maxX; ++x)
-            {
-                int srcIndex = y * w + x;
-                int dstIndex = (y - minY) * width + (x - minX);
-                if (isIndexed)
-                    reinterpret_cast<uint8_t*>(data)[dstIndex] = reinterpret_cast<uint8_t*>(buffer)[srcIndex];
-                else
-                    reinterpret_cast<uint32_t*>(data)[dstIndex] = reinterpret_cast<uint32_t*>(buffer)[srcIndex];
-            }
-        }
+            CopyNibbles(data + (y - minY) * Stride(), 0, buffer + y * stride, minX, width);
 
         //Free the untrimmed pixels
-        free(buffer);
+        ArenaFree(buffer);
     }
 
-    //Generate a hash for the bitmap
-    hashValue = 0;
-    HashCombine(hashValue, static_cast<size_t>(width));
-    HashCombine(hashValue, static_cast<size_t>(height));
-    HashData(hashValue, reinterpret_cast<char*>(data), (isIndexed ? sizeof(uint8_t) : sizeof(uint32_t)) * width * height);
-    
+    //Lodepng and every buffer above took their memory from the thread's arena, if it has one
+    if (InArena())
+        LeaveArena();
+
+    UpdateHash();
+
+    //Remember what the png encoder will want to know about these pixels
+    if (!isByte)
+        colors.Add(reinterpret_cast<uint32_t*>(data), width, height, Stride() / 4);
+
     return true;
 }
 
+//Encodes a png, trying every filter strategy and keeping the smallest result when
+//compressing with optimal parsing
+static unsigned EncodePng(unsigned char** png, size_t* size, const uint8_t* data, unsigned int w, unsigned int h, LodePNGState* state, int compression)
+{
+    UseDeflate(state->encoder.zlibsettings, compression);
+
+    if (compression != DEFLATE_OPTIMAL)
+        return lodepng_encode(png, size, data, w, h, state);
+
+    static const LodePNGFilterStrategy strategies[] = { LFS_MINSUM, LFS_ENTROPY, LFS_BRUTE_FORCE };
+
+    state->encoder.filter_palette_zero = 0;
+    *png = NULL;
+    *size = 0;
+    for (LodePNGFilterStrategy strategy : strategies)
+    {
+        unsigned char* attempt = NULL;
+        size_t attemptSize = 0;
+        state->encoder.filter_strategy = strategy;
+
+        unsigned result = lodepng_encode(&attempt, &attemptSize, data, w, h, state);
+        if (result)
+        {
+            free(*png);
+            return result;
+        }
+
+        if (*png == NULL || attemptSize < *size)
+        {
+            free(*png);
+            *png = attempt;
+            *size = attemptSize;
+        }
+        else
+            free(attempt);
+    }
+    return 0;
+}
+
 Bitmap::~Bitmap()
 {
     if (paletteSize)
 		free(palette);
-    free(data);
+    FreePixels();
 }
 
-void Bitmap::SaveAs(const string& file)
+void Bitmap::SaveAs(const string& file, int compression)
 {
     if (paletteSize > 0)
     {
@@ -268,21 +701,23 @@ void Bitmap::SaveAs(const string& file)
 
         lodepng_state_init(&state);
 
-        for (int i = 0; i < paletteSize; i++)
+        //4 bit pages only use the first 16 colors, as with sub-palettes
+        int entries = bitDepth == 4 ? min(paletteSize, 16) : paletteSize;
+        for (int i = 0; i < entries; i++)
         {
-            lodepng_palette_add(&state.info_png.color, (palette[i] >> 0) & 0xff, (palette[i] >> 8) & 0xff, (palette[i] >> 16) & 0xff, 0xff);
-            lodepng_palette_add(&state.info_raw, (palette[i] >> 0) & 0xff, (palette[i] >> 8) & 0xff, (palette[i] >> 16) & 0xff, 0xff);
+            lodepng_palette_add(&state.info_png.color, (palette[i] >> 0) & 0xff, (palette[i] >> 8) & 0xff, (palette[i] >> 16) & 0xff, palette[i] >> 24);
+            lodepng_palette_add(&state.info_raw, (palette[i] >> 0) & 0xff, (palette[i] >> 8) & 0xff, (palette[i] >> 16) & 0xff, palette[i] >> 24);
        }
 
         state.info_png.color.colortype = LCT_PALETTE;
-        state.info_png.color.bitdepth = 8;
+        state.info_png.color.bitdepth = bitDepth;
         state.info_raw.colortype = LCT_PALETTE;
-        state.info_raw.bitdepth = 8;
+        state.info_raw.bitdepth = bitDepth;
         state.encoder.auto_convert = 0;
 
         size_t pngSize;
         unsigned char* pngData = NULL;
-        result = lodepng_encode(&pngData, &pngSize, data, pw, ph, &state);
+        result = EncodePng(&pngData, &pngSize, data, pw, ph, &state, compression);
 
         if (result)
         {
@@ -297,16 +732,57 @@ void Bitmap::SaveAs(const string& file)
 
         free(pngData);
     }
+    else if (mask)
+    {
+        unsigned int pw = static_cast<unsigned int>(width);
+        unsigned int ph = static_cast<unsigned int>(height);
+
+        LodePNGState state;
+
+        lodepng_state_init(&state);
+
+        state.info_png.color.colortype = LCT_GREY;
+        state.info_png.color.bitdepth = 8;
+        state.info_raw.colortype = LCT_GREY;
+        state.info_raw.bitdepth = 8;
+        state.encoder.auto_convert = 0;
+
+        size_t pngSize;
+        unsigned char* pngData = NULL;
+
+        if (EncodePng(&pngData, &pngSize, data, pw, ph, &state, compression) || lodepng_save_file(pngData, pngSize, file.data()))
+        {
+            cout << "failed to save png: " << file << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        free(pngData);
+        lodepng_state_cleanup(&state);
+    }
     else
     {
         unsigned int pw = static_cast<unsigned int>(width);
         unsigned int ph = static_cast<unsigned int>(height);
 
-        if (lodepng_encode32_file(file.data(), data, pw, ph))
+        LodePNGState state;
+
+        lodepng_state_init(&state);
+
+        //Our stats were merged from the sprites, so lodepng doesn't need to analyze the pixels again
+        colors.ChooseMode(&state.info_png.color, static_cast<size_t>(width) * height);
+        state.encoder.auto_convert = 0;
+
+        size_t pngSize;
+        unsigned char* pngData = NULL;
+
+        if (EncodePng(&pngData, &pngSize, data, pw, ph, &state, compression) || lodepng_save_file(pngData, pngSize, file.data()))
         {
             cout << "failed to save png: " << file << endl;
             exit(EXIT_FAILURE);
         }
+
+        free(pngData);
+        lodepng_state_cleanup(&state);
     }
 }
 
@@ -337,40 +813,131 @@ void Bitmap::FindPaletteSlot(Bitmap* dst)
 
 void Bitmap::CopyPixels(const Bitmap* src, int tx, int ty)
 {
-    if (paletteSize > 0)
+    if (paletteSize > 0 || mask)
     {
-        if (src->paletteSize == 0)
+        if ((src->paletteSize > 0) != (paletteSize > 0) || src->mask != mask || (bitDepth == 4 && src->bitDepth != 4))
             return;
 
+        size_t stride = Stride();
+        size_t srcStride = src->Stride();
         for (int y = 0; y < src->height; ++y)
+        {
+            uint8_t* row = data + (ty + y) * stride;
+            const uint8_t* srcRow = src->data + y * srcStride;
+            if (bitDepth == 4)
+                CopyNibbles(row, tx, srcRow, 0, src->width);
+            else if (src->bitDepth == 4)
+                UnpackNibbles(row + tx, srcRow, src->width);
+            else
+                memcpy(row + tx, srcRow, src->width);
+        }
+    }
+    else if (src->mask)
+    {
+        //Masks on an rgba page fill one plane, leaving the others to the masks packed there
+        uint32_t* dstPixels = reinterpret_cast<uint32_t*>(data);
+        int shift = src->channel * 8;
+
+        for (int y = 0; y < src->height; ++y)
+        {
+            const uint8_t* srcRow = src->data + y * src->Stride();
             for (int x = 0; x < src->width; ++x)
-                data[(ty + y) * width + (tx + x)] = src->data[y * src->width + x];
+            {
+                uint32_t& p = dstPixels[(ty + y) * width + (tx + x)];
+                p = (p & ~(0xffu << shift)) | (static_cast<uint32_t>(srcRow[x]) << shift);
+            }
+        }
     }
     else
     {
         if (src->paletteSize > 0)
             return;
 
-        uint32_t* srcPixels = reinterpret_cast<uint32_t*>(src->data);
         uint32_t* dstPixels = reinterpret_cast<uint32_t*>(data);
 
         for (int y = 0; y < src->height; ++y)
-            for (int x = 0; x < src->width; ++x)
-                dstPixels[(ty + y) * width + (tx + x)] = srcPixels[y * src->width + x];
+            memcpy(dstPixels + (ty + y) * width + tx, src->data + y * src->Stride(), src->width * sizeof(uint32_t));
+    }
+}
+
+//Fills this bitmap with the pixels of src starting at (sx, sy), both of the same kind.
+//Whatever falls outside src is left as it was.
+void Bitmap::CopyRegion(const Bitmap* src, int sx, int sy)
+{
+    int w = min(width, src->width - sx);
+    int h = min(height, src->height - sy);
+    if (w <= 0 || h <= 0)
+        return;
+
+    size_t stride = Stride();
+    size_t srcStride = src->Stride();
+    for (int y = 0; y < h; ++y)
+    {
+        uint8_t* row = data + y * stride;
+        const uint8_t* srcRow = src->data + (sy + y) * srcStride;
+        if (bitDepth == 4)
+            CopyNibbles(row, 0, srcRow, sx, w);
+        else if (paletteSize > 0 || mask)
+            memcpy(row, srcRow + sx, w);
+        else
+            memcpy(row, srcRow + static_cast<size_t>(sx) * 4, static_cast<size_t>(w) * 4);
     }
 }
 
 void Bitmap::CopyPixelsRot(const Bitmap* src, int tx, int ty)
 {
-    if (paletteSize > 0)
+    if (paletteSize > 0 || mask)
     {
-        if (src->paletteSize == 0)
+        if ((src->paletteSize > 0) != (paletteSize > 0) || src->mask != mask || (bitDepth == 4 && src->bitDepth != 4))
             return;
 
+        //4 bit sprites are widened to a byte a pixel to gather their columns, and each
+        //column is packed again for 4 bit pages
+        vector<uint8_t> indices;
+        const uint8_t* pixels = src->data;
+        size_t srcStride = src->Stride();
+        if (src->bitDepth == 4)
+        {
+            indices.resize(static_cast<size_t>(src->width) * src->height);
+            for (int y = 0; y < src->height; ++y)
+                UnpackNibbles(&indices[y * src->width], src->data + y * srcStride, src->width);
+            pixels = indices.data();
+            srcStride = src->width;
+        }
+
+        vector<uint8_t> line(src->height);
+        vector<uint8_t> packed((src->height + 1) / 2);
+        size_t stride = Stride();
+        int r = src->height - 1;
+        for (int y = 0; y < src->width; ++y)
+        {
+            for (int x = 0; x < src->height; ++x)
+                line[x] = pixels[(r - x) * srcStride + y];
+
+            uint8_t* row = data + (ty + y) * stride;
+            if (bitDepth == 4)
+            {
+                PackNibbles(packed.data(), line.data(), src->height);
+                CopyNibbles(row, tx, packed.data(), 0, src->height);
+            }
+            else
+                memcpy(row + tx, line.data(), src->height);
+        }
+    }
+    else if (src->mask)
+    {
+        uint32_t* dstPixels = reinterpret_cast<uint32_t*>(data);
+        int shift = src->channel * 8;
+
         int r = src->height - 1;
         for (int y = 0; y < src->width; ++y)
+        {
             for (int x = 0; x < src->height; ++x)
-                data[(ty + y) * width + (tx + x)] = src->data[(r - x) * src->width + y];
+            {
+                uint32_t& p = dstPixels[(ty + y) * width + (tx + x)];
+                p = (p & ~(0xffu << shift)) | (static_cast<uint32_t>(src->data[(r - x) * src->Stride() + y]) << shift);
+            }
+        }
     }
     else
     {
@@ -379,11 +946,12 @@ void Bitmap::CopyPixelsRot(const Bitmap* src, int tx, int ty)
 
         uint32_t* srcPixels = reinterpret_cast<uint32_t*>(src->data);
         uint32_t* dstPixels = reinterpret_cast<uint32_t*>(data);
+        size_t srcStride = src->Stride() / 4;
 
         int r = src->height - 1;
         for (int y = 0; y < src->width; ++y)
             for (int x = 0; x < src->height; ++x)
-                dstPixels[(ty + y) * width + (tx + x)] = srcPixels[(r - x) * src->width + y];
+                dstPixels[(ty + y) * width + (tx + x)] = srcPixels[(r - x) * srcStride + y];
     }
 }
 
@@ -392,5 +960,26 @@ bool Bitmap::Equals(const Bitmap* other) const
     if (width != other->width || height != other->height)
         return false;
 
-    return memcmp(data, other->data, (paletteSize > 0 ? sizeof(uint8_t) : sizeof(uint32_t)) * width * height) == 0;
+    if ((paletteSize > 0) != (other->paletteSize > 0) || mask != other->mask || bitDepth != other->bitDepth)
+        return false;
+
+    for (int y = 0; y < height; ++y)
+        if (memcmp(data + y * Stride(), other->data + y * other->Stride(), RowBytes()) != 0)
+            return false;
+    return true;
+}
+
+bool Bitmap::SamePalette(const Bitmap* other) const
+{
+    return paletteSize == other->paletteSize && (paletteSize == 0 || memcmp(palette, other->palette, paletteSize * sizeof(uint32_t)) == 0);
+}
+
+//The hash only covers the pixels, so recolored variants of a sprite hash the same, and so
+//do views and compacted copies of the same pixels
+void Bitmap::UpdateHash()
+{
+    hashValue = 0;
+    HashCombine(hashValue, static_cast<size_t>(width));
+    HashCombine(hashValue, static_cast<size_t>(height));
+    HashRows(hashValue, reinterpret_cast<char*>(data), RowBytes(), height, Stride());
 }
@@ -31,9 +31,18 @@
 #include <cstdint>
 #include <vector>
 #include "lodepng.h"
+#include "intern.hpp"
 
 using namespace std;
 
+//How an alias's pixels come from the ones it shares: swap x and y first, then flip
+enum Transform
+{
+    TRANSFORM_FLIP_X = 1,
+    TRANSFORM_FLIP_Y = 2,
+    TRANSFORM_TRANSPOSE = 4
+};
+
 struct Point
 {
     int x;
@@ -42,12 +51,35 @@ struct Point
     bool rot;
 };
 
+//What the png encoder needs to know about a set of pixels to choose its color mode.
+//Gathered once per sprite while loading and merged per page, so lodepng doesn't
+//have to analyze every page again before encoding it.
+struct ColorStats
+{
+    bool alpha;             //some pixel needs a full alpha channel
+    bool transparent;       //has fully transparent pixels, all with the rgb of keyColor
+    uint32_t keyColor;
+    bool opaqueBlack;       //some opaque pixel is black, so the background can't be keyed out
+    bool complete;          //colors holds every distinct color (there are at most 256)
+    vector<uint32_t> colors;
+
+    ColorStats();
+    void Add(const uint32_t* pixels, size_t count);
+    void Add(const uint32_t* pixels, int width, int height, size_t stride);
+    void Merge(const ColorStats& other);
+    void ChooseMode(LodePNGColorMode* mode, size_t pixelCount) const;
+};
+
+//Premultiplied channels are truncated, like they always have been, unless this asks for
+//them to be rounded to the nearest value
+void SetPremultiplyRounding(bool rounded);
+
 struct Bitmap
 {
     Point pos;
     int frameIndex;
-    string name;
-    string label;
+    Interned name;
+    Interned label;
     int loopDirection;
     int duration;
     int width;
@@ -61,18 +93,36 @@ struct Bitmap
     size_t hashValue;
     int paletteSize;
     int paletteSlot;
+    int bitDepth;           //indexed pixels are 8 bits, or 4 bits packed two to a byte
+    bool mask;              //data holds a single 8 bit channel per pixel instead of rgba
+    int channel;            //plane of an rgba page a mask is drawn into when packing channels
+    int transform;          //how an alias's pixels are flipped from its original's, see TRANSFORM_ flags
+    uint8_t* decoded;       //the whole decoded image when data is a trimmed view into it
+    size_t pitch;           //bytes per row of a view, 0 when data's rows are packed tightly
+    int64_t spillOffset;    //where SpillPixels wrote the pixels in the scratch file, or -1
+    ColorStats colors;
 
-    Bitmap(const string& file, const string& name, bool premultiply, bool trim, bool verbose);
-    Bitmap(int frameIndex, const string& name, const string& label, int loopDirection, int duration, LodePNGState* state, unsigned char* png, size_t size, bool premultiply, bool trim, bool verbose);
-    Bitmap(int width, int height, uint32_t* palette, int paletteSize);
+    Bitmap(const string& file, Interned name, bool premultiply, int maskChannel, bool trim, bool verbose);
+    Bitmap(int frameIndex, Interned name, Interned label, int loopDirection, int duration, LodePNGState* state, unsigned char* png, size_t size, bool premultiply, int maskChannel, bool trim, bool verbose);
+    Bitmap(int width, int height, uint32_t* palette, int paletteSize, int bitDepth, bool mask);
+    Bitmap(Interned name, int frameIndex, int width, int height);
     ~Bitmap();
-    bool DecodePng(LodePNGState* state, unsigned char* png, size_t size, bool premultiply, bool trim, bool verbose);
-    void SaveAs(const string& file);
+    size_t Stride() const;
+    size_t RowBytes() const;
+    size_t PixelBytes() const;
+    void FreePixels();
+    void Compact();
+    void LeaveArena();
+    bool DecodePng(LodePNGState* state, unsigned char* png, size_t size, bool premultiply, int maskChannel, bool trim, bool verbose);
+    void SaveAs(const string& file, int compression);
     void FindPaletteSlot(Bitmap* dst);
     void SetPaletteSlot(int paletteSlot) { this->paletteSlot = paletteSlot; }
     void CopyPixels(const Bitmap* src, int tx, int ty);
     void CopyPixelsRot(const Bitmap* src, int tx, int ty);
+    void CopyRegion(const Bitmap* src, int sx, int sy);
     bool Equals(const Bitmap* other) const;
+    bool SamePalette(const Bitmap* other) const;
+    void UpdateHash();
 };
 
 #endif
@@ -327,6 +327,12 @@ struct ase_t
 	#define CUTE_ASEPRITE_FREE(mem, ctx) free(mem)
 #endif
 
+// Overrides the built-in inflater for compressed cels. Must return nonzero on success.
+#if !defined(CUTE_ASEPRITE_INFLATE)
+	#define CUTE_ASEPRITE_INFLATE(in, in_bytes, out, out_bytes, mem_ctx) s_inflate(in, in_bytes, out, out_bytes, mem_ctx)
+	#define CUTE_ASEPRITE_BUILTIN_INFLATE
+#endif
+
 #if !defined(CUTE_ASEPRITE_UNUSED)
 	#if defined(_MSC_VER)
 		#define CUTE_ASEPRITE_UNUSED(x) (void)x
@@ -408,6 +414,7 @@ static const char* s_error_reason;      // Used to capture errors during DEFLATE
 #define CUTE_ASEPRITE_FAIL() do { goto ase_err; } while (0)
 #define CUTE_ASEPRITE_CHECK(X, Y) do { if (!(X)) { s_error_reason = Y; CUTE_ASEPRITE_FAIL(); } } while (0)
 #define CUTE_ASEPRITE_CALL(X) do { if (!(X)) goto ase_err; } while (0)
+#ifdef CUTE_ASEPRITE_BUILTIN_INFLATE
 #define CUTE_ASEPRITE_DEFLATE_MAX_BITLEN 15
 
 // DEFLATE tables from RFC 1951
@@ -733,6 +740,8 @@ ase_err:
 	return 0;
 }
 
+#endif // CUTE_ASEPRITE_BUILTIN_INFLATE
+
 typedef struct ase_state_t
 {
 	uint8_t* in;
@@ -1079,7 +1088,7 @@ ase_t* cute_aseprite_load_from_memory(const void* memory, int size, void* mem_ct
 					CUTE_ASEPRITE_ASSERT(!(zlib_byte1 & 0x20)); // Preset dictionary is present and not supported.
 					int pixels_sz = cel->w * cel->h * bpp;
 					void* pixels_decompressed = CUTE_ASEPRITE_ALLOC(pixels_sz, mem_ctx);
-					int ret = s_inflate(pixels, deflate_bytes, pixels_decompressed, pixels_sz, mem_ctx);
+					int ret = CUTE_ASEPRITE_INFLATE(pixels, deflate_bytes, pixels_decompressed, pixels_sz, mem_ctx);
 					if (!ret) CUTE_ASEPRITE_WARNING(s_error_reason);
 					cel->pixels = pixels_decompressed;
 					s_skip(s, deflate_bytes);
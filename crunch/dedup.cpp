@@ -0,0 +1,186 @@
+#include "dedup.hpp"
+#include "hash.hpp"
+#include "spill.hpp"
+#include <vector>
+
+using namespace std;
+
+static uint32_t GetPixel(const Bitmap& bitmap, const uint8_t* row, int x)
+{
+    if (bitmap.paletteSize > 0 && bitmap.bitDepth == 4)
+        return (row[x >> 1] >> ((x & 1) ? 0 : 4)) & 0xf;
+    if (bitmap.paletteSize > 0 || bitmap.mask)
+        return row[x];
+    return reinterpret_cast<const uint32_t*>(row)[x];
+}
+
+//Where pixel (x, y) of the bitmap seen through transform comes from
+static void GetSource(const Bitmap& bitmap, int transform, int x, int y, int& sx, int& sy)
+{
+    bool transpose = (transform & TRANSFORM_TRANSPOSE) != 0;
+    int w = transpose ? bitmap.height : bitmap.width;
+    int h = transpose ? bitmap.width : bitmap.height;
+    if (transform & TRANSFORM_FLIP_X)
+        x = w - 1 - x;
+    if (transform & TRANSFORM_FLIP_Y)
+        y = h - 1 - y;
+    sx = transpose ? y : x;
+    sy = transpose ? x : y;
+}
+
+//Hashes the bitmap as each of its first count flips would look and returns the lowest
+static int GetCanonical(const Bitmap& bitmap, int count, size_t& hash)
+{
+    vector<uint32_t> pixels(static_cast<size_t>(bitmap.width) * bitmap.height);
+    int canonical = 0;
+    for (int transform = 0; transform < count; ++transform)
+    {
+        bool transpose = (transform & TRANSFORM_TRANSPOSE) != 0;
+        int w = transpose ? bitmap.height : bitmap.width;
+        int h = transpose ? bitmap.width : bitmap.height;
+        size_t i = 0;
+        for (int y = 0; y < h; ++y)
+        {
+            for (int x = 0; x < w; ++x)
+            {
+                int sx, sy;
+                GetSource(bitmap, transform, x, y, sx, sy);
+                pixels[i++] = GetPixel(bitmap, bitmap.data + sy * bitmap.Stride(), sx);
+            }
+        }
+
+        size_t value = 0;
+        HashCombine(value, static_cast<size_t>(w));
+        HashCombine(value, static_cast<size_t>(h));
+        HashCombine(value, static_cast<size_t>(bitmap.paletteSize > 0 ? 1 : (bitmap.mask ? 2 : 0)));
+        HashData(value, reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(uint32_t));
+        if (transform == 0 || value < hash)
+        {
+            hash = value;
+            canonical = transform;
+        }
+    }
+    return canonical;
+}
+
+//Whether the two bitmaps look the same, each seen through its own transform
+static bool EqualsTransformed(const Bitmap& a, int transformA, const Bitmap& b, int transformB)
+{
+    if ((a.paletteSize > 0) != (b.paletteSize > 0) || a.mask != b.mask || a.bitDepth != b.bitDepth)
+        return false;
+    if (a.width * a.height != b.width * b.height)
+        return false;
+
+    bool transpose = (transformA & TRANSFORM_TRANSPOSE) != 0;
+    int w = transpose ? a.height : a.width;
+    int h = transpose ? a.width : a.height;
+    if (w != ((transformB & TRANSFORM_TRANSPOSE) ? b.height : b.width))
+        return false;
+
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            int ax, ay, bx, by;
+            GetSource(a, transformA, x, y, ax, ay);
+            GetSource(b, transformB, x, y, bx, by);
+            if (GetPixel(a, a.data + ay * a.Stride(), ax) != GetPixel(b, b.data + by * b.Stride(), bx))
+                return false;
+        }
+    }
+    return true;
+}
+
+//The transform that turns the original into the alias. Followed by the alias's canonical
+//flip it has to move the corners of a non-square rect where the original's does.
+static int Compose(int aliasCanonical, int originalCanonical)
+{
+    static const int w = 2;
+    static const int h = 3;
+    for (int transform = 0; transform < 8; ++transform)
+    {
+        bool matches = true;
+        for (int corner = 0; corner < 2 && matches; ++corner)
+        {
+            //Where the transform sends a corner of a w x h rect
+            int x = corner ? w - 1 : 0;
+            int y = 0;
+            auto apply = [](int t, int& x, int& y, int& cw, int& ch)
+            {
+                if (t & TRANSFORM_TRANSPOSE)
+                {
+                    swap(x, y);
+                    swap(cw, ch);
+                }
+                if (t & TRANSFORM_FLIP_X)
+                    x = cw - 1 - x;
+                if (t & TRANSFORM_FLIP_Y)
+                    y = ch - 1 - y;
+            };
+
+            int ax = x, ay = y, aw = w, ah = h;
+            apply(transform, ax, ay, aw, ah);
+            apply(aliasCanonical, ax, ay, aw, ah);
+
+            int bx = x, by = y, bw = w, bh = h;
+            apply(originalCanonical, bx, by, bw, bh);
+            matches = ax == bx && ay == by && aw == bw;
+        }
+        if (matches)
+            return transform;
+    }
+    return 0;
+}
+
+size_t DedupIndex::Hash(const Bitmap* bitmap, int& canonical) const
+{
+    size_t hash = bitmap->hashValue;
+    canonical = transforms > 1 ? GetCanonical(*bitmap, transforms, hash) : 0;
+    return hash;
+}
+
+Bitmap* DedupIndex::Insert(Bitmap* bitmap, int& transform)
+{
+    int canonical;
+    size_t hash = Hash(bitmap, canonical);
+    return Insert(bitmap, hash, canonical, transform);
+}
+
+Bitmap* DedupIndex::Insert(Bitmap* bitmap, size_t hash, int canonical, int& transform)
+{
+    transform = 0;
+
+    //The low bits pick the bucket inside a shard, so shards go by the top six
+    Shard& shard = shards[(hash >> (sizeof(size_t) * 8 - 6)) % shardCount];
+    lock_guard<mutex> guard(shard.lock);
+
+    auto range = shard.bitmaps.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        const Entry& entry = it->second;
+
+        //With --memory-limit the earlier bitmap may have gone to the scratch file already
+        bool spilled = !entry.bitmap->data && entry.bitmap->spillOffset >= 0;
+        if (spilled)
+            UnspillPixels(*entry.bitmap);
+        bool equal = transforms == 1 ? bitmap->Equals(entry.bitmap) : EqualsTransformed(*bitmap, canonical, *entry.bitmap, entry.canonical);
+        if (spilled)
+            entry.bitmap->FreePixels();
+
+        if (equal)
+        {
+            if (transforms > 1)
+                transform = Compose(canonical, entry.canonical);
+            return entry.bitmap;
+        }
+    }
+
+    shard.bitmaps.emplace(hash, Entry{ bitmap, canonical });
+    return nullptr;
+}
+
+void DedupIndex::Clear()
+{
+    for (Shard& shard : shards)
+        shard.bitmaps.clear();
+}
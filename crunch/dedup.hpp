@@ -0,0 +1,46 @@
+#ifndef dedup_hpp
+#define dedup_hpp
+
+#include <mutex>
+#include <unordered_map>
+#include "bitmap.hpp"
+
+using namespace std;
+
+//Every distinct set of sprite pixels loaded so far, keyed on the pixel hash. Safe to use
+//from several threads at once: the hashes are spread over shards with a lock each, so
+//threads only wait on each other when their sprites land in the same shard.
+struct DedupIndex
+{
+    static const int shardCount = 64;
+
+    //A bitmap, and with transforms the one of its 8 flips that hashed lowest
+    struct Entry
+    {
+        Bitmap* bitmap;
+        int canonical;
+    };
+
+    struct Shard
+    {
+        mutex lock;
+        unordered_multimap<size_t, Entry> bitmaps;
+    };
+
+    //How many of the TRANSFORM_ flag combinations to match: 1 for exact copies only, 4 for
+    //flips and 8 for flips and transposes. Bitmaps are keyed on their lowest hashing one.
+    int transforms = 1;
+    Shard shards[shardCount];
+
+    //The hash a bitmap is keyed on, and which transform of it that hash is for. Doesn't
+    //touch the index, so it can be worked out for many bitmaps at once before inserting.
+    size_t Hash(const Bitmap* bitmap, int& canonical) const;
+
+    //Returns the earlier bitmap with the same pixels, or adds this one and returns nullptr.
+    //With transforms, transform is set to how the bitmap's pixels come from the earlier one's.
+    Bitmap* Insert(Bitmap* bitmap, int& transform);
+    Bitmap* Insert(Bitmap* bitmap, size_t hash, int canonical, int& transform);
+    void Clear();
+};
+
+#endif
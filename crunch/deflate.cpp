@@ -0,0 +1,1005 @@
+#include "deflate.hpp"
+#include "parallel.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#if defined(__SSE4_2__) || (defined(_MSC_VER) && defined(__AVX__))
+#include <nmmintrin.h>
+#define DEFLATE_CRC_HASH
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DEFLATE_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+#define WINDOW_SIZE 32768
+#define WINDOW_MASK (WINDOW_SIZE - 1)
+#define HASH_BITS 15
+#define HASH_SIZE (1 << HASH_BITS)
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define TOO_FAR 4096
+#define BLOCK_SYMBOLS (1 << 16)
+#define NUM_LITLEN 286
+#define NUM_DIST 30
+#define NUM_CODELEN 19
+#define OPTIMAL_BLOCK 65535
+#define OPTIMAL_MATCHES 8
+#define OPTIMAL_ITERATIONS 15
+
+//Same tuning as zlib: good, lazy (max insert length when greedy), nice and chain lengths.
+//The optimal level parses each block with iterated shortest paths instead.
+struct DeflateLevel
+{
+    int good;
+    int lazy;
+    int nice;
+    int chain;
+    bool greedy;
+    bool optimal;
+};
+
+static const DeflateLevel levels[DEFLATE_OPTIMAL + 1] =
+{
+    { 0, 0, 0, 0, true, false },
+    { 4, 4, 8, 4, true, false },
+    { 4, 5, 16, 8, true, false },
+    { 4, 6, 32, 32, true, false },
+    { 4, 4, 16, 16, false, false },
+    { 8, 16, 32, 32, false, false },
+    { 8, 16, 128, 128, false, false },
+    { 8, 32, 128, 256, false, false },
+    { 32, 128, 258, 1024, false, false },
+    { 32, 258, 258, 4096, false, false },
+    { 0, 0, 258, 1024, false, true }
+};
+
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t codeLengthOrder[NUM_CODELEN] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static struct Tables
+{
+    uint8_t lengthCode[MAX_MATCH + 1];
+    uint8_t distCode[512];
+    uint8_t fixedLitLen[288];
+    uint16_t fixedLitCode[288];
+    uint8_t fixedDistLen[NUM_DIST];
+    uint16_t fixedDistCode[NUM_DIST];
+
+    Tables();
+} tables;
+
+static uint16_t ReverseBits(uint32_t code, int length)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < length; ++i)
+    {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return static_cast<uint16_t>(result);
+}
+
+static void BuildCodes(const uint8_t* lengths, int count, uint16_t* codes)
+{
+    int lengthCount[16] = {};
+    uint32_t nextCode[16] = {};
+
+    for (int i = 0; i < count; ++i)
+        lengthCount[lengths[i]]++;
+    lengthCount[0] = 0;
+
+    uint32_t code = 0;
+    for (int bits = 1; bits < 16; ++bits)
+    {
+        code = (code + lengthCount[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+
+    for (int i = 0; i < count; ++i)
+        codes[i] = lengths[i] ? ReverseBits(nextCode[lengths[i]]++, lengths[i]) : 0;
+}
+
+Tables::Tables()
+{
+    for (int code = 0; code < 29; ++code)
+        for (int length = lengthBase[code]; length < lengthBase[code] + (1 << lengthExtra[code]) && length <= MAX_MATCH; ++length)
+            lengthCode[length] = static_cast<uint8_t>(code);
+    lengthCode[MAX_MATCH] = 28;
+
+    for (int code = 0; code < NUM_DIST; ++code)
+    {
+        for (int dist = distBase[code] - 1; dist < distBase[code] - 1 + (1 << distExtra[code]); ++dist)
+        {
+            if (dist < 256)
+                distCode[dist] = static_cast<uint8_t>(code);
+            else
+                distCode[256 + (dist >> 7)] = static_cast<uint8_t>(code);
+        }
+    }
+
+    for (int i = 0; i < 288; ++i)
+        fixedLitLen[i] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+    for (int i = 0; i < NUM_DIST; ++i)
+        fixedDistLen[i] = 5;
+    BuildCodes(fixedLitLen, 288, fixedLitCode);
+    BuildCodes(fixedDistLen, NUM_DIST, fixedDistCode);
+}
+
+static inline int DistCode(int dist)
+{
+    --dist;
+    return dist < 256 ? tables.distCode[dist] : tables.distCode[256 + (dist >> 7)];
+}
+
+static inline uint32_t Read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+//The multiplicative hash is what the shipped builds use, none of them pass -msse4.2. Only
+//builds made for sse4.2 get the crc one, which finds different matches, so their pages
+//aren't byte for byte the same as everyone else's.
+static inline uint32_t Hash(uint32_t v)
+{
+#ifdef DEFLATE_CRC_HASH
+    return _mm_crc32_u32(0, v) & (HASH_SIZE - 1);
+#else
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+#endif
+}
+
+static inline int CountTrailingZeros(uint64_t v)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+//Length of the common prefix of a and b, up to max bytes
+static inline int MatchLength(const uint8_t* a, const uint8_t* b, int max)
+{
+    int len = 0;
+#ifdef DEFLATE_SSE2
+    while (len + 16 <= max)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + len));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + len));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+        if (mask)
+            return len + CountTrailingZeros(static_cast<uint64_t>(mask));
+        len += 16;
+    }
+#endif
+    while (len + 8 <= max)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + len, sizeof(x));
+        memcpy(&y, b + len, sizeof(y));
+        if (x != y)
+            return len + CountTrailingZeros(x ^ y) / 8;
+        len += 8;
+    }
+    while (len < max && a[len] == b[len])
+        ++len;
+    return len;
+}
+
+//Computes length-limited huffman code lengths, always producing at least two codes
+//so every decoder accepts the tree as complete
+static void BuildLengths(const uint32_t* freqs, int count, int limit, uint8_t* lengths)
+{
+    int symbols[288];
+    uint32_t depth[288] = {};
+    int n = 0;
+
+    memset(lengths, 0, count);
+    for (int i = 0; i < count; ++i)
+        if (freqs[i])
+            symbols[n++] = i;
+
+    //Pad with unused symbols up to two codes
+    for (int i = 0; n < 2 && i < count; ++i)
+        if (!freqs[i] && (n == 0 || symbols[0] != i))
+            symbols[n++] = i;
+
+    stable_sort(symbols, symbols + n, [freqs](int a, int b) { return freqs[a] < freqs[b]; });
+    for (int i = 0; i < n; ++i)
+        depth[i] = max(freqs[symbols[i]], 1u);
+
+    //In-place minimum redundancy code (Moffat & Katajainen)
+    depth[0] += depth[1];
+    int root = 0;
+    int leaf = 2;
+    for (int next = 1; next < n - 1; ++next)
+    {
+        if (leaf >= n || depth[root] < depth[leaf])
+        {
+            depth[next] = depth[root];
+            depth[root++] = next;
+        }
+        else
+            depth[next] = depth[leaf++];
+
+        if (leaf >= n || (root < next && depth[root] < depth[leaf]))
+        {
+            depth[next] += depth[root];
+            depth[root++] = next;
+        }
+        else
+            depth[next] += depth[leaf++];
+    }
+    depth[n - 2] = 0;
+    for (int next = n - 3; next >= 0; --next)
+        depth[next] = depth[depth[next]] + 1;
+
+    int avail = 1;
+    int used = 0;
+    uint32_t d = 0;
+    root = n - 2;
+    int next = n - 1;
+    while (avail > 0)
+    {
+        while (root >= 0 && depth[root] == d)
+        {
+            ++used;
+            --root;
+        }
+        while (avail > used)
+        {
+            depth[next--] = d;
+            --avail;
+        }
+        avail = 2 * used;
+        ++d;
+        used = 0;
+    }
+
+    //Clamp to the length limit and repair the Kraft sum
+    int lengthCount[32] = {};
+    for (int i = 0; i < n; ++i)
+        lengthCount[min(static_cast<int>(depth[i]), limit)]++;
+
+    uint32_t total = 0;
+    for (int i = 1; i <= limit; ++i)
+        total += static_cast<uint32_t>(lengthCount[i]) << (limit - i);
+    while (total > (1u << limit))
+    {
+        lengthCount[limit]--;
+        for (int i = limit - 1; i > 0; --i)
+        {
+            if (lengthCount[i])
+            {
+                lengthCount[i]--;
+                lengthCount[i + 1] += 2;
+                break;
+            }
+        }
+        --total;
+    }
+
+    //Symbols are sorted by ascending frequency, so they take the longest codes first
+    int k = 0;
+    for (int len = limit; len > 0; --len)
+        for (int i = 0; i < lengthCount[len]; ++i)
+            lengths[symbols[k++]] = static_cast<uint8_t>(len);
+}
+
+struct BitWriter
+{
+    uint8_t* data;
+    size_t pos;
+    uint64_t bits;
+    int count;
+
+    inline void Put(uint32_t value, int n)
+    {
+        bits |= static_cast<uint64_t>(value) << count;
+        count += n;
+        if (count >= 32)
+        {
+            data[pos + 0] = static_cast<uint8_t>(bits);
+            data[pos + 1] = static_cast<uint8_t>(bits >> 8);
+            data[pos + 2] = static_cast<uint8_t>(bits >> 16);
+            data[pos + 3] = static_cast<uint8_t>(bits >> 24);
+            pos += 4;
+            bits >>= 32;
+            count -= 32;
+        }
+    }
+
+    void Align()
+    {
+        while (count > 0)
+        {
+            data[pos++] = static_cast<uint8_t>(bits);
+            bits >>= 8;
+            count -= 8;
+        }
+        bits = 0;
+        count = 0;
+    }
+};
+
+struct Encoder
+{
+    const uint8_t* in;
+    size_t size;
+    const DeflateLevel* level;
+    BitWriter out;
+    vector<uint32_t> symbols;
+    uint32_t litFreq[NUM_LITLEN];
+    uint32_t distFreq[NUM_DIST];
+    size_t blockStart;
+    size_t emitted;
+    vector<int32_t> head;
+    vector<int32_t> prev;
+
+    Encoder(const uint8_t* in, size_t size, const DeflateLevel* level, uint8_t* data);
+    void Literal(uint8_t c);
+    void Match(int length, int dist);
+    void FlushBlock(bool final);
+    void WriteStored(bool final);
+    void WriteSymbols(const uint8_t* litLen, const uint16_t* litCode, const uint8_t* distLen, const uint16_t* distCode);
+    int FindMatch(size_t pos, int32_t cand, int prevLength, int& dist) const;
+    int32_t Insert(size_t pos);
+    void CompressGreedy();
+    void CompressLazy();
+};
+
+Encoder::Encoder(const uint8_t* in, size_t size, const DeflateLevel* level, uint8_t* data)
+    : in(in), size(size), level(level), out{ data, 0, 0, 0 }, blockStart(0), emitted(0), head(HASH_SIZE, -1), prev(WINDOW_SIZE, -1)
+{
+    symbols.reserve(BLOCK_SYMBOLS);
+    memset(litFreq, 0, sizeof(litFreq));
+    memset(distFreq, 0, sizeof(distFreq));
+}
+
+inline void Encoder::Literal(uint8_t c)
+{
+    symbols.push_back(c);
+    litFreq[c]++;
+    emitted++;
+    if (symbols.size() >= BLOCK_SYMBOLS)
+        FlushBlock(false);
+}
+
+inline void Encoder::Match(int length, int dist)
+{
+    symbols.push_back((static_cast<uint32_t>(dist) << 16) | static_cast<uint32_t>(length));
+    litFreq[257 + tables.lengthCode[length]]++;
+    distFreq[DistCode(dist)]++;
+    emitted += length;
+    if (symbols.size() >= BLOCK_SYMBOLS)
+        FlushBlock(false);
+}
+
+void Encoder::WriteStored(bool final)
+{
+    size_t pos = blockStart;
+    do
+    {
+        size_t len = min(emitted - pos, static_cast<size_t>(65535));
+        bool last = pos + len == emitted;
+        out.Put(final && last ? 1 : 0, 1);
+        out.Put(0, 2);
+        out.Align();
+        out.data[out.pos++] = static_cast<uint8_t>(len);
+        out.data[out.pos++] = static_cast<uint8_t>(len >> 8);
+        out.data[out.pos++] = static_cast<uint8_t>(~len);
+        out.data[out.pos++] = static_cast<uint8_t>(~len >> 8);
+        memcpy(out.data + out.pos, in + pos, len);
+        out.pos += len;
+        pos += len;
+    } while (pos < emitted);
+}
+
+void Encoder::WriteSymbols(const uint8_t* litLen, const uint16_t* litCode, const uint8_t* distLen, const uint16_t* distCode)
+{
+    for (uint32_t symbol : symbols)
+    {
+        if (symbol < 256)
+        {
+            out.Put(litCode[symbol], litLen[symbol]);
+            continue;
+        }
+
+        int length = symbol & 0xffff;
+        int dist = symbol >> 16;
+        int lc = tables.lengthCode[length];
+        int dc = DistCode(dist);
+        out.Put(litCode[257 + lc], litLen[257 + lc]);
+        if (lengthExtra[lc])
+            out.Put(length - lengthBase[lc], lengthExtra[lc]);
+        out.Put(distCode[dc], distLen[dc]);
+        if (distExtra[dc])
+            out.Put(dist - distBase[dc], distExtra[dc]);
+    }
+    out.Put(litCode[256], litLen[256]);
+}
+
+//Huffman trees and run-length encoded header of a dynamic block, along with
+//the sizes the block would take in each of the three block types
+struct BlockPlan
+{
+    uint8_t litLen[NUM_LITLEN];
+    uint8_t distLen[NUM_DIST];
+    uint8_t clLen[NUM_CODELEN];
+    uint8_t clSymbols[NUM_LITLEN + NUM_DIST];
+    uint8_t clExtra[NUM_LITLEN + NUM_DIST];
+    int clCount;
+    int hlit;
+    int hdist;
+    int hclen;
+    uint64_t dynamicBits;
+    uint64_t fixedBits;
+};
+
+static void PlanBlock(const uint32_t* litFreq, const uint32_t* distFreq, BlockPlan& plan)
+{
+    BuildLengths(litFreq, NUM_LITLEN, 15, plan.litLen);
+    BuildLengths(distFreq, NUM_DIST, 15, plan.distLen);
+
+    plan.hlit = NUM_LITLEN;
+    while (plan.hlit > 257 && plan.litLen[plan.hlit - 1] == 0)
+        --plan.hlit;
+    plan.hdist = NUM_DIST;
+    while (plan.hdist > 1 && plan.distLen[plan.hdist - 1] == 0)
+        --plan.hdist;
+
+    //Run-length encode the code lengths
+    uint8_t all[NUM_LITLEN + NUM_DIST];
+    memcpy(all, plan.litLen, plan.hlit);
+    memcpy(all + plan.hlit, plan.distLen, plan.hdist);
+    int total = plan.hlit + plan.hdist;
+
+    uint32_t clFreq[NUM_CODELEN] = {};
+    int count = 0;
+    for (int i = 0; i < total;)
+    {
+        uint8_t value = all[i];
+        int run = 1;
+        while (i + run < total && all[i + run] == value)
+            ++run;
+        i += run;
+
+        if (value == 0)
+        {
+            while (run >= 11)
+            {
+                int r = min(run, 138);
+                plan.clSymbols[count] = 18;
+                plan.clExtra[count++] = static_cast<uint8_t>(r - 11);
+                run -= r;
+            }
+            if (run >= 3)
+            {
+                plan.clSymbols[count] = 17;
+                plan.clExtra[count++] = static_cast<uint8_t>(run - 3);
+                run = 0;
+            }
+        }
+        else
+        {
+            plan.clSymbols[count] = value;
+            plan.clExtra[count++] = 0;
+            --run;
+            while (run >= 3)
+            {
+                int r = min(run, 6);
+                plan.clSymbols[count] = 16;
+                plan.clExtra[count++] = static_cast<uint8_t>(r - 3);
+                run -= r;
+            }
+        }
+        while (run-- > 0)
+        {
+            plan.clSymbols[count] = value;
+            plan.clExtra[count++] = 0;
+        }
+    }
+    plan.clCount = count;
+    for (int i = 0; i < count; ++i)
+        clFreq[plan.clSymbols[i]]++;
+
+    BuildLengths(clFreq, NUM_CODELEN, 7, plan.clLen);
+    plan.hclen = NUM_CODELEN;
+    while (plan.hclen > 4 && plan.clLen[codeLengthOrder[plan.hclen - 1]] == 0)
+        --plan.hclen;
+
+    //Measure the dynamic and fixed block types
+    plan.dynamicBits = 3 + 5 + 5 + 4 + 3 * plan.hclen;
+    plan.fixedBits = 3;
+    for (int i = 0; i < NUM_CODELEN; ++i)
+        plan.dynamicBits += clFreq[i] * plan.clLen[i];
+    plan.dynamicBits += clFreq[16] * 2 + clFreq[17] * 3 + clFreq[18] * 7;
+    for (int i = 0; i < NUM_LITLEN; ++i)
+    {
+        uint32_t extra = i > 256 ? lengthExtra[i - 257] : 0;
+        plan.dynamicBits += litFreq[i] * static_cast<uint64_t>(plan.litLen[i] + extra);
+        plan.fixedBits += litFreq[i] * static_cast<uint64_t>(tables.fixedLitLen[i] + extra);
+    }
+    for (int i = 0; i < NUM_DIST; ++i)
+    {
+        plan.dynamicBits += distFreq[i] * static_cast<uint64_t>(plan.distLen[i] + distExtra[i]);
+        plan.fixedBits += distFreq[i] * static_cast<uint64_t>(5 + distExtra[i]);
+    }
+}
+
+void Encoder::FlushBlock(bool final)
+{
+    litFreq[256] = 1;
+
+    BlockPlan plan;
+    PlanBlock(litFreq, distFreq, plan);
+
+    size_t raw = emitted - blockStart;
+    uint64_t storedBits = (7 - (out.count + 2) % 8) + 3 + 32 + raw * 8 + (raw > 0 ? (raw - 1) / 65535 : 0) * 40;
+
+    if (storedBits < plan.dynamicBits && storedBits < plan.fixedBits)
+        WriteStored(final);
+    else if (plan.fixedBits <= plan.dynamicBits)
+    {
+        out.Put(final ? 1 : 0, 1);
+        out.Put(1, 2);
+        WriteSymbols(tables.fixedLitLen, tables.fixedLitCode, tables.fixedDistLen, tables.fixedDistCode);
+    }
+    else
+    {
+        uint16_t litCode[NUM_LITLEN];
+        uint16_t distCode[NUM_DIST];
+        uint16_t clCode[NUM_CODELEN];
+        BuildCodes(plan.litLen, NUM_LITLEN, litCode);
+        BuildCodes(plan.distLen, NUM_DIST, distCode);
+        BuildCodes(plan.clLen, NUM_CODELEN, clCode);
+
+        out.Put(final ? 1 : 0, 1);
+        out.Put(2, 2);
+        out.Put(plan.hlit - 257, 5);
+        out.Put(plan.hdist - 1, 5);
+        out.Put(plan.hclen - 4, 4);
+        for (int i = 0; i < plan.hclen; ++i)
+            out.Put(plan.clLen[codeLengthOrder[i]], 3);
+        for (int i = 0; i < plan.clCount; ++i)
+        {
+            uint8_t symbol = plan.clSymbols[i];
+            out.Put(clCode[symbol], plan.clLen[symbol]);
+            if (symbol == 16)
+                out.Put(plan.clExtra[i], 2);
+            else if (symbol == 17)
+                out.Put(plan.clExtra[i], 3);
+            else if (symbol == 18)
+                out.Put(plan.clExtra[i], 7);
+        }
+        WriteSymbols(plan.litLen, litCode, plan.distLen, distCode);
+    }
+
+    symbols.clear();
+    memset(litFreq, 0, sizeof(litFreq));
+    memset(distFreq, 0, sizeof(distFreq));
+    blockStart = emitted;
+}
+
+//Adds pos to the hash chains and returns the previous head of its chain
+inline int32_t Encoder::Insert(size_t pos)
+{
+    if (pos + 4 > size)
+        return -1;
+    uint32_t h = Hash(Read32(in + pos) & 0xffffff);
+    int32_t cand = head[h];
+    prev[pos & WINDOW_MASK] = cand;
+    head[h] = static_cast<int32_t>(pos);
+    return cand;
+}
+
+int Encoder::FindMatch(size_t pos, int32_t cand, int prevLength, int& dist) const
+{
+    int maxLength = static_cast<int>(min(static_cast<size_t>(MAX_MATCH), size - pos));
+    int best = max(prevLength, MIN_MATCH - 1);
+    int chain = prevLength >= level->good ? level->chain >> 2 : level->chain;
+    const uint8_t* cur = in + pos;
+    bool found = false;
+
+    if (best >= maxLength)
+        return 0;
+
+    while (cand >= 0 && pos - cand < WINDOW_SIZE && chain-- > 0)
+    {
+        const uint8_t* match = in + cand;
+        if (match[best] == cur[best] && (Read32(match) & 0xffffff) == (Read32(cur) & 0xffffff))
+        {
+            int length = MatchLength(match, cur, maxLength);
+            if (length > best)
+            {
+                best = length;
+                dist = static_cast<int>(pos - cand);
+                found = true;
+                if (length >= level->nice || length >= maxLength)
+                    break;
+            }
+        }
+
+        int32_t next = prev[cand & WINDOW_MASK];
+        if (next >= cand)
+            break;
+        cand = next;
+    }
+
+    if (found && best == MIN_MATCH && dist > TOO_FAR)
+        return 0;
+    return found ? best : 0;
+}
+
+void Encoder::CompressGreedy()
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        int length = 0;
+        int dist = 0;
+        int32_t cand = Insert(pos);
+        if (cand >= 0)
+            length = FindMatch(pos, cand, 0, dist);
+
+        if (length >= MIN_MATCH)
+        {
+            Match(length, dist);
+            if (length <= level->lazy)
+            {
+                for (size_t i = pos + 1; i < pos + length; ++i)
+                    Insert(i);
+            }
+            pos += length;
+        }
+        else
+        {
+            Literal(in[pos]);
+            ++pos;
+        }
+    }
+}
+
+void Encoder::CompressLazy()
+{
+    size_t pos = 0;
+    int prevLength = 0;
+    int prevDist = 0;
+    bool pending = false;
+
+    while (pos < size)
+    {
+        int length = 0;
+        int dist = 0;
+        int32_t cand = Insert(pos);
+        if (cand >= 0 && prevLength < level->lazy)
+            length = FindMatch(pos, cand, prevLength, dist);
+
+        //Keep the previous match if the one here isn't longer
+        if (prevLength >= MIN_MATCH && length <= prevLength)
+        {
+            size_t end = pos - 1 + prevLength;
+            Match(prevLength, prevDist);
+            for (size_t i = pos + 1; i < end; ++i)
+                Insert(i);
+            pos = end;
+            prevLength = 0;
+            pending = false;
+            continue;
+        }
+
+        if (pending)
+            Literal(in[pos - 1]);
+        pending = true;
+        prevLength = length;
+        prevDist = dist;
+        ++pos;
+    }
+
+    if (pending)
+        Literal(in[pos - 1]);
+}
+
+//Estimated bit costs of each literal, match length and distance code
+struct Costs
+{
+    float literal[256];
+    float length[MAX_MATCH + 1];
+    float dist[NUM_DIST];
+};
+
+static void FixedCosts(Costs& costs)
+{
+    for (int i = 0; i < 256; ++i)
+        costs.literal[i] = tables.fixedLitLen[i];
+    for (int len = MIN_MATCH; len <= MAX_MATCH; ++len)
+    {
+        int lc = tables.lengthCode[len];
+        costs.length[len] = static_cast<float>(tables.fixedLitLen[257 + lc] + lengthExtra[lc]);
+    }
+    for (int i = 0; i < NUM_DIST; ++i)
+        costs.dist[i] = static_cast<float>(5 + distExtra[i]);
+}
+
+//Entropy of the symbol statistics of the previous parse
+static void StatCosts(const uint32_t* litFreq, const uint32_t* distFreq, Costs& costs)
+{
+    float litCost[NUM_LITLEN];
+    float distCost[NUM_DIST];
+    uint32_t litTotal = 0;
+    uint32_t distTotal = 0;
+    for (int i = 0; i < NUM_LITLEN; ++i)
+        litTotal += litFreq[i];
+    for (int i = 0; i < NUM_DIST; ++i)
+        distTotal += distFreq[i];
+
+    float litLog = log2f(static_cast<float>(max(litTotal, 1u)));
+    float distLog = log2f(static_cast<float>(max(distTotal, 1u)));
+    for (int i = 0; i < NUM_LITLEN; ++i)
+        litCost[i] = litFreq[i] ? litLog - log2f(static_cast<float>(litFreq[i])) : litLog + 1.0f;
+    for (int i = 0; i < NUM_DIST; ++i)
+        distCost[i] = distFreq[i] ? distLog - log2f(static_cast<float>(distFreq[i])) : distLog + 1.0f;
+
+    for (int i = 0; i < 256; ++i)
+        costs.literal[i] = litCost[i];
+    for (int len = MIN_MATCH; len <= MAX_MATCH; ++len)
+    {
+        int lc = tables.lengthCode[len];
+        costs.length[len] = litCost[257 + lc] + lengthExtra[lc];
+    }
+    for (int i = 0; i < NUM_DIST; ++i)
+        costs.dist[i] = distCost[i] + distExtra[i];
+}
+
+//Collects, for every position in [start, end), the matches that are longer than all
+//closer ones, which is every (length, distance) pair a shortest path could use
+static void FindMatches(const uint8_t* in, size_t size, size_t start, size_t end, const DeflateLevel* level, vector<uint32_t>& matches, vector<uint8_t>& counts)
+{
+    vector<int32_t> head(HASH_SIZE, -1);
+    vector<int32_t> prev(WINDOW_SIZE, -1);
+    auto insert = [&](size_t pos)
+    {
+        if (pos + 4 > size)
+            return -1;
+        uint32_t h = Hash(Read32(in + pos) & 0xffffff);
+        int32_t cand = head[h];
+        prev[pos & WINDOW_MASK] = cand;
+        head[h] = static_cast<int32_t>(pos);
+        return cand;
+    };
+
+    for (size_t pos = start > WINDOW_SIZE ? start - WINDOW_SIZE : 0; pos < start; ++pos)
+        insert(pos);
+
+    matches.assign((end - start) * OPTIMAL_MATCHES, 0);
+    counts.assign(end - start, 0);
+
+    for (size_t pos = start; pos < end; ++pos)
+    {
+        int32_t cand = insert(pos);
+        int maxLength = static_cast<int>(min(static_cast<size_t>(MAX_MATCH), end - pos));
+        int best = MIN_MATCH - 1;
+        int chain = level->chain;
+        uint32_t* found = &matches[(pos - start) * OPTIMAL_MATCHES];
+        uint8_t& count = counts[pos - start];
+        const uint8_t* cur = in + pos;
+
+        while (cand >= 0 && pos - cand < WINDOW_SIZE && chain-- > 0 && best < maxLength)
+        {
+            const uint8_t* match = in + cand;
+            if (match[best] == cur[best])
+            {
+                int length = MatchLength(match, cur, maxLength);
+                if (length > best)
+                {
+                    //When full, the longest match replaces the last one
+                    if (count == OPTIMAL_MATCHES)
+                        --count;
+                    found[count++] = (static_cast<uint32_t>(pos - cand) << 16) | static_cast<uint32_t>(length);
+                    best = length;
+                    if (length >= level->nice)
+                        break;
+                }
+            }
+
+            int32_t next = prev[cand & WINDOW_MASK];
+            if (next >= cand)
+                break;
+            cand = next;
+        }
+    }
+}
+
+//Finds the cheapest parse of [start, end) under the given costs
+static void ParseOptimal(const uint8_t* in, size_t start, size_t end, const vector<uint32_t>& matches, const vector<uint8_t>& counts, const Costs& costs, vector<float>& cost, vector<uint32_t>& choice, vector<uint32_t>& symbols)
+{
+    size_t n = end - start;
+    cost.assign(n + 1, FLT_MAX);
+    choice.assign(n + 1, 0);
+    cost[0] = 0.0f;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        float base = cost[i];
+        float c = base + costs.literal[in[start + i]];
+        if (c < cost[i + 1])
+        {
+            cost[i + 1] = c;
+            choice[i + 1] = 1;
+        }
+
+        const uint32_t* found = &matches[i * OPTIMAL_MATCHES];
+        int count = counts[i];
+        int k = 0;
+        int prevLength = MIN_MATCH - 1;
+
+        //Inside long repeats only the longest match is worth trying
+        if (count > 0 && (found[count - 1] & 0xffff) == MAX_MATCH)
+        {
+            k = count - 1;
+            prevLength = MAX_MATCH - 1;
+        }
+
+        for (; k < count; ++k)
+        {
+            int length = found[k] & 0xffff;
+            int dist = found[k] >> 16;
+            float distCost = base + costs.dist[DistCode(dist)];
+            for (int len = prevLength + 1; len <= length; ++len)
+            {
+                c = distCost + costs.length[len];
+                if (c < cost[i + len])
+                {
+                    cost[i + len] = c;
+                    choice[i + len] = (static_cast<uint32_t>(dist) << 16) | static_cast<uint32_t>(len);
+                }
+            }
+            prevLength = length;
+        }
+    }
+
+    symbols.clear();
+    for (size_t j = n; j > 0;)
+    {
+        uint32_t step = choice[j];
+        if (step == 1)
+        {
+            symbols.push_back(in[start + j - 1]);
+            --j;
+        }
+        else
+        {
+            symbols.push_back(step);
+            j -= step & 0xffff;
+        }
+    }
+    reverse(symbols.begin(), symbols.end());
+}
+
+//Iterates the shortest path parse, feeding each parse's statistics back in as costs,
+//and keeps the parse that gives the smallest block
+static void OptimizeBlock(const uint8_t* in, size_t size, size_t start, size_t end, const DeflateLevel* level, vector<uint32_t>& best)
+{
+    vector<uint32_t> matches;
+    vector<uint8_t> counts;
+    vector<float> cost;
+    vector<uint32_t> choice;
+    vector<uint32_t> symbols;
+    Costs costs;
+    BlockPlan plan;
+    uint64_t bestBits = UINT64_MAX;
+    int stale = 0;
+
+    FindMatches(in, size, start, end, level, matches, counts);
+    FixedCosts(costs);
+
+    for (int i = 0; i < OPTIMAL_ITERATIONS && stale < 3; ++i)
+    {
+        ParseOptimal(in, start, end, matches, counts, costs, cost, choice, symbols);
+
+        uint32_t litFreq[NUM_LITLEN] = {};
+        uint32_t distFreq[NUM_DIST] = {};
+        for (uint32_t symbol : symbols)
+        {
+            if (symbol < 256)
+                litFreq[symbol]++;
+            else
+            {
+                litFreq[257 + tables.lengthCode[symbol & 0xffff]]++;
+                distFreq[DistCode(symbol >> 16)]++;
+            }
+        }
+        litFreq[256] = 1;
+
+        PlanBlock(litFreq, distFreq, plan);
+        uint64_t bits = min(plan.dynamicBits, plan.fixedBits);
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            best.swap(symbols);
+            stale = 0;
+        }
+        else
+            ++stale;
+
+        StatCosts(litFreq, distFreq, costs);
+    }
+}
+
+static void DeflateOptimal(Encoder& encoder, const DeflateLevel* level)
+{
+    int blocks = static_cast<int>((encoder.size + OPTIMAL_BLOCK - 1) / OPTIMAL_BLOCK);
+    vector<vector<uint32_t>> parsed(blocks);
+
+    //Blocks only read the input, so they are parsed in parallel and written in order
+    ParallelFor(blocks, [&](int i)
+    {
+        size_t start = static_cast<size_t>(i) * OPTIMAL_BLOCK;
+        OptimizeBlock(encoder.in, encoder.size, start, min(start + OPTIMAL_BLOCK, encoder.size), level, parsed[i]);
+    });
+
+    for (int i = 0; i < blocks; ++i)
+    {
+        for (uint32_t symbol : parsed[i])
+        {
+            if (symbol < 256)
+                encoder.Literal(static_cast<uint8_t>(symbol));
+            else
+                encoder.Match(symbol & 0xffff, symbol >> 16);
+        }
+        vector<uint32_t>().swap(parsed[i]);
+        if (i + 1 < blocks)
+            encoder.FlushBlock(false);
+    }
+}
+
+unsigned Deflate(unsigned char** out, size_t* outSize, const unsigned char* in, size_t inSize, const LodePNGCompressSettings* settings)
+{
+    const DeflateLevel* level = &levels[DEFLATE_DEFAULT_LEVEL];
+    if (settings && settings->custom_context)
+        level = reinterpret_cast<const DeflateLevel*>(settings->custom_context);
+
+    //Every block is at most as large as storing it, plus slack for the bit writer
+    size_t bound = inSize + 5 * (inSize / 16383 + 4) + 64;
+    uint8_t* data = reinterpret_cast<uint8_t*>(malloc(bound));
+    if (!data)
+        return 83;
+
+    Encoder encoder(in, inSize, level, data);
+    if (level->optimal)
+        DeflateOptimal(encoder, level);
+    else if (level->greedy)
+        encoder.CompressGreedy();
+    else
+        encoder.CompressLazy();
+    encoder.FlushBlock(true);
+    encoder.out.Align();
+
+    *out = data;
+    *outSize = encoder.out.pos;
+    return 0;
+}
+
+void UseDeflate(LodePNGCompressSettings& settings, int level)
+{
+    level = max(DEFLATE_MIN_LEVEL, min(level, DEFLATE_OPTIMAL));
+    settings.custom_deflate = Deflate;
+    settings.custom_context = &levels[level];
+}
@@ -0,0 +1,21 @@
+#ifndef deflate_hpp
+#define deflate_hpp
+
+#include <cstddef>
+#include "lodepng.h"
+
+#define DEFLATE_MIN_LEVEL 1
+#define DEFLATE_MAX_LEVEL 9
+#define DEFLATE_DEFAULT_LEVEL 6
+#define DEFLATE_OPTIMAL 10
+
+// Compresses in into a raw deflate stream, matching lodepng's custom_deflate
+// signature. The level is read from settings->custom_context (see UseDeflate),
+// *out is allocated with malloc and must be freed by the caller.
+unsigned Deflate(unsigned char** out, size_t* outSize, const unsigned char* in, size_t inSize, const LodePNGCompressSettings* settings);
+
+// Routes lodepng's zlib encoder through Deflate at the given level (1-9, or
+// DEFLATE_OPTIMAL for iterated optimal parsing, which is much slower)
+void UseDeflate(LodePNGCompressSettings& settings, int level);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef dither_hpp
+#define dither_hpp
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+enum Dither
+{
+    DITHER_NONE,
+    DITHER_ORDERED,
+    DITHER_DIFFUSION
+};
+
+//Dithers a w x h rect of pixels down to fewer colors. For every pixel, load(x, y, v) fills
+//v with its channels, or returns false if it has dealt with the pixel itself. Channels with
+//a spread are then offset by the 4x4 Bayer matrix scaled by it, or by the error carried
+//onto them, and nearest(x, y, v, chosen) stores the color the pixel becomes, setting chosen
+//to its channels so the difference can be diffused on. The matrix is anchored to the rect,
+//so a sprite dithers the same wherever it's placed.
+template<int Channels, typename Load, typename Nearest>
+void DitherRect(int w, int h, Dither dither, const float (&spread)[Channels], Load load, Nearest nearest)
+{
+    static const int bayer[4][4] = { { 0, 8, 2, 10 }, { 12, 4, 14, 6 }, { 3, 11, 1, 9 }, { 15, 7, 13, 5 } };
+
+    //Floyd-Steinberg error for this row and the next, with a pixel of border either side
+    bool diffuse = dither == DITHER_DIFFUSION;
+    vector<float> errors(diffuse ? (w + 2) * Channels * 2 : 0, 0.0f);
+
+    for (int y = 0; y < h; ++y)
+    {
+        float* row = diffuse ? &errors[(y & 1) * (w + 2) * Channels] : nullptr;
+        float* next = diffuse ? &errors[((y + 1) & 1) * (w + 2) * Channels] : nullptr;
+        if (diffuse)
+            fill(next, next + (w + 2) * Channels, 0.0f);
+
+        for (int x = 0; x < w; ++x)
+        {
+            float v[Channels];
+            if (!load(x, y, v))
+                continue;
+
+            for (int c = 0; c < Channels; ++c)
+            {
+                if (spread[c] == 0.0f)
+                    continue;
+                if (dither == DITHER_ORDERED)
+                    v[c] += ((bayer[y & 3][x & 3] + 0.5f) / 16.0f - 0.5f) * spread[c];
+                else if (diffuse)
+                    v[c] += row[(x + 1) * Channels + c];
+            }
+
+            float chosen[Channels];
+            nearest(x, y, v, chosen);
+
+            if (diffuse)
+            {
+                for (int c = 0; c < Channels; ++c)
+                {
+                    if (spread[c] == 0.0f)
+                        continue;
+                    float e = v[c] - chosen[c];
+                    row[(x + 2) * Channels + c] += e * 7.0f / 16.0f;
+                    next[x * Channels + c] += e * 3.0f / 16.0f;
+                    next[(x + 1) * Channels + c] += e * 5.0f / 16.0f;
+                    next[(x + 2) * Channels + c] += e / 16.0f;
+                }
+            }
+        }
+    }
+}
+
+#endif
@@ -36,15 +36,37 @@
 
 using namespace std;
 
-size_t GetHashBKDR(const string& str)
+//Continues a BKDR hash over more bytes. Eight are folded in per step with the seed's
+//powers, which wraps around exactly like multiplying them in one at a time but doesn't
+//wait on a multiply for every byte.
+static size_t FoldBKDR(size_t hash, const char* data, size_t size)
 {
     size_t seed = 131;
-    size_t hash = 0;
-    int len = str.length();
-    for (int i = 0; i < len; ++i) {
-        hash = hash * seed + str[i];
+    size_t powers[9] = { 1 };
+    for (int i = 1; i < 9; ++i)
+        powers[i] = powers[i - 1] * seed;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        size_t block = 0;
+        for (int j = 0; j < 8; ++j)
+            block += static_cast<size_t>(data[i + j]) * powers[7 - j];
+        hash = hash * powers[8] + block;
     }
-    return hash & 0x7fffffff;
+    for (; i < size; ++i)
+        hash = hash * seed + data[i];
+    return hash;
+}
+
+size_t GetHashBKDR(const char* data, size_t size)
+{
+    return FoldBKDR(0, data, size) & 0x7fffffff;
+}
+
+size_t GetHashBKDR(const string& str)
+{
+    return GetHashBKDR(str.data(), str.length());
 }
 
 void HashCombine(size_t& hash, const string& s)
@@ -52,7 +74,7 @@ void HashCombine(size_t& hash, const string& s)
     // std::hash<T> hasher;
     // hash ^= hasher(v) + 0x9e3779b9 + (hash<<6) + (hash>>2);
     // std::hash can differ on different platforms
-    hash ^= GetHashBKDR(s) + 0x9e3779b9 + (hash<<6) + (hash>>2);
+    HashCombine(hash, GetHashBKDR(s));
 }
 void HashCombine(size_t& hash, size_t v)
 {
@@ -83,8 +105,7 @@ void HashFile(size_t& hash, const string& file, bool checkTime)
         exit(EXIT_FAILURE);
     }
     buffer[size] = '\0';
-    string text(buffer.begin(), buffer.end());
-    HashCombine(hash, text);
+    HashCombine(hash, GetHashBKDR(buffer.data(), buffer.size()));
 }
 
 void HashFiles(size_t& hash, const string& root, bool checkTime)
@@ -114,8 +135,22 @@ void HashFiles(size_t& hash, const string& root, bool checkTime)
 
 void HashData(size_t& hash, const char* data, size_t size)
 {
-    string str(data, size);
-    HashCombine(hash, str);
+    HashCombine(hash, GetHashBKDR(data, size));
+}
+
+//Hashes rows stride bytes apart the same as HashData would the rows back to back
+void HashRows(size_t& hash, const char* data, size_t rowSize, size_t rows, size_t stride)
+{
+    size_t running = 0;
+    for (size_t y = 0; y < rows; ++y)
+        running = FoldBKDR(running, data + y * stride, rowSize);
+    HashCombine(hash, running & 0x7fffffff);
+}
+
+//Carries on a running hash with more bytes, so a string's hash can start from its prefix's
+size_t FoldHash(size_t running, const char* data, size_t size)
+{
+    return FoldBKDR(running, data, size);
 }
 
 bool LoadHash(size_t& hash, const string& file)
@@ -34,6 +34,8 @@ void HashString(size_t& hash, const std::string& str);
 void HashFile(size_t& hash, const std::string& file, bool checkTime);
 void HashFiles(size_t& hash, const std::string& root, bool checkTime);
 void HashData(size_t& hash, const char* data, size_t size);
+void HashRows(size_t& hash, const char* data, size_t rowSize, size_t rows, size_t stride);
+size_t FoldHash(size_t running, const char* data, size_t size);
 bool LoadHash(size_t& hash, const std::string& file);
 void SaveHash(size_t hash, const std::string& file);
 
@@ -0,0 +1,569 @@
+#include "inflate.hpp"
+#include "simd.hpp"
+#include "arena.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+#define MAX_BITS 15
+#define LITLEN_BITS 11
+#define DIST_BITS 8
+#define CODELEN_BITS 7
+#define LITLEN_SIZE ((1 << LITLEN_BITS) + 288 * (1 << (MAX_BITS - LITLEN_BITS)))
+#define DIST_SIZE ((1 << DIST_BITS) + 32 * (1 << (MAX_BITS - DIST_BITS)))
+#define NUM_CODELEN 19
+#define OUTPUT_SLACK 16
+#define INPUT_OVERRUN 8
+
+//Table entries: bits 0-7 hold the code length to consume, 8-11 the kind, 12-15 the
+//number of extra bits (or a subtable's index bits) and 16-31 the value. Two literal
+//entries carry the second literal in bits 24-31.
+#define ENTRY_LITERAL 0
+#define ENTRY_LITERAL2 1
+#define ENTRY_BASE 2
+#define ENTRY_END 3
+#define ENTRY_SUB 4
+#define ENTRY_INVALID 5
+
+static inline uint32_t Entry(int kind, int extra, uint32_t value)
+{
+    return (uint32_t)(kind << 8) | (uint32_t)(extra << 12) | (value << 16);
+}
+
+static inline int EntryKind(uint32_t e)
+{
+    return (e >> 8) & 15;
+}
+
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t codeLengthOrder[NUM_CODELEN] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+//What each symbol decodes to, without its code length
+static struct Symbols
+{
+    uint32_t litLen[288];
+    uint32_t dist[32];
+    uint32_t codeLen[NUM_CODELEN];
+    Symbols();
+} symbols;
+
+Symbols::Symbols()
+{
+    for (int i = 0; i < 256; ++i)
+        litLen[i] = Entry(ENTRY_LITERAL, 0, i);
+    litLen[256] = Entry(ENTRY_END, 0, 0);
+    for (int i = 0; i < 29; ++i)
+        litLen[257 + i] = Entry(ENTRY_BASE, lengthExtra[i], lengthBase[i]);
+    litLen[286] = litLen[287] = Entry(ENTRY_INVALID, 0, 0);
+    for (int i = 0; i < 30; ++i)
+        dist[i] = Entry(ENTRY_BASE, distExtra[i], distBase[i]);
+    dist[30] = dist[31] = Entry(ENTRY_INVALID, 0, 0);
+    for (int i = 0; i < NUM_CODELEN; ++i)
+        codeLen[i] = Entry(ENTRY_LITERAL, 0, i);
+}
+
+static uint32_t ReverseBits(uint32_t code, int length)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < length; ++i)
+    {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
+}
+
+//Builds a lookup table indexed by the next tableBits input bits. Longer codes go to
+//subtables placed after the main table. Incomplete codes are allowed, the unused
+//entries decode as invalid. Returns false for an over-subscribed code.
+static bool BuildTable(uint32_t* table, int tableBits, const uint8_t* lengths, int count, const uint32_t* entries)
+{
+    int counts[MAX_BITS + 1] = {};
+    for (int i = 0; i < count; ++i)
+        counts[lengths[i]]++;
+    counts[0] = 0;
+
+    int left = 1;
+    int maxLength = 0;
+    for (int len = 1; len <= MAX_BITS; ++len)
+    {
+        left = (left << 1) - counts[len];
+        if (left < 0)
+            return false;
+        if (counts[len])
+            maxLength = len;
+    }
+
+    uint32_t nextCode[MAX_BITS + 1];
+    uint32_t code = 0;
+    for (int len = 1; len <= MAX_BITS; ++len)
+    {
+        code = (code + counts[len - 1]) << 1;
+        nextCode[len] = code;
+    }
+
+    int size = 1 << tableBits;
+    int subBits = max(maxLength - tableBits, 0);
+    int subSize = 1 << subBits;
+    int nextSub = size;
+    uint32_t invalid = Entry(ENTRY_INVALID, 0, 0) | 1;
+    fill(table, table + size, invalid);
+
+    //Walk the symbols shortest code first so subtable prefixes never hit a short code
+    for (int len = 1; len <= maxLength; ++len)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (lengths[i] != len)
+                continue;
+            uint32_t rev = ReverseBits(nextCode[len]++, len);
+            uint32_t entry = entries[i] | len;
+            if (len <= tableBits)
+            {
+                for (uint32_t r = rev; r < (uint32_t)size; r += 1 << len)
+                    table[r] = entry;
+            }
+            else
+            {
+                uint32_t& head = table[rev & (size - 1)];
+                if (EntryKind(head) != ENTRY_SUB)
+                {
+                    head = Entry(ENTRY_SUB, subBits, nextSub) | tableBits;
+                    fill(table + nextSub, table + nextSub + subSize, invalid);
+                    nextSub += subSize;
+                }
+                uint32_t* sub = table + (head >> 16);
+                for (uint32_t r = rev >> tableBits; r < (uint32_t)subSize; r += 1 << (len - tableBits))
+                    sub[r] = entry;
+            }
+        }
+    }
+    return true;
+}
+
+//Lets a single lookup emit two literals when both codes fit in the main table bits.
+//Runs from the top down, so entry i >> len1 is always still single when read.
+static void PairLiterals(uint32_t* table, int tableBits)
+{
+    for (int i = (1 << tableBits) - 1; i >= 0; --i)
+    {
+        uint32_t first = table[i];
+        if (EntryKind(first) != ENTRY_LITERAL)
+            continue;
+        int len1 = first & 0xff;
+        uint32_t second = table[i >> len1];
+        int len2 = second & 0xff;
+        if (EntryKind(second) != ENTRY_LITERAL || len1 + len2 > tableBits)
+            continue;
+        table[i] = Entry(ENTRY_LITERAL2, 0, 0) | (first & 0xff0000) | ((second & 0xff0000) << 8) | (len1 + len2);
+    }
+}
+
+static struct FixedTables
+{
+    uint32_t litLen[LITLEN_SIZE];
+    uint32_t dist[DIST_SIZE];
+    FixedTables();
+} fixedTables;
+
+FixedTables::FixedTables()
+{
+    uint8_t lengths[288];
+    for (int i = 0; i < 288; ++i)
+        lengths[i] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+    BuildTable(litLen, LITLEN_BITS, lengths, 288, symbols.litLen);
+    PairLiterals(litLen, LITLEN_BITS);
+    for (int i = 0; i < 32; ++i)
+        lengths[i] = 5;
+    BuildTable(dist, DIST_BITS, lengths, 32, symbols.dist);
+}
+
+static inline uint64_t Read64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void Copy16(uint8_t* dst, const uint8_t* src)
+{
+    uint8_t v[16];
+    memcpy(v, src, sizeof(v));
+    memcpy(dst, v, sizeof(v));
+}
+
+static inline void Copy8(uint8_t* dst, const uint8_t* src)
+{
+    uint64_t v;
+    memcpy(&v, src, sizeof(v));
+    memcpy(dst, &v, sizeof(v));
+}
+
+static inline void Copy4(uint8_t* dst, const uint8_t* src)
+{
+    uint32_t v;
+    memcpy(&v, src, sizeof(v));
+    memcpy(dst, &v, sizeof(v));
+}
+
+struct Inflater
+{
+    const uint8_t* in;
+    size_t inSize;
+    size_t inPos;
+    uint64_t bits;
+    int count;
+
+    uint8_t* out;
+    size_t outPos;
+    size_t outCap;
+    size_t maxSize;
+    bool growable;
+
+    uint32_t litLen[LITLEN_SIZE];
+    uint32_t dist[DIST_SIZE];
+
+    Inflater(const uint8_t* in, size_t inSize, uint8_t* out, size_t outPos, size_t outCap, bool growable, size_t maxSize);
+    bool Run();
+
+    inline void Refill();
+    inline uint32_t Bits(int n);
+    inline void Consume(int n);
+    bool Reserve(size_t n);
+    bool Stored();
+    bool Dynamic();
+    bool Codes(const uint32_t* litTable, const uint32_t* distTable);
+};
+
+Inflater::Inflater(const uint8_t* in, size_t inSize, uint8_t* out, size_t outPos, size_t outCap, bool growable, size_t maxSize)
+    : in(in), inSize(inSize), inPos(0), bits(0), count(0), out(out), outPos(outPos), outCap(outCap), maxSize(maxSize), growable(growable)
+{
+
+}
+
+//Tops the bit buffer up to at least 56 bits. Past the end of the input it shifts in
+//zeroes; Run checks afterwards that none of them were consumed.
+inline void Inflater::Refill()
+{
+    if (inPos + 8 <= inSize)
+    {
+        bits |= Read64(in + inPos) << count;
+        inPos += (63 - count) >> 3;
+        count |= 56;
+    }
+    else
+    {
+        while (count < 56)
+        {
+            if (inPos < inSize)
+                bits |= (uint64_t)in[inPos] << count;
+            ++inPos;
+            count += 8;
+        }
+    }
+}
+
+inline void Inflater::Consume(int n)
+{
+    bits >>= n;
+    count -= n;
+}
+
+inline uint32_t Inflater::Bits(int n)
+{
+    uint32_t v = (uint32_t)(bits & ((1ull << n) - 1));
+    Consume(n);
+    return v;
+}
+
+//Makes room for n more output bytes, growing the buffer if we own it
+bool Inflater::Reserve(size_t n)
+{
+    if (outCap - outPos >= n)
+        return true;
+    if (!growable || (maxSize && outPos + n > maxSize))
+        return false;
+    size_t cap = max(max(outCap * 2, outPos + n), (size_t)4096);
+    if (maxSize)
+        cap = min(cap, maxSize);
+    uint8_t* data = reinterpret_cast<uint8_t*>(ArenaReallocate(out, cap + OUTPUT_SLACK));
+    if (!data)
+        return false;
+    out = data;
+    outCap = cap;
+    return true;
+}
+
+bool Inflater::Stored()
+{
+    //Drop the partial byte, then hand back the whole bytes still in the bit buffer
+    Consume(count & 7);
+    size_t pos = inPos - count / 8;
+    bits = 0;
+    count = 0;
+    if (pos + 4 > inSize)
+        return false;
+    uint32_t len = in[pos] | (in[pos + 1] << 8);
+    uint32_t nlen = in[pos + 2] | (in[pos + 3] << 8);
+    pos += 4;
+    if (len != (~nlen & 0xffff) || pos + len > inSize || !Reserve(len))
+        return false;
+    memcpy(out + outPos, in + pos, len);
+    outPos += len;
+    inPos = pos + len;
+    return true;
+}
+
+bool Inflater::Dynamic()
+{
+    Refill();
+    int numLitLen = Bits(5) + 257;
+    int numDist = Bits(5) + 1;
+    int numCodeLen = Bits(4) + 4;
+    if (numLitLen > 286 || numDist > 30)
+        return false;
+
+    uint8_t codeLenLengths[NUM_CODELEN] = {};
+    for (int i = 0; i < numCodeLen; ++i)
+    {
+        Refill();
+        codeLenLengths[codeLengthOrder[i]] = Bits(3);
+    }
+
+    uint32_t codeLenTable[1 << CODELEN_BITS];
+    if (!BuildTable(codeLenTable, CODELEN_BITS, codeLenLengths, NUM_CODELEN, symbols.codeLen))
+        return false;
+
+    uint8_t lengths[286 + 30];
+    int total = numLitLen + numDist;
+    for (int i = 0; i < total;)
+    {
+        Refill();
+        uint32_t e = codeLenTable[bits & ((1 << CODELEN_BITS) - 1)];
+        if (EntryKind(e) != ENTRY_LITERAL)
+            return false;
+        Consume(e & 0xff);
+        int sym = e >> 16;
+        if (sym < 16)
+        {
+            lengths[i++] = sym;
+            continue;
+        }
+
+        int repeat;
+        uint8_t value = 0;
+        if (sym == 16)
+        {
+            if (i == 0)
+                return false;
+            value = lengths[i - 1];
+            repeat = 3 + Bits(2);
+        }
+        else if (sym == 17)
+            repeat = 3 + Bits(3);
+        else
+            repeat = 11 + Bits(7);
+        if (i + repeat > total)
+            return false;
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+
+    //Without an end of block code the block could never finish
+    if (lengths[256] == 0)
+        return false;
+    if (!BuildTable(litLen, LITLEN_BITS, lengths, numLitLen, symbols.litLen))
+        return false;
+    PairLiterals(litLen, LITLEN_BITS);
+    return BuildTable(dist, DIST_BITS, lengths + numLitLen, numDist, symbols.dist);
+}
+
+bool Inflater::Codes(const uint32_t* litTable, const uint32_t* distTable)
+{
+    for (;;)
+    {
+        //56 bits cover the longest symbol: 15 + 5 length bits, 15 + 13 distance bits
+        Refill();
+        if (inPos > inSize + INPUT_OVERRUN)
+            return false;
+
+        uint32_t e = litTable[bits & ((1 << LITLEN_BITS) - 1)];
+        if (EntryKind(e) == ENTRY_SUB)
+            e = litTable[(e >> 16) + ((bits >> LITLEN_BITS) & ((1u << ((e >> 12) & 15)) - 1))];
+        int kind = EntryKind(e);
+
+        if (kind <= ENTRY_LITERAL2)
+        {
+            int n = kind + 1;
+            if (outCap - outPos < (size_t)n && !Reserve(n))
+                return false;
+            out[outPos] = (uint8_t)(e >> 16);
+            if (n == 2)
+                out[outPos + 1] = (uint8_t)(e >> 24);
+            outPos += n;
+            Consume(e & 0xff);
+            continue;
+        }
+        if (kind != ENTRY_BASE)
+        {
+            Consume(e & 0xff);
+            return kind == ENTRY_END;
+        }
+
+        Consume(e & 0xff);
+        size_t length = (e >> 16) + Bits((e >> 12) & 15);
+
+        e = distTable[bits & ((1 << DIST_BITS) - 1)];
+        if (EntryKind(e) == ENTRY_SUB)
+            e = distTable[(e >> 16) + ((bits >> DIST_BITS) & ((1u << ((e >> 12) & 15)) - 1))];
+        if (EntryKind(e) != ENTRY_BASE)
+            return false;
+        Consume(e & 0xff);
+        size_t distance = (e >> 16) + Bits((e >> 12) & 15);
+
+        if (distance > outPos || (outCap - outPos < length && !Reserve(length)))
+            return false;
+
+        uint8_t* dst = out + outPos;
+        const uint8_t* src = dst - distance;
+        outPos += length;
+
+        //Wide copies may run up to 15 bytes past the match, which is fine as long as the
+        //buffer has room; owned buffers always keep OUTPUT_SLACK spare bytes
+        if (growable || outCap - outPos >= 16)
+        {
+            uint8_t* end = dst + length;
+            if (distance >= 16)
+            {
+                do
+                {
+                    Copy16(dst, src);
+                    dst += 16;
+                    src += 16;
+                }
+                while (dst < end);
+                continue;
+            }
+            if (distance >= 8)
+            {
+                do
+                {
+                    Copy8(dst, src);
+                    dst += 8;
+                    src += 8;
+                }
+                while (dst < end);
+                continue;
+            }
+            if (distance == 1)
+            {
+                memset(dst, *src, length);
+                continue;
+            }
+            if (distance >= 4)
+            {
+                do
+                {
+                    Copy4(dst, src);
+                    dst += 4;
+                    src += 4;
+                }
+                while (dst < end);
+                continue;
+            }
+        }
+        while (length--)
+            *dst++ = *src++;
+    }
+}
+
+bool Inflater::Run()
+{
+    bool final = false;
+    while (!final)
+    {
+        Refill();
+        final = Bits(1) != 0;
+        int type = Bits(2);
+
+        bool ok;
+        if (type == 0)
+            ok = Stored();
+        else if (type == 1)
+            ok = Codes(fixedTables.litLen, fixedTables.dist);
+        else if (type == 2)
+            ok = Dynamic() && Codes(litLen, dist);
+        else
+            ok = false;
+
+        if (!ok)
+            return false;
+    }
+
+    //Make sure the padding Refill shifts in past the end wasn't decoded as data
+    return inPos - count / 8 <= inSize;
+}
+
+bool Inflate(unsigned char* out, size_t outSize, const unsigned char* in, size_t inSize)
+{
+    Inflater* inflater = new Inflater(in, inSize, out, 0, outSize, false, 0);
+    bool ok = inflater->Run();
+    delete inflater;
+    return ok;
+}
+
+unsigned InflateZlib(unsigned char** out, size_t* outSize, const unsigned char* in, size_t inSize, const LodePNGDecompressSettings* settings)
+{
+    //Same error codes lodepng uses for a bad zlib header
+    if (inSize < 2)
+        return 53;
+    if ((in[0] * 256 + in[1]) % 31 != 0)
+        return 24;
+    if ((in[0] & 15) != 8 || (in[0] >> 4) > 7)
+        return 25;
+    if (in[1] & 32)
+        return 26;
+
+    size_t start = *outSize;
+    size_t expected = settings->custom_context ? *reinterpret_cast<const size_t*>(settings->custom_context) : 0;
+    size_t cap = start + max(expected, inSize * 4);
+    if (settings->max_output_size)
+        cap = min(cap, settings->max_output_size);
+
+    uint8_t* data = reinterpret_cast<uint8_t*>(ArenaReallocate(*out, cap + OUTPUT_SLACK));
+    if (!data)
+        return 83;
+
+    Inflater* inflater = new Inflater(in + 2, inSize - 2, data, start, cap, true, settings->max_output_size);
+    bool ok = inflater->Run();
+    size_t end = inflater->inPos - inflater->count / 8;
+    *out = inflater->out;
+    *outSize = inflater->outPos;
+    delete inflater;
+
+    if (!ok)
+        return 110;
+
+    if (!settings->ignore_adler32)
+    {
+        end += 2;
+        if (end + 4 > inSize)
+            return 52;
+        uint32_t adler = ((uint32_t)in[end] << 24) | (in[end + 1] << 16) | (in[end + 2] << 8) | in[end + 3];
+        if (adler != Adler32(1, *out + start, *outSize - start))
+            return 58;
+    }
+    return 0;
+}
+
+void UseInflate(LodePNGDecompressSettings& settings, const size_t* expectedSize)
+{
+    settings.custom_zlib = InflateZlib;
+    settings.custom_context = expectedSize;
+}
@@ -0,0 +1,22 @@
+#ifndef inflate_hpp
+#define inflate_hpp
+
+#include <cstddef>
+#include "lodepng.h"
+
+// Decompresses the raw deflate stream in into out, which must be big enough to hold
+// the whole result. Returns false if the stream is corrupt or doesn't fit. Anything
+// after the final block (such as a zlib checksum) is ignored.
+bool Inflate(unsigned char* out, size_t outSize, const unsigned char* in, size_t inSize);
+
+// Decompresses a zlib stream, matching lodepng's custom_zlib signature. If
+// settings->custom_context is set it points to a size_t with the expected output size,
+// used to size the buffer up front. *out is allocated like lodepng's own buffers, from
+// the thread's arena inside an ArenaScope.
+unsigned InflateZlib(unsigned char** out, size_t* outSize, const unsigned char* in, size_t inSize, const LodePNGDecompressSettings* settings);
+
+// Routes lodepng's zlib decoder through InflateZlib. expectedSize may be null, otherwise
+// it must stay alive until decoding is done.
+void UseInflate(LodePNGDecompressSettings& settings, const size_t* expectedSize);
+
+#endif
@@ -0,0 +1,101 @@
+#include "intern.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+//Every entry is its parent's text followed by its tail. Entry 0 is the empty string,
+//the parent of everything interned without a prefix, so parents always come first.
+struct Entry
+{
+    uint32_t parent;
+    string tail;
+    size_t hash;    //running hash of the whole text, whatever its prefixes are
+};
+
+static mutex tableLock;
+static vector<Entry> entries = { { 0, "", 0 } };
+static unordered_multimap<size_t, uint32_t> lookup;
+static vector<uint32_t> ranks;
+
+static string GetText(uint32_t id)
+{
+    string text = entries[id].tail;
+    for (id = entries[id].parent; id != 0; id = entries[id].parent)
+        text.insert(0, entries[id].tail);
+    return text;
+}
+
+Interned::Interned()
+    : id(0)
+{
+}
+
+Interned::Interned(const string& str)
+    : Interned(Interned(), str)
+{
+}
+
+Interned::Interned(Interned prefix, const string& tail)
+    : id(prefix.id)
+{
+    if (tail.empty())
+        return;
+
+    lock_guard<mutex> guard(tableLock);
+    size_t hash = FoldHash(entries[prefix.id].hash, tail.data(), tail.size());
+    auto range = lookup.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (entries[it->second].parent == prefix.id && entries[it->second].tail == tail)
+        {
+            id = it->second;
+            return;
+        }
+    }
+
+    id = static_cast<uint32_t>(entries.size());
+    entries.push_back({ prefix.id, tail, hash });
+    lookup.emplace(hash, id);
+}
+
+string Interned::Str() const
+{
+    lock_guard<mutex> guard(tableLock);
+    return GetText(id);
+}
+
+uint32_t Interned::SortKey() const
+{
+    lock_guard<mutex> guard(tableLock);
+    if (ranks.size() != entries.size())
+    {
+        //Parents come before their children, so each text only adds its tail
+        vector<string> texts(entries.size());
+        for (size_t i = 1; i < entries.size(); ++i)
+            texts[i] = texts[entries[i].parent] + entries[i].tail;
+
+        vector<uint32_t> order(entries.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = static_cast<uint32_t>(i);
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return texts[a] < texts[b]; });
+
+        ranks.resize(entries.size());
+        uint32_t rank = 0;
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            if (i > 0 && texts[order[i]] != texts[order[i - 1]])
+                ++rank;
+            ranks[order[i]] = rank;
+        }
+    }
+    return ranks[id];
+}
+
+ostream& operator<<(ostream& out, Interned str)
+{
+    return out << str.Str();
+}
@@ -0,0 +1,31 @@
+#ifndef intern_hpp
+#define intern_hpp
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+using namespace std;
+
+//A string kept once in a table shared by the whole run, so copying one is just copying
+//its id. Names loaded from the same directory share that directory as their prefix
+//rather than each holding a copy of it. Ids of equal text can differ when the text was
+//put together differently, so order and compare them by SortKey.
+struct Interned
+{
+    uint32_t id;
+
+    Interned();
+    explicit Interned(const string& str);
+    Interned(Interned prefix, const string& tail);
+
+    string Str() const;
+
+    //Where the text comes among every string interned so far, the same for equal text.
+    //They're worked out once per batch of new strings instead of comparing text each time.
+    uint32_t SortKey() const;
+};
+
+ostream& operator<<(ostream& out, Interned str);
+
+#endif
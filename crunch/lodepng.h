@@ -78,9 +78,10 @@ the custom_zlib field of the compress and decompress settings*/
 /*Compile the default allocators (C's free, malloc and realloc). If you disable this,
 you can define the functions lodepng_free, lodepng_malloc and lodepng_realloc in your
 source files with custom allocators.*/
-#ifndef LODEPNG_NO_COMPILE_ALLOCATORS
+/*crunch defines them in arena.cpp, so sprites are decoded into per thread arenas*/
+/*#ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
-#endif
+#endif*/
 
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
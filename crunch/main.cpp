@@ -29,6 +29,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <iomanip>
 #if defined(_WIN32) || defined(_WIN64)
 #include "getopt.h"
 #else
@@ -42,8 +43,20 @@
 #include "str.hpp"
 #include "time.hpp"
 #include "palette.h"
+#include "deflate.hpp"
+#include "parallel.hpp"
+#include "inflate.hpp"
+#include "texture.hpp"
+#include "dedup.hpp"
+#include "tiles.hpp"
+#include "spill.hpp"
+#include "arena.hpp"
+#include "plan.hpp"
 
 #define CUTE_ASEPRITE_IMPLEMENTATION
+#define CUTE_ASEPRITE_INFLATE(in, inBytes, out, outBytes, ctx) Inflate((unsigned char*)(out), (size_t)(outBytes), (const unsigned char*)(in), (size_t)(inBytes))
+#define CUTE_ASEPRITE_ALLOC(size, ctx) ArenaAllocate(size)
+#define CUTE_ASEPRITE_FREE(mem, ctx) ArenaFree(mem)
 #include "cute_aseprite.h"
 
 #define EXIT_SKIPPED 2
@@ -51,7 +64,7 @@
 using namespace std;
 
 const char *version = "v0.20";
-const int binVersion = 0;
+const int binVersion = 4;
 
 #define NAME_LENGTH 16
 
@@ -70,6 +83,14 @@ enum StringType
     FIXED_LENGTH
 };
 
+//Options without a short form, numbered past every character getopt can return
+enum LongOption
+{
+    OPTION_ROUND_ALPHA = 256,
+    OPTION_MEMORY_LIMIT,
+    OPTION_PLAN
+};
+
 static struct options
 {
     const char *inputFilename;
@@ -79,22 +100,39 @@ static struct options
     int width;
     int height;
     int padding;
+    int compression;
     StringType binstr;
     OutputFormat output_format;
     int texture_format;
+    TextureContainer container;
+    Dither dither;
+    Quantize quantize;
+    bool banks;
+    PaletteFormat bankFormat;
     bool alpha;
+    bool roundAlpha;
     bool trim;
     bool verbose;
     bool ignore;
     bool unique;
+    bool transforms;
+    int tiles;
     bool rotate;
+    bool channels;
     bool last;
     bool dirs;
     bool nozero;
+    bool mips;
+    size_t memoryLimit;
+    bool plan;
 } options;
 
 static vector<Bitmap *> bitmaps;
 static vector<Packer *> packers;
+static DedupIndex dedupIndex;
+static vector<pair<Bitmap *, Bitmap *>> duplicates;
+static vector<pair<string, string>> queuedFiles;
+static size_t spillCursor;
 
 static const char *helpMessage =
     "usage:\n"
@@ -105,17 +143,30 @@ static const char *helpMessage =
     "\n"
     "options:\n"
     "   -o --output <xml|bin|json>  saves the atlas data in xml, binary or json format\n"
-    "   -f --format <n>             texture format\n"
+    "   -f --format <n|bc1|bc3|bc7|rgb565|rgba5551|rgba4444|r8|a8> texture format written to the atlas data, bc1 (71), bc3 (77) and bc7 (98) also save block compressed pages instead of png, rgb565 (85), rgba5551 (86) and rgba4444 (191) save 16 bit pages with a png preview, r8 (61) and a8 (65) keep only the red or alpha of each sprite and save grayscale pages\n"
+    "   -e --container <dds|ktx2>   container for block compressed and 16 bit pages (default dds)\n"
+    "   -m --mips                   include a full mip chain in block compressed and 16 bit pages\n"
+    "   -y --dither <none|ordered|diffusion> dithering used when reducing sprites to a 16 bit format or remapping rgba sprites onto a palette (default none)\n"
+    "   -q --quantize <lossless|lossy> saves png pages indexed, lossless only when a page has at most 256 colors, lossy reducing any page to 256\n"
+    "   -g --banks <act|jasc|mspal|gimp|paintnet> sorts the colors of indexed sprites into 16 color palette banks, saving the combined palette in this format\n"
     "   -a --alpha                  premultiplies the pixels of the bitmaps by their alpha channel\n"
+    "      --round-alpha            rounds premultiplied channels to the nearest value instead of truncating them\n"
     "   -t --trim                   trims excess transparency off the bitmaps\n"
     "   -v --verbose                print to the debug console as the packer works\n"
     "   -i --ignore                 ignore the hash, forcing the packer to repack\n"
     "   -u --unique                 remove duplicate bitmaps from the atlas\n"
+    "   -x --transforms             with --unique, also finds duplicates that are flipped, rotated or transposed copies, with --tiles also transposed tiles\n"
+    "   -z --tiles <8|16|32>        cuts the bitmaps into tiles of this size and packs only the unique ones, flips included, writing a tilemap for each bitmap\n"
     "   -r --rotate                 enabled rotating bitmaps 90 degrees clockwise when packing\n"
+    "   -k --channels               packs four single channel atlases into the r, g, b and a planes of each page (needs --format a8 or r8)\n"
     "   -s --size <n>               max atlas size (<n> can be 4096, 2048, 1024, 512, 256, 128, or 64)\n"
     "   -w --width <n>              max atlas width (overrides --size) (<n> can be 4096, 2048, 1024, 512, 256, 128, or 64)\n"
     "   -h --height <n>             max atlas height (overrides --size) (<n> can be 4096, 2048, 1024, 512, 256, 128, or 64)\n"
     "   -p --padding <n>            padding between images (<n> can be from 0 to 16)\n"
+    "   -c --png-compress <n|max>   png compression level (<n> can be from 1 to 9, default 6, max tries every filter strategy with optimal parsing)\n"
+    "   -j --threads <n>            number of worker threads (defaults to the number of hardware threads)\n"
+    "      --memory-limit <mb>      keeps at most this many megabytes of sprite pixels in memory, writing the rest to a scratch file until the pages are drawn\n"
+    "      --plan                   reads only the image headers and prints the pages the atlas would need and their memory in each format, reusing the trimmed sizes saved by the last run, without writing anything\n"
     "   -b --binstr <n|p|7|f>       string type in binary format (n: null-terminated, p: prefixed (int16), 7: 7-bit prefixed, f: fixed 16 bytes)\n"
     "   -l --last                   use file's last write time instead of its content for hashing\n"
     "   -d --dirs                   split output textures by subdirectories\n"
@@ -125,10 +176,12 @@ static const char *helpMessage =
     "  act, jasc, mspal, gimp, paint.net and png.\n"
     "binary format:\n"
     "crch (0x68637263 in hex or 1751347811 in decimal)\n"
-    "[int16] version (current version is 0)"
+    "[int16] version (current version is 4)\n"
     "[byte] --trim enabled\n"
     "[byte] --rotate enabled\n"
-    "[byte] string type (0 - null-termainated, 1 - prefixed (int16), 2 - 7-bit prefixed, f: fixed 16 bytes)\n"
+    "[byte] --channels enabled\n"
+    "[byte] string type (0 - null-termainated, 1 - prefixed (int16), 2 - 7-bit prefixed, 3 - fixed 16 bytes)\n"
+    "[byte] --tiles size (0 if not enabled)\n"
     "[int16] num_textures (below block is repeated this many times)\n"
     "  [string] name\n"
     "  [int16] tex_width\n"
@@ -149,7 +202,18 @@ static const char *helpMessage =
     "    [int16] img_frame_width     (if --trim enabled)\n"
     "    [int16] img_frame_height    (if --trim enabled)\n"
     "    [byte] img_rotated          (if --rotate enabled)\n"
-    "    [byte] img_slot";
+    "    [byte] img_channel          (if --channels enabled)\n"
+    "    [byte] img_palette_slot\n"
+    "    [int16] img_alias           (index of the image this one shares pixels with, or -1)\n"
+    "    [byte] img_transform        (how the alias's pixels come from its original's, 0 if it's an exact copy)\n"
+    "[int16] num_tilemaps (if --tiles enabled, below block is repeated this many times)\n"
+    "  [string] map_name\n"
+    "  [int16] map_frame_index\n"
+    "  [int16] map_columns\n"
+    "  [int16] map_rows\n"
+    "  [byte] map_palette_slot\n"
+    "    [int16] cell_tile           (repeated columns * rows times, row by row, with the byte below)\n"
+    "    [byte] cell_transform";
 
 static void SplitFileName(const string &path, string *dir, string *name, string *ext)
 {
@@ -187,16 +251,48 @@ static string GetFileName(const string &path)
     return name;
 }
 
-static void LoadBitmap(const string &prefix, const string &path)
+//With --unique, a bitmap whose pixels were already loaded gives them up straight away and
+//only comes back as an alias once its original has been packed. Palette banks change
+//the indices, so those sprites are only deduplicated once they're remapped. The keys are
+//worked out across the workers, but bitmaps are looked up in the order they're given,
+//so the same ones stay originals however the work was split.
+static void AddBitmaps(const vector<Bitmap *> &added, bool dedup)
 {
-    if (options.verbose)
-        cout << '\t' << path << endl;
+    vector<size_t> hashes(added.size());
+    vector<int> canonicals(added.size());
+    if (dedup)
+    {
+        ParallelFor(static_cast<int>(added.size()), [&](int i)
+        {
+            hashes[i] = dedupIndex.Hash(added[i], canonicals[i]);
+        });
+    }
 
-    bitmaps.push_back(new Bitmap(path, prefix + GetFileName(path), options.alpha, options.trim, options.verbose));
+    for (size_t i = 0; i < added.size(); ++i)
+    {
+        Bitmap *bitmap = added[i];
+        Bitmap *original = dedup ? dedupIndex.Insert(bitmap, hashes[i], canonicals[i], bitmap->transform) : nullptr;
+        if (original)
+        {
+            bitmap->FreePixels();
+            duplicates.emplace_back(bitmap, original);
+        }
+        else
+            bitmaps.push_back(bitmap);
+    }
 }
 
-static void LoadAseprite(const string& prefix, const string& path)
+//Sprites are decoded with the worker's arena for scratch, which the scope rewinds once
+//their pixels are copied out. Under a memory limit there are no spare chunks kept around.
+static void LoadBitmap(const string &prefix, const string &path, vector<Bitmap *> &loaded)
 {
+    ArenaScope scope(options.memoryLimit == 0);
+    loaded.push_back(new Bitmap(path, Interned(Interned(prefix), GetFileName(path)), options.alpha, GetMaskChannel(options.texture_format), options.trim, options.verbose));
+}
+
+static void LoadAseprite(const string& prefix, const string& path, vector<Bitmap *> &loaded)
+{
+    ArenaScope scope(options.memoryLimit == 0);
     ase_t* ase = cute_aseprite_load_from_file(path.c_str(), NULL);
 
     if (ase == NULL)
@@ -292,6 +388,7 @@ static void LoadAseprite(const string& prefix, const string& path)
         state.info_png.color.colortype = LCT_PALETTE;
         state.info_png.color.bitdepth = 8;
         state.encoder.auto_convert = 0;
+        UseDeflate(state.encoder.zlibsettings, DEFLATE_MIN_LEVEL);
 
         // Set palette
         for (int i = 0; i < ase->palette.entry_count; i++) {
@@ -302,7 +399,7 @@ static void LoadAseprite(const string& prefix, const string& path)
         unsigned int error = lodepng_encode(&pngData, &pngSize, image, ase->w, ase->h, &state);
 
         if (!error) {
-            bitmaps.push_back(new Bitmap(frameIndex + 1, prefix + GetFileName(path), tagLabel, loopDirection, frame->duration_milliseconds, &state, pngData, pngSize, options.alpha, false, options.verbose));
+            loaded.push_back(new Bitmap(frameIndex + 1, Interned(Interned(prefix), GetFileName(path)), Interned(tagLabel), loopDirection, frame->duration_milliseconds, &state, pngData, pngSize, options.alpha, GetMaskChannel(options.texture_format), false, options.verbose));
         }
         else {
             printf("Error %u: %s\n", error, lodepng_error_text(error));
@@ -311,7 +408,7 @@ static void LoadAseprite(const string& prefix, const string& path)
         lodepng_state_cleanup(&state);
 
         // Clean up
-        //free(pngData);
+        ArenaFree(pngData);
         free(image);
         free(palette);
     }
@@ -324,11 +421,8 @@ void LoadFile(const std::string& dir, const std::string& filename) {
     size_t dotPosition = filename.rfind('.');
     if (dotPosition != std::string::npos) {
         std::string extension = filename.substr(dotPosition + 1);
-        if (extension == "png") {
-            LoadBitmap(dir, filename);
-        }
-        else if (extension == "ase" || extension == "aseprite") {
-            LoadAseprite(dir, filename);
+        if (extension == "png" || extension == "ase" || extension == "aseprite") {
+            queuedFiles.emplace_back(dir, filename);
         }
         else {
             std::cerr << "Unsupported file format: " << extension << std::endl;
@@ -358,15 +452,71 @@ static void LoadFiles(const string &root, const string &prefix)
             if (dot1 != PathToStr(file.name) && dot2 != PathToStr(file.name))
                 LoadFiles(PathToStr(file.path), prefix + PathToStr(file.name) + "/");
         }
-        else if (PathToStr(file.extension) == "png")
-            LoadBitmap(prefix, PathToStr(file.path));
-        else if (PathToStr(file.extension) == "ase" || PathToStr(file.extension) == "aseprite")
-            LoadAseprite(prefix, PathToStr(file.path));
+        else if (PathToStr(file.extension) == "png" || PathToStr(file.extension) == "ase" || PathToStr(file.extension) == "aseprite")
+            queuedFiles.emplace_back(prefix, PathToStr(file.path));
     }
 
     tinydir_close(&dir);
 }
 
+//With --memory-limit, the sprites loaded first send their pixels to the scratch file until
+//the ones left in memory fit in the limit
+static void SpillOverLimit()
+{
+    if (options.memoryLimit == 0)
+        return;
+
+    size_t resident = 0;
+    for (size_t i = spillCursor; i < bitmaps.size(); ++i)
+        resident += bitmaps[i]->PixelBytes();
+    for (; spillCursor < bitmaps.size() && resident > options.memoryLimit; ++spillCursor)
+    {
+        resident -= bitmaps[spillCursor]->PixelBytes();
+        if (bitmaps[spillCursor]->data)
+            SpillPixels(*bitmaps[spillCursor]);
+    }
+}
+
+//Decodes the files found so far, one per worker, keeping them in the order they were found.
+//Under a memory limit they're decoded a few per worker at a time, spilling in between.
+static void LoadQueuedFiles(bool dedup, bool spill)
+{
+    size_t batch = options.memoryLimit > 0 && spill ? static_cast<size_t>(GetThreadCount()) * 4 : queuedFiles.size();
+    for (size_t first = 0; first < queuedFiles.size(); first += batch)
+    {
+        size_t count = min(batch, queuedFiles.size() - first);
+        vector<vector<Bitmap *>> loaded(count);
+        ParallelFor(static_cast<int>(count), [&](int i)
+        {
+            const string &path = queuedFiles[first + i].second;
+            if (path.ends_with(".png"))
+                LoadBitmap(queuedFiles[first + i].first, path, loaded[i]);
+            else
+                LoadAseprite(queuedFiles[first + i].first, path, loaded[i]);
+        });
+
+        vector<Bitmap *> added;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (options.verbose)
+                cout << '\t' << queuedFiles[first + i].second << endl;
+            added.insert(added.end(), loaded[i].begin(), loaded[i].end());
+        }
+        size_t kept = bitmaps.size();
+        AddBitmaps(added, dedup);
+
+        //Duplicates have let go of their pixels by now, so only the sprites kept are compacted
+        ParallelFor(static_cast<int>(bitmaps.size() - kept), [&](int i)
+        {
+            bitmaps[kept + i]->Compact();
+        });
+
+        if (spill)
+            SpillOverLimit();
+    }
+    queuedFiles.clear();
+}
+
 static void RemoveFile(string file)
 {
     remove(file.data());
@@ -432,6 +582,140 @@ static int GetPadding(const string &str)
     return 1;
 }
 
+static int GetTileSize(const string &str)
+{
+    for (int i = 8; i <= 32; i *= 2)
+        if (str == to_string(i))
+            return i;
+    cerr << "invalid tile size: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 8;
+}
+
+static size_t GetMemoryLimit(const string &str)
+{
+    int megabytes = atoi(str.data());
+    if (megabytes <= 0)
+    {
+        cerr << "invalid memory limit: " << str << endl;
+        exit(EXIT_FAILURE);
+    }
+    return static_cast<size_t>(megabytes) << 20;
+}
+
+static int GetCompression(const string &str)
+{
+    if (str == "max")
+        return DEFLATE_OPTIMAL;
+    for (int i = DEFLATE_MIN_LEVEL; i <= DEFLATE_MAX_LEVEL; ++i)
+        if (str == to_string(i))
+            return i;
+    cerr << "invalid png compression level: " << str << endl;
+    exit(EXIT_FAILURE);
+    return DEFLATE_DEFAULT_LEVEL;
+}
+
+static int GetTextureFormat(const string &str)
+{
+    if (str == "png")
+        return TEXTURE_PNG;
+    if (str == "bc1")
+        return TEXTURE_BC1;
+    if (str == "bc3")
+        return TEXTURE_BC3;
+    if (str == "bc7")
+        return TEXTURE_BC7;
+    if (str == "rgb565")
+        return TEXTURE_RGB565;
+    if (str == "rgba5551")
+        return TEXTURE_RGBA5551;
+    if (str == "rgba4444")
+        return TEXTURE_RGBA4444;
+    if (str == "r8")
+        return TEXTURE_R8;
+    if (str == "a8")
+        return TEXTURE_A8;
+    return atoi(str.c_str());
+}
+
+static TextureContainer GetContainer(const string &str)
+{
+    if (str == "dds")
+        return DDS;
+    if (str == "ktx2")
+        return KTX2;
+    cerr << "invalid texture container: " << str << endl;
+    exit(EXIT_FAILURE);
+    return DDS;
+}
+
+static Dither GetDither(const string &str)
+{
+    if (str == "none")
+        return DITHER_NONE;
+    if (str == "ordered")
+        return DITHER_ORDERED;
+    if (str == "diffusion")
+        return DITHER_DIFFUSION;
+    cerr << "invalid dither mode: " << str << endl;
+    exit(EXIT_FAILURE);
+    return DITHER_NONE;
+}
+
+static PaletteFormat GetPaletteFormat(const string &str)
+{
+    if (str == "act")
+        return Act;
+    if (str == "jasc")
+        return JASC;
+    if (str == "mspal")
+        return MSPal;
+    if (str == "gimp")
+        return GIMP;
+    if (str == "paintnet")
+        return PaintNET;
+    cerr << "invalid palette format: " << str << endl;
+    exit(EXIT_FAILURE);
+    return Act;
+}
+
+static const char* GetPaletteExtension(PaletteFormat format)
+{
+    switch (format)
+    {
+        case JASC:
+        case MSPal:
+            return ".pal";
+        case GIMP:
+            return ".gpl";
+        case PaintNET:
+            return ".txt";
+        default:
+            return ".act";
+    }
+}
+
+static Quantize GetQuantize(const string &str)
+{
+    if (str == "lossless")
+        return QUANTIZE_LOSSLESS;
+    if (str == "lossy")
+        return QUANTIZE_LOSSY;
+    cerr << "invalid quantize mode: " << str << endl;
+    exit(EXIT_FAILURE);
+    return QUANTIZE_NONE;
+}
+
+static int GetThreads(const string &str)
+{
+    int threads = atoi(str.c_str());
+    if (threads > 0)
+        return threads;
+    cerr << "invalid thread count: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 1;
+}
+
 static void GetSubdirs(const string &root, vector<string> &subdirs)
 {
     static string dot1 = ".";
@@ -475,8 +759,313 @@ static void FindPackers(const string &root, const string &name, const string &ex
     tinydir_close(&dir);
 }
 
+//Writes the xml, json or binary atlas data of every page, once the pages are drawn and
+//their sprites sorted
+static void SaveAtlasData(const string &outputDir, const string &name, bool noZero, vector<Tilemap> &tilemaps)
+{
+    //Tilemaps count tiles through the images of every texture in turn
+    unordered_map<const Bitmap *, int> tileIndices;
+    for (Packer *packer : packers)
+        for (Bitmap *bitmap : packer->bitmaps)
+            tileIndices.emplace(bitmap, static_cast<int>(tileIndices.size()));
+
+    // Save the atlas binary
+    if (options.output_format == BIN)
+    {
+        SetStringType(options.binstr);
+        if (options.verbose)
+            cout << "writing bin: " << outputDir << name << ".crch" << endl;
+
+        ofstream bin(outputDir + name + ".crch", ios::binary);
+        
+        if (!options.dirs)
+        {
+            WriteByte(bin, 'c');
+            WriteByte(bin, 'r');
+            WriteByte(bin, 'c');
+            WriteByte(bin, 'h');
+            WriteShort(bin, binVersion);
+            WriteByte(bin, options.trim);
+            WriteByte(bin, options.rotate);
+            WriteByte(bin, options.channels);
+            WriteByte(bin, options.binstr);
+            WriteByte(bin, options.tiles);
+        }
+        WriteShort(bin, (int16_t)packers.size());
+        for (size_t i = 0; i < packers.size(); ++i)
+            packers[i]->SaveBin(name + (noZero ? "" : to_string(i)), bin, options.texture_format, options.trim, options.rotate, options.channels, NAME_LENGTH);
+        if (options.tiles > 0)
+        {
+            WriteShort(bin, (int16_t)tilemaps.size());
+            for (Tilemap &tilemap : tilemaps)
+                tilemap.SaveBin(bin, tileIndices, NAME_LENGTH);
+        }
+        bin.close();
+    }
+
+    // Save the atlas xml
+    if (options.output_format == XML)
+    {
+        if (options.verbose)
+            cout << "writing xml: " << outputDir << name << ".xml" << endl;
+
+        ofstream xml(outputDir + name + ".xml");
+        if (!options.dirs)
+        {
+            xml << "<atlas>" << endl;
+            xml << "\t<trim>" << (options.trim ? "true" : "false") << "</trim>" << endl;
+            xml << "\t<rotate>" << (options.rotate ? "true" : "false") << "</trim>" << endl;
+            xml << "\t<channels>" << (options.channels ? "true" : "false") << "</channels>" << endl;
+            if (options.tiles > 0)
+                xml << "\t<tiles>" << options.tiles << "</tiles>" << endl;
+        }
+        for (size_t i = 0; i < packers.size(); ++i)
+            packers[i]->SaveXml(name + (noZero ? "" : to_string(i)), xml, options.texture_format, options.trim, options.rotate, options.channels);
+        for (Tilemap &tilemap : tilemaps)
+            tilemap.SaveXml(xml, tileIndices);
+        if (!options.dirs) xml << "</atlas>";
+        xml.close();
+    }
+
+    // Save the atlas json
+    if (options.output_format == JSON)
+    {
+        if (options.verbose)
+            cout << "writing json: " << outputDir << name << ".json" << endl;
+
+        ofstream json(outputDir + name + ".json");
+        if (!options.dirs)
+        {
+            json << '{' << endl;
+            json << "\t\"trim\":" << (options.trim ? "true" : "false") << ',' << endl;
+            json << "\t\"rotate\":" << (options.rotate ? "true" : "false") << ',' << endl;
+            json << "\t\"channels\":" << (options.channels ? "true" : "false") << ',' << endl;
+            if (options.tiles > 0)
+                json << "\t\"tiles\":" << options.tiles << ',' << endl;
+            json << "\t\"textures\":[" << endl;
+        }
+        for (size_t i = 0; i < packers.size(); ++i)
+        {
+            json << "\t\t{" << endl;
+            packers[i]->SaveJson(name + (noZero ? "" : to_string(i)), json, options.texture_format, options.trim, options.rotate, options.channels);
+            json << "\t\t}";
+            if (!options.dirs)
+            {
+                if (i + 1 < packers.size())
+                    json << ',';
+                json << endl;
+            }
+        }
+        if (!options.dirs)
+        {
+            json << "\t]";
+            if (options.tiles > 0)
+            {
+                json << ',' << endl << "\t\"tilemaps\":[" << endl;
+                for (size_t i = 0; i < tilemaps.size(); ++i)
+                {
+                    json << "\t\t{" << endl;
+                    tilemaps[i].SaveJson(json, tileIndices);
+                    json << "\t\t}";
+                    if (i + 1 < tilemaps.size())
+                        json << ',';
+                    json << endl;
+                }
+                json << "\t]";
+            }
+            json << endl;
+            json << '}';
+        }
+        json.close();
+    }
+}
+
+//Formats a number for the plan without touching cout's own formatting
+static string FormatFixed(double value, int precision)
+{
+    ostringstream out;
+    out << fixed << setprecision(precision) << value;
+    return out.str();
+}
+
+//Lays the atlas out from the image headers alone, taking trimmed sizes from the atlas data
+//the last run saved, and prints what its pages would take without decoding or writing anything
+static int PlanAtlas(const string &outputDir, const string &name, vector<string> &inputs, const string &prefix)
+{
+    //The sprites and pages of a plan are only ever printed, whichever way it ends
+    SpriteTable sprites;
+    auto release = [&]()
+    {
+        for (Bitmap *bitmap : bitmaps)
+            delete bitmap;
+        for (Bitmap *bitmap : sprites.bitmaps)
+            delete bitmap;
+        for (Packer *packer : packers)
+            delete packer;
+        bitmaps.clear();
+        packers.clear();
+        queuedFiles.clear();
+    };
+
+    StartTimer("probing headers");
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (!options.dirs && inputs[i].rfind('.') != string::npos)
+            LoadFile("", inputs[i]);
+        else
+            LoadFiles(inputs[i], prefix);
+    }
+    vector<ImageHeader> headers(queuedFiles.size());
+    vector<char> probed(queuedFiles.size());
+    ParallelFor(static_cast<int>(queuedFiles.size()), [&](int i)
+    {
+        probed[i] = ProbeImage(queuedFiles[i].second, headers[i]);
+    });
+
+    TrimCache cache;
+    string cacheName = outputDir + name + ".xml";
+    if (!LoadTrimCache(cacheName, cache))
+    {
+        cacheName = outputDir + name + ".json";
+        if (!LoadTrimCache(cacheName, cache))
+            cacheName.clear();
+    }
+
+    size_t images = 0;
+    size_t trimmed = 0;
+    size_t aliased = 0;
+    for (size_t i = 0; i < queuedFiles.size(); ++i)
+    {
+        const string &path = queuedFiles[i].second;
+        const ImageHeader &header = headers[i];
+        bool png = path.ends_with(".png");
+        if (!probed[i])
+        {
+            cerr << "failed to read image header: " << path << endl;
+            release();
+            return EXIT_FAILURE;
+        }
+        if (!png && !header.indexed)
+        {
+            cerr << "Can't read the Aseprite image format. Must be a paletted 8-bit image." << endl;
+            continue;
+        }
+
+        Interned spriteName(Interned(queuedFiles[i].first), GetFileName(path));
+        for (int frame = 0; frame < header.frames; ++frame)
+        {
+            //Aseprite frames are never trimmed, pngs only shrink to what the last run trimmed
+            //them to if their size hasn't changed since
+            int frameIndex = png ? 0 : frame + 1;
+            int width = header.width;
+            int height = header.height;
+            ++images;
+            auto cached = cache.find(make_pair(spriteName.Str(), frameIndex));
+            if (cached != cache.end())
+            {
+                if (options.unique && cached->second.alias)
+                {
+                    ++aliased;
+                    continue;
+                }
+                if (png && options.trim && cached->second.frameW == width && cached->second.frameH == height)
+                {
+                    width = cached->second.width;
+                    height = cached->second.height;
+                    ++trimmed;
+                }
+            }
+
+            //Without the pixels there's no telling which tiles repeat, so every one is counted
+            if (options.tiles > 0)
+            {
+                int tileCount = ((width + options.tiles - 1) / options.tiles) * ((height + options.tiles - 1) / options.tiles);
+                for (int tile = 0; tile < tileCount; ++tile)
+                    bitmaps.push_back(new Bitmap(spriteName, tile, options.tiles, options.tiles));
+            }
+            else
+                bitmaps.push_back(new Bitmap(spriteName, frameIndex, width, height));
+        }
+    }
+    queuedFiles.clear();
+    StopTimer("probing headers");
+
+    StartTimer("packing bitmaps");
+    for (Bitmap *bitmap : bitmaps)
+        sprites.Add(bitmap);
+    bitmaps.clear();
+    sprites.SortByArea();
+    while (!sprites.order.empty())
+    {
+        auto packer = new Packer(options.width, options.height, options.padding, IsBlockFormat(options.texture_format) ? 4 : 1);
+        packer->Pack(sprites, options.verbose, options.rotate);
+        packers.push_back(packer);
+        if (packer->bitmaps.empty())
+        {
+            cerr << "packing failed, could not fit bitmap: " << sprites.bitmaps[sprites.order.back()]->name << endl;
+            release();
+            return EXIT_FAILURE;
+        }
+    }
+    StopTimer("packing bitmaps");
+
+    cout << "plan: " << name << " (" << images << " images";
+    if (!cacheName.empty() && (options.trim || options.unique))
+    {
+        cout << ", ";
+        if (options.trim)
+            cout << trimmed << " trimmed" << (options.unique ? " and " : "");
+        if (options.unique)
+            cout << aliased << " aliased";
+        cout << " as in " << cacheName;
+    }
+    cout << ')' << endl;
+
+    //With channels every four atlases share a page as big as the biggest of them
+    vector<pair<int, int>> pages;
+    for (size_t i = 0; i < packers.size(); ++i)
+    {
+        cout << '\t' << name << (options.nozero && packers.size() == 1 ? "" : to_string(i)) << ": " << packers[i]->width << " x " << packers[i]->height;
+        cout << ", " << packers[i]->bitmaps.size() << " sprites, " << FormatFixed(packers[i]->occupancy * 100, 1) << "% occupied" << endl;
+        if (!options.channels || i % 4 == 0)
+            pages.emplace_back(packers[i]->width, packers[i]->height);
+        else
+            pages.back() = make_pair(max(pages.back().first, packers[i]->width), max(pages.back().second, packers[i]->height));
+    }
+    if (options.channels)
+        cout << "\tpacked into the channels of " << pages.size() << " pages" << endl;
+
+    static const pair<const char *, int> formats[] =
+    {
+        { "png", TEXTURE_PNG },
+        { "bc1", TEXTURE_BC1 },
+        { "bc3", TEXTURE_BC3 },
+        { "bc7", TEXTURE_BC7 },
+        { "rgb565", TEXTURE_RGB565 },
+        { "rgba5551", TEXTURE_RGBA5551 },
+        { "rgba4444", TEXTURE_RGBA4444 },
+        { "r8/a8", TEXTURE_A8 }
+    };
+    cout << "estimated page memory:" << endl;
+    for (const auto &format : formats)
+    {
+        //Only the texture containers carry a mip chain
+        bool mips = options.mips && (IsBlockFormat(format.second) || IsPackedFormat(format.second));
+        size_t bytes = 0;
+        for (const auto &page : pages)
+            bytes += GetTextureBytes(format.second, page.first, page.second, mips);
+        cout << '\t' << format.first << ": " << FormatFixed(bytes / 1048576.0, 2) << " MB" << endl;
+    }
+
+    release();
+    return EXIT_SUCCESS;
+}
+
 static int Pack(size_t newHash, string &outputDir, string &name, vector<string> &inputs, string prefix = "")
 {
+    if (options.plan)
+        return PlanAtlas(outputDir, name, inputs, prefix);
+
     if (options.dirs) StartTimer(prefix);
     StartTimer("hashing input");
     for (size_t i = 0; i < inputs.size(); ++i)
@@ -509,9 +1098,14 @@ static int Pack(size_t newHash, string &outputDir, string &name, vector<string>
     RemoveFile(outputDir + name + ".crch");
     RemoveFile(outputDir + name + ".xml");
     RemoveFile(outputDir + name + ".json");
-    RemoveFile(outputDir + name + ".png");
-    for (size_t i = 0; i < 16; ++i)
-        RemoveFile(outputDir + name + to_string(i) + ".png");
+    if (options.banks)
+        RemoveFile(outputDir + name + GetPaletteExtension(options.bankFormat));
+    for (const char* ext : { ".png", ".dds", ".ktx2" })
+    {
+        RemoveFile(outputDir + name + ext);
+        for (size_t i = 0; i < 16; ++i)
+            RemoveFile(outputDir + name + to_string(i) + ext);
+    }
 
     StartTimer("loading bitmaps");
 
@@ -525,158 +1119,266 @@ static int Pack(size_t newHash, string &outputDir, string &name, vector<string>
         else
             LoadFiles(inputs[i], prefix);
     }
+    //Banks and tiles read every sprite's pixels, so those wait until they're done to spill
+    spillCursor = 0;
+    LoadQueuedFiles(options.unique && !options.banks && options.tiles == 0, !options.banks && options.tiles == 0);
     StopTimer("loading bitmaps");
 
-    StartTimer("sorting bitmaps");
-    // Sort the bitmaps by area
-    stable_sort(bitmaps.begin(), bitmaps.end(), [](const Bitmap* a, const Bitmap* b)
-        { return (a->width * a->height) < (b->width * b->height); });
-    StopTimer("sorting bitmaps");
+    //Banks are picked before packing, so duplicates are found among the remapped sprites
+    vector<uint32_t> bankPalette;
+    if (options.banks)
+    {
+        StartTimer("allocating palette banks");
+        if (options.paletteFilename || IsBlockFormat(options.texture_format) || IsPackedFormat(options.texture_format) || GetMaskChannel(options.texture_format) >= 0)
+        {
+            cerr << "palette banks need png pages without a palette file" << endl;
+            return EXIT_FAILURE;
+        }
+        for (const Bitmap* bitmap : bitmaps)
+        {
+            if (bitmap->paletteSize == 0)
+            {
+                cerr << "palette banks need indexed sprites: " << bitmap->name << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        if (!AllocatePaletteBanks(bitmaps, bankPalette))
+            return EXIT_FAILURE;
 
-    StartTimer("packing bitmaps");
+        if (options.unique && options.tiles == 0)
+        {
+            vector<Bitmap *> remapped;
+            remapped.swap(bitmaps);
+            AddBitmaps(remapped, true);
+        }
 
-    // Pack the bitmaps
-    while (!bitmaps.empty())
-    {
+        string paletteName = outputDir + name + GetPaletteExtension(options.bankFormat);
         if (options.verbose)
-            cout << "packing " << bitmaps.size() << " images..." << endl;
-        auto packer = new Packer(options.width, options.height, options.padding);
-        packer->Pack(bitmaps, options.verbose, options.unique, options.rotate);
-        packers.push_back(packer);
-        if (options.verbose)
-            cout << "finished packing: " << name << (options.nozero && bitmaps.empty() ? "" : to_string(packers.size() - 1)) << " (" << packer->width << " x " << packer->height << ')' << endl;
-
-        if (packer->bitmaps.empty())
+            cout << "writing " << bankPalette.size() / 16 << " palette banks: " << paletteName << endl;
+        Palette palette;
+        if (palette.WritePalette(paletteName.data(), reinterpret_cast<Color*>(bankPalette.data()), static_cast<int>(bankPalette.size()), 0, options.bankFormat) == EXIT_FAILURE)
         {
-            cerr << "packing failed, could not fit bitmap: " << (bitmaps.back())->name << endl;
+            cerr << "could not write palette: " << paletteName << endl;
             return EXIT_FAILURE;
         }
+        StopTimer("allocating palette banks");
     }
-    StopTimer("packing bitmaps");
-
-    bool noZero = options.nozero && packers.size() == 1;
 
-    StartTimer("saving atlas png");
-    // Save the atlas image
-    for (size_t i = 0; i < packers.size(); ++i)
+    //Sheets are cut once their palette banks are picked, so tiles come out with bank indices
+    vector<Tilemap> tilemaps;
+    if (options.tiles > 0)
     {
-        string pngName = outputDir + name + (noZero ? "" : to_string(i)) + ".png";
+        StartTimer("cutting tiles");
+        DedupIndex tileIndex;
+        tileIndex.transforms = options.transforms ? 8 : 4;
+        vector<Bitmap *> sheets;
+        sheets.swap(bitmaps);
+        size_t sheetCount = sheets.size();
+        CutTiles(sheets, options.tiles, tileIndex, bitmaps, tilemaps);
         if (options.verbose)
-            cout << "writing png: " << pngName << endl;
+            cout << "cut " << sheetCount << " images into " << bitmaps.size() << " unique tiles" << endl;
+        StopTimer("cutting tiles");
+    }
 
-        Color *colorPalette = nullptr;
-        int paletteSize = 0;
-        int transparentIndex = 0;
+    if (options.banks || options.tiles > 0)
+        SpillOverLimit();
 
-        if (options.paletteFilename)
+    StartTimer("sorting bitmaps");
+    // Sort the bitmaps by area
+    SpriteTable sprites;
+    for (Bitmap *bitmap : bitmaps)
+        sprites.Add(bitmap);
+    bitmaps.clear();
+    sprites.SortByArea();
+    StopTimer("sorting bitmaps");
+
+    //A page needs nothing but its sprites and the palette, so the palette is read up front
+    //and pages can be drawn as soon as they're packed
+    bool texture = IsBlockFormat(options.texture_format) || IsPackedFormat(options.texture_format);
+    Color *colorPalette = nullptr;
+    int paletteSize = 0;
+    int transparentIndex = 0;
+    bool mask = GetMaskChannel(options.texture_format) >= 0 && !options.channels;
+    PaletteLut *lut = nullptr;
+    if (options.paletteFilename)
+    {
+        if (texture)
         {
-            Palette palette;
-            if (palette.ReadPalette(options.paletteFilename, &colorPalette, &paletteSize, &transparentIndex) == EXIT_FAILURE)
-            {
-                cerr << "could not read palette: " << options.paletteFilename << endl;
-				return EXIT_FAILURE;
-            }
+            cerr << "block compressed and 16 bit formats can't use a palette" << endl;
+            return EXIT_FAILURE;
+        }
+        if (GetMaskChannel(options.texture_format) >= 0)
+        {
+            cerr << "single channel formats can't use a palette" << endl;
+            return EXIT_FAILURE;
+        }
 
-            packers[i]->SavePng(pngName, reinterpret_cast<uint32_t*>(colorPalette), paletteSize);
-            free(colorPalette);
+        Palette palette;
+        if (palette.ReadPalette(options.paletteFilename, &colorPalette, &paletteSize, &transparentIndex) == EXIT_FAILURE)
+        {
+            cerr << "could not read palette: " << options.paletteFilename << endl;
+            return EXIT_FAILURE;
         }
-        else
+
+        //Palette files have always been saved opaque, only quantized pages carry alpha
+        for (int i = 0; i < paletteSize; ++i)
+            colorPalette[i].A = 255;
+
+        //Rgba sprites are remapped onto the palette, so they can share its pages
+        for (const Bitmap *bitmap : sprites.bitmaps)
         {
-            packers[i]->SavePng(pngName, nullptr, 0);
+            if (bitmap->paletteSize == 0 && !bitmap->mask)
+            {
+                lut = new PaletteLut(reinterpret_cast<uint32_t*>(colorPalette), paletteSize, transparentIndex);
+                break;
+            }
         }
     }
-    StopTimer("saving atlas png");
-
-    for (size_t i = 0; i < packers.size(); ++i)
+    if (!bankPalette.empty())
     {
-        // Sort the bitmaps by name then frameIndex
-        stable_sort(packers[i]->bitmaps.begin(), packers[i]->bitmaps.end(), [](const Bitmap* a, const Bitmap* b) {
-            if (a->name != b->name)
-                return a->name < b->name;
-
-            return a->frameIndex < b->frameIndex;
-            });
+        colorPalette = reinterpret_cast<Color*>(malloc(bankPalette.size() * sizeof(Color)));
+        memcpy(colorPalette, bankPalette.data(), bankPalette.size() * sizeof(Color));
+        paletteSize = static_cast<int>(bankPalette.size());
     }
 
-    StartTimer("saving atlas");
-    // Save the atlas binary
-    if (options.output_format == BIN)
+    //Duplicates join the page their original is packed on, in the order they were found
+    unordered_map<const Bitmap *, vector<size_t>> aliases;
+    for (size_t i = 0; i < duplicates.size(); ++i)
+        aliases[duplicates[i].second].push_back(i);
+
+    //Each page is drawn and saved by the workers while the main thread packs the next. The
+    //atlas data waits on every page being drawn, which picks the sprites' palette slots,
+    //and is written while the last pages are still being compressed.
+    TextureOptions textureOptions = { options.texture_format, options.container, options.mips, options.alpha, options.dither };
+    TaskGroup pipeline;
+    TaskNode atlasData(pipeline, [&]()
     {
-        SetStringType(options.binstr);
+        SaveAtlasData(outputDir, name, options.nozero && packers.size() == 1, tilemaps);
+    });
+    vector<string> pageFiles;
+    auto startPage = [&](Packer *page)
+    {
+        bool noZero = options.nozero && packers.empty() && sprites.order.empty();
+        string pageName = outputDir + name + (noZero ? "" : to_string(packers.size()));
+        string file = pageName + (texture ? GetContainerExtension(options.container) : ".png");
+        string preview = IsPackedFormat(options.texture_format) ? pageName + ".png" : "";
         if (options.verbose)
-            cout << "writing bin: " << outputDir << name << ".crch" << endl;
-
-        ofstream bin(outputDir + name + ".crch", ios::binary);
-        
-        if (!options.dirs)
         {
-            WriteByte(bin, 'c');
-            WriteByte(bin, 'r');
-            WriteByte(bin, 'c');
-            WriteByte(bin, 'h');
-            WriteShort(bin, binVersion);
-            WriteByte(bin, options.trim);
-            WriteByte(bin, options.rotate);
-            WriteByte(bin, options.binstr);
+            cout << (texture ? "writing texture: " : "writing png: ") << file << endl;
+            if (!preview.empty())
+                cout << "writing png: " << preview << endl;
         }
-        WriteShort(bin, (int16_t)packers.size());
-        for (size_t i = 0; i < packers.size(); ++i)
-            packers[i]->SaveBin(name + (noZero ? "" : to_string(i)), bin, options.texture_format, options.trim, options.rotate, NAME_LENGTH);
-        bin.close();
-    }
+        pageFiles.push_back(file);
+        if (!preview.empty())
+            pageFiles.push_back(preview);
 
-    // Save the atlas xml
-    if (options.output_format == XML)
+        packers.push_back(page);
+        atlasData.Depend();
+        pipeline.Run([&, page, file, preview]()
+        {
+            if (lut)
+            {
+                vector<Bitmap *> remapped;
+                for (Bitmap *bitmap : page->bitmaps)
+                    if (bitmap->pos.dupID < 0 && bitmap->paletteSize == 0 && !bitmap->mask)
+                        remapped.push_back(bitmap);
+                ParallelFor(static_cast<int>(remapped.size()), [&](int i)
+                {
+                    //Spilled sprites go back to the scratch file with their new indices
+                    bool spilled = remapped[i]->spillOffset >= 0;
+                    if (spilled)
+                        UnspillPixels(*remapped[i]);
+                    RemapSprite(*remapped[i], *lut, options.dither, options.alpha);
+                    if (spilled)
+                        SpillPixels(*remapped[i]);
+                });
+            }
+
+            Bitmap *drawn = texture ? page->DrawTexture(textureOptions) : page->DrawPng(reinterpret_cast<uint32_t*>(colorPalette), paletteSize, mask);
+            page->SortBitmaps();
+            atlasData.Done();
+
+            if (texture)
+                page->SaveTexture(*drawn, file, preview, textureOptions, options.compression);
+            else
+                page->SavePng(*drawn, file, options.quantize, options.compression);
+            delete drawn;
+        });
+    };
+
+    StartTimer("packing bitmaps");
+
+    // Pack the bitmaps
+    size_t atlasCount = 0;
+    vector<Packer *> atlases;
+    while (!sprites.order.empty())
     {
         if (options.verbose)
-            cout << "writing xml: " << outputDir << name << ".xml" << endl;
+            cout << "packing " << sprites.order.size() << " images..." << endl;
+        auto packer = new Packer(options.width, options.height, options.padding, IsBlockFormat(options.texture_format) ? 4 : 1);
+        packer->Pack(sprites, options.verbose, options.rotate);
+        ++atlasCount;
 
-        ofstream xml(outputDir + name + ".xml");
-        if (!options.dirs)
+        if (packer->bitmaps.empty())
         {
-            xml << "<atlas>" << endl;
-            xml << "\t<trim>" << (options.trim ? "true" : "false") << "</trim>" << endl;
-            xml << "\t<rotate>" << (options.rotate ? "true" : "false") << "</trim>" << endl;
+            cerr << "packing failed, could not fit bitmap: " << sprites.bitmaps[sprites.order.back()]->name << endl;
+
+            //The pages already started are finished, then thrown away with the rest
+            pipeline.Wait();
+            for (const string &file : pageFiles)
+                RemoveFile(file);
+            delete packer;
+            delete lut;
+            free(colorPalette);
+            return EXIT_FAILURE;
         }
-        for (size_t i = 0; i < packers.size(); ++i)
-            packers[i]->SaveXml(name + (noZero ? "" : to_string(i)), xml, options.texture_format, options.trim, options.rotate);
-        if (!options.dirs) xml << "</atlas>";
-        xml.close();
-    }
 
-    // Save the atlas json
-    if (options.output_format == JSON)
-    {
-        if (options.verbose)
-            cout << "writing json: " << outputDir << name << ".json" << endl;
-
-        ofstream json(outputDir + name + ".json");
-        if (!options.dirs)
+        vector<pair<size_t, int>> joined;
+        for (size_t i = 0; i < packer->bitmaps.size(); ++i)
         {
-            json << '{' << endl;
-            json << "\t\"trim\":" << (options.trim ? "true" : "false") << ',' << endl;
-            json << "\t\"rotate\":" << (options.rotate ? "true" : "false") << ',' << endl;
-            json << "\t\"textures\":[" << endl;
+            auto found = aliases.find(packer->bitmaps[i]);
+            if (found != aliases.end())
+                for (size_t duplicate : found->second)
+                    joined.emplace_back(duplicate, static_cast<int>(i));
         }
-        for (size_t i = 0; i < packers.size(); ++i)
+        sort(joined.begin(), joined.end());
+        for (auto &alias : joined)
+            packer->AddAlias(duplicates[alias.first].first, alias.second);
+
+        //Every four single channel atlases become the planes of one rgba page
+        atlases.push_back(packer);
+        if (!options.channels || atlases.size() == 4 || sprites.order.empty())
         {
-            json << "\t\t{" << endl;
-            packers[i]->SaveJson(name + (noZero ? "" : to_string(i)), json, options.texture_format, options.trim, options.rotate);
-            json << "\t\t}";
-            if (!options.dirs)
+            for (size_t j = 1; j < atlases.size(); ++j)
             {
-                if (i + 1 < packers.size())
-                    json << ',';
-                json << endl;
+                atlases[0]->AddChannel(atlases[j], static_cast<int>(j));
+                delete atlases[j];
             }
+
+            //Reported by the page the atlases end up on, the one startPage names next
+            if (options.verbose)
+            {
+                cout << "finished packing: " << name << (options.nozero && packers.empty() && sprites.order.empty() ? "" : to_string(packers.size()));
+                cout << " (" << atlases[0]->width << " x " << atlases[0]->height;
+                if (options.channels)
+                    cout << ", " << atlases.size() << (atlases.size() == 1 ? " channel" : " channels");
+                cout << ')' << endl;
+            }
+            startPage(atlases[0]);
+            atlases.clear();
         }
-        if (!options.dirs)
-        {
-            json << "\t]" << endl;
-            json << '}';
-        }
-        json.close();
     }
+    if (options.verbose && !duplicates.empty())
+        cout << "aliased " << duplicates.size() << " duplicate images" << endl;
+    if (options.verbose && options.channels)
+        cout << "packed " << atlasCount << " atlases into the channels of " << packers.size() << " pages" << endl;
+    StopTimer("packing bitmaps");
+
+    StartTimer("saving atlas");
+    atlasData.Done();
+    pipeline.Wait();
+    delete lut;
+    free(colorPalette);
     StopTimer("saving atlas");
 
     // Save the new hash
@@ -699,17 +1401,30 @@ int main(int argc, char **argv)
         .paletteFilename = nullptr,
         .size = 4096,
         .padding = 1,
+        .compression = DEFLATE_DEFAULT_LEVEL,
         .binstr = NULL_TERMINATED,
         .output_format = XML,
-        .texture_format = 0,
+        .texture_format = TEXTURE_PNG,
+        .container = DDS,
+        .dither = DITHER_NONE,
+        .quantize = QUANTIZE_NONE,
+        .banks = false,
+        .bankFormat = Act,
         .alpha = true,
+        .roundAlpha = false,
         .trim = false,
         .verbose = false,
         .ignore = false,
         .unique = false,
+        .transforms = false,
+        .tiles = 0,
+        .channels = false,
         .last = false,
         .dirs = false,
-        .nozero = false
+        .nozero = false,
+        .mips = false,
+        .memoryLimit = 0,
+        .plan = false
     };
 
     static option long_options[] = {
@@ -721,6 +1436,7 @@ int main(int argc, char **argv)
         {"ignore", no_argument, nullptr, 'i'},
         {"unique", no_argument, nullptr, 'u'},
         {"rotate", no_argument, nullptr, 'r'},
+        {"channels", no_argument, nullptr, 'k'},
         {"last", no_argument, nullptr, 'l'},
         {"dirs", no_argument, nullptr, 'd'},
         {"nozero", no_argument, nullptr, 'n'},
@@ -729,13 +1445,25 @@ int main(int argc, char **argv)
         {"width", required_argument, nullptr, 'w'},
         {"height", required_argument, nullptr, 'h'},
         {"padding", required_argument, nullptr, 'p'},
+        {"png-compress", required_argument, nullptr, 'c'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"container", required_argument, nullptr, 'e'},
+        {"mips", no_argument, nullptr, 'm'},
+        {"dither", required_argument, nullptr, 'y'},
+        {"quantize", required_argument, nullptr, 'q'},
+        {"transforms", no_argument, nullptr, 'x'},
+        {"tiles", required_argument, nullptr, 'z'},
+        {"round-alpha", no_argument, nullptr, OPTION_ROUND_ALPHA},
+        {"memory-limit", required_argument, nullptr, OPTION_MEMORY_LIMIT},
+        {"plan", no_argument, nullptr, OPTION_PLAN},
+        {"banks", required_argument, nullptr, 'g'},
         {nullptr, 0, nullptr, 0}
     };
 
     int option;
     int option_index = 0;
 
-    while ((option = getopt_long(argc, argv, "o:f:atvaiurldnb:s:w:h:p:", long_options, &option_index)) != -1) {
+    while ((option = getopt_long(argc, argv, "o:f:atvaiurkldnb:s:w:h:p:c:j:e:my:q:g:xz:", long_options, &option_index)) != -1) {
         switch (option) {
             case 'o':
                 if (strcmp(optarg, "xml") == 0)
@@ -746,7 +1474,7 @@ int main(int argc, char **argv)
                     options.output_format = JSON;
                 break;
             case 'f':
-                options.texture_format = atoi(optarg);
+                options.texture_format = GetTextureFormat(optarg);
                 break;
             case 'a':
                 options.alpha = true;
@@ -766,6 +1494,9 @@ int main(int argc, char **argv)
             case 'r':
                 options.rotate = true;
                 break;
+            case 'k':
+                options.channels = true;
+                break;
             case 'l':
                 options.last = true;
                 break;
@@ -790,12 +1521,51 @@ int main(int argc, char **argv)
             case 'p':
                 options.padding = GetPadding(optarg);
                 break;
+            case 'c':
+                options.compression = GetCompression(optarg);
+                break;
+            case 'j':
+                SetThreadCount(GetThreads(optarg));
+                break;
+            case 'e':
+                options.container = GetContainer(optarg);
+                break;
+            case 'm':
+                options.mips = true;
+                break;
+            case 'y':
+                options.dither = GetDither(optarg);
+                break;
+            case 'q':
+                options.quantize = GetQuantize(optarg);
+                break;
+            case 'x':
+                options.transforms = true;
+                break;
+            case 'z':
+                options.tiles = GetTileSize(optarg);
+                break;
+            case OPTION_ROUND_ALPHA:
+                options.roundAlpha = true;
+                break;
+            case OPTION_MEMORY_LIMIT:
+                options.memoryLimit = GetMemoryLimit(optarg);
+                break;
+            case OPTION_PLAN:
+                options.plan = true;
+                break;
+            case 'g':
+                options.banks = true;
+                options.bankFormat = GetPaletteFormat(optarg);
+                break;
             default:
                 cout << helpMessage << endl;
                 return EXIT_FAILURE;
         }
     }
 
+    SetPremultiplyRounding(options.roundAlpha);
+
     if (argc - optind < 2) {
         cout << helpMessage << endl;
         return EXIT_FAILURE;
@@ -821,6 +1591,18 @@ int main(int argc, char **argv)
     if (argc - optind > 2)
         options.paletteFilename = argv[optind + 2];
 
+    if (options.tiles > 0 && (options.trim || options.dirs))
+    {
+        cerr << "tiles can't be trimmed or split by subdirectories" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (options.channels && GetMaskChannel(options.texture_format) < 0)
+    {
+        cerr << "packing channels needs a single channel format (a8 or r8)" << endl;
+        return EXIT_FAILURE;
+    }
+
     if (options.width == 0) options.width = options.size;
     if (options.height == 0) options.height = options.size;
 
@@ -829,11 +1611,16 @@ int main(int argc, char **argv)
         cout << "options..." << endl;
         cout << "\t--format: " << string(GetFormatString(options.output_format)) << endl;
         cout << "\t--alpha: " << (options.alpha ? "true" : "false") << endl;
+        cout << "\t--round-alpha: " << (options.roundAlpha ? "true" : "false") << endl;
         cout << "\t--trim: " << (options.trim ? "true" : "false") << endl;
         cout << "\t--verbose: " << (options.verbose ? "true" : "false") << endl;
         cout << "\t--ignore: " << (options.ignore ? "true" : "false") << endl;
         cout << "\t--unique: " << (options.unique ? "true" : "false") << endl;
+        cout << "\t--transforms: " << (options.transforms ? "true" : "false") << endl;
+        if (options.tiles > 0)
+            cout << "\t--tiles: " << options.tiles << endl;
         cout << "\t--rotate: " << (options.rotate ? "true" : "false") << endl;
+        cout << "\t--channels: " << (options.channels ? "true" : "false") << endl;
         if(options.width == options.height) cout << "\t--size: " << options.width << endl;
         else
         {
@@ -841,12 +1628,30 @@ int main(int argc, char **argv)
             cout << "\t--height: " << options.height << endl;
         }
         cout << "\t--padding: " << options.padding << endl;
+        cout << "\t--png-compress: " << (options.compression == DEFLATE_OPTIMAL ? "max" : to_string(options.compression)) << endl;
+        cout << "\t--threads: " << GetThreadCount() << endl;
+        if (options.memoryLimit > 0)
+            cout << "\t--memory-limit: " << (options.memoryLimit >> 20) << endl;
+        if (options.plan)
+            cout << "\t--plan: true" << endl;
+        if (IsBlockFormat(options.texture_format) || IsPackedFormat(options.texture_format))
+        {
+            cout << "\t--container: " << (options.container == KTX2 ? "ktx2" : "dds") << endl;
+            cout << "\t--mips: " << (options.mips ? "true" : "false") << endl;
+        }
+        if (IsPackedFormat(options.texture_format))
+            cout << "\t--dither: " << (options.dither == DITHER_ORDERED ? "ordered" : (options.dither == DITHER_DIFFUSION ? "diffusion" : "none")) << endl;
+        if (options.banks)
+            cout << "\t--banks: " << GetPaletteExtension(options.bankFormat) + 1 << endl;
+        cout << "\t--quantize: " << (options.quantize == QUANTIZE_LOSSY ? "lossy" : (options.quantize == QUANTIZE_LOSSLESS ? "lossless" : "none")) << endl;
         cout << "\t--binstr: " << (options.binstr == NULL_TERMINATED ? "n" : (options.binstr == PREFIXED ? "p" : "7")) << endl;
         cout << "\t--last: " << (options.last ? "true" : "false") << endl;
         cout << "\t--dirs: " << (options.dirs ? "true" : "false") << endl;
         cout << "\t--nozero: " << (options.nozero ? "true" : "false") << endl;
     }
 
+    dedupIndex.transforms = options.unique && options.transforms ? 8 : 1;
+
     StartTimer("hashing input");
     // Hash the arguments and input directories
     size_t newHash = 0;
@@ -901,8 +1706,30 @@ int main(int argc, char **argv)
         else if(result != EXIT_SKIPPED)
             return result;
 
+        //Nothing of one subdirectory's atlas is needed for the next, aliases included, and
+        //the spare arena chunks its sprites were decoded with go too
+        for (Packer *packer : packers)
+        {
+            for (Bitmap *bitmap : packer->bitmaps)
+                delete bitmap;
+            delete packer;
+        }
+        for (Bitmap *bitmap : bitmaps)
+            delete bitmap;
         packers.clear();
         bitmaps.clear();
+        dedupIndex.Clear();
+        duplicates.clear();
+        CloseSpillFile();
+        ReleaseArenas();
+    }
+
+    //A plan only prints, so there's nothing to combine
+    if (options.plan)
+    {
+        StopTimer("total");
+        WriteAllTimers();
+        return EXIT_SUCCESS;
     }
 
     if (skipped)
@@ -938,7 +1765,9 @@ int main(int argc, char **argv)
         WriteShort(bin, binVersion);
         WriteByte(bin, options.trim);
         WriteByte(bin, options.rotate);
+        WriteByte(bin, options.channels);
         WriteByte(bin, options.binstr);
+        WriteByte(bin, options.tiles);
         int16_t imageCount = 0;
         for (size_t i = 0; i < cachedPackers.size(); ++i)
         {
@@ -970,6 +1799,7 @@ int main(int argc, char **argv)
         xml << "<atlas>" << endl;
         xml << "\t<trim>" << (options.trim ? "true" : "false") << "</trim>" << endl;
         xml << "\t<rotate>" << (options.rotate ? "true" : "false") << "</trim>" << endl;
+        xml << "\t<channels>" << (options.channels ? "true" : "false") << "</channels>" << endl;
         for (size_t i = 0; i < cachedPackers.size(); ++i)
         {
             ifstream xmlCache(cachedPackers[i]);
@@ -993,6 +1823,7 @@ int main(int argc, char **argv)
         json << '{' << endl;
         json << "\t\"trim\":" << (options.trim ? "true" : "false") << ',' << endl;
         json << "\t\"rotate\":" << (options.rotate ? "true" : "false") << ',' << endl;
+        json << "\t\"channels\":" << (options.channels ? "true" : "false") << ',' << endl;
         json << "\t\"textures\":[" << endl;
         for (size_t i = 0; i < cachedPackers.size(); ++i)
         {
@@ -28,96 +28,268 @@
 #include "MaxRectsBinPack.h"
 #include "GuillotineBinPack.h"
 #include "binary.hpp"
+#include "spill.hpp"
 #include <iostream>
 #include <algorithm>
 
 using namespace std;
 using namespace rbp;
 
-Packer::Packer(int width, int height, int pad)
-: width(width), height(height), pad(pad)
+Packer::Packer(int width, int height, int pad, int align)
+: width(width), height(height), pad(pad), align(align), occupancy(0)
 {
     
 }
 
-void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate)
+//Pages are at most 4096 pixels across, so anything wider than 16 bits can't fit anyway
+void SpriteTable::Add(Bitmap* bitmap)
+{
+    order.push_back(static_cast<uint32_t>(bitmaps.size()));
+    widths.push_back(static_cast<uint16_t>(min(bitmap->width, 0xffff)));
+    heights.push_back(static_cast<uint16_t>(min(bitmap->height, 0xffff)));
+    bitmaps.push_back(bitmap);
+}
+
+//Smallest first, so the biggest are packed first from the back
+void SpriteTable::SortByArea()
+{
+    stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b)
+        { return static_cast<uint32_t>(widths[a]) * heights[a] < static_cast<uint32_t>(widths[b]) * heights[b]; });
+}
+
+void Packer::Pack(SpriteTable& sprites, bool verbose, bool rotate)
 {
     MaxRectsBinPack packer(width, height);
 
     int ww = 0;
     int hh = 0;
-    while (!bitmaps.empty())
+    while (!sprites.order.empty())
     {
-        auto bitmap = bitmaps.back();
+        uint32_t sprite = sprites.order.back();
 
         if (verbose)
-            cout << '\t' << bitmaps.size() << ": " << bitmap->name << endl;
+            cout << '\t' << sprites.order.size() << ": " << sprites.bitmaps[sprite]->name << endl;
 
-        //Check to see if this is a duplicate of an already packed bitmap
-        if (unique)
-        {
-            auto di = dupLookup.find(bitmap->hashValue);
-            if (di != dupLookup.end() && bitmap->Equals(this->bitmaps[di->second]))
-            {
-                Bitmap* dupBitmap = this->bitmaps[di->second];
-                dupBitmap->pos = bitmap->pos;
-                bitmaps.pop_back();
-                continue;
-            }
-        }
+        //Pack it into the atlas. Rounding the sizes up keeps every rect on the alignment
+        //grid, so sprites never share a compressed block.
+        int w = (sprites.widths[sprite] + pad + align - 1) / align * align;
+        int h = (sprites.heights[sprite] + pad + align - 1) / align * align;
+        Rect rect = packer.Insert(w, h, rotate, MaxRectsBinPack::RectBestShortSideFit);
 
-        //If it's not a duplicate, pack it into the atlas
-        {
-            Rect rect = packer.Insert(bitmap->width + pad, bitmap->height + pad, rotate, MaxRectsBinPack::RectBestShortSideFit);
-
-            if (rect.width == 0 || rect.height == 0)
-                break;
-
-            if (unique)
-                dupLookup[bitmap->hashValue] = static_cast<int>(this->bitmaps.size());
+        if (rect.width == 0 || rect.height == 0)
+            break;
 
-            //Check if we rotated it
-            Point p;
-            p.x = rect.x;
-            p.y = rect.y;
-            p.dupID = -1;
-            p.rot = rotate && bitmap->width != (rect.width - pad);
+        //Check if we rotated it
+        Point p;
+        p.x = rect.x;
+        p.y = rect.y;
+        p.dupID = -1;
+        p.rot = rotate && w != rect.width;
 
-            bitmap->pos = p;
-            this->bitmaps.push_back(bitmap);
-            bitmaps.pop_back();
+        sprites.bitmaps[sprite]->pos = p;
+        bitmaps.push_back(sprites.bitmaps[sprite]);
+        sprites.order.pop_back();
 
-            ww = max(rect.x + rect.width, ww);
-            hh = max(rect.y + rect.height, hh);
-        }
+        ww = max(rect.x + rect.width, ww);
+        hh = max(rect.y + rect.height, hh);
     }
 
+    //Occupancy is of the whole bin, so scale it to the page once it's shrunk to fit
+    float binArea = static_cast<float>(width) * height;
     while (width / 2 >= ww)
         width /= 2;
     while (height / 2 >= hh)
         height /= 2;
+    occupancy = packer.Occupancy() * binArea / (static_cast<float>(width) * height);
 }
 
-void Packer::SavePng(const string& file, uint32_t* palette, int paletteSize)
+//Duplicates share the packed pixels, but stay on the atlas as an alias keeping their own
+//name, frame, trim and palette slot
+void Packer::AddAlias(Bitmap* bitmap, int index)
 {
-    Bitmap bitmap(width, height, palette, paletteSize);
+    bitmap->pos = bitmaps[index]->pos;
+    bitmap->pos.dupID = index;
+    bitmaps.push_back(bitmap);
+}
+
+void Packer::AddChannel(Packer* other, int channel)
+{
+    width = max(width, other->width);
+    height = max(height, other->height);
+
+    int offset = static_cast<int>(bitmaps.size());
+    for (Bitmap* bitmap : other->bitmaps)
+    {
+        bitmap->channel = channel;
+        if (bitmap->pos.dupID >= 0)
+            bitmap->pos.dupID += offset;
+        bitmaps.push_back(bitmap);
+    }
+    other->bitmaps.clear();
+}
+
+void Packer::SortBitmaps()
+{
+    //Aliases point at their sprite by index, so find them again after sorting
+    unordered_map<const Bitmap*, const Bitmap*> targets;
+    for (const Bitmap* bitmap : bitmaps)
+        if (bitmap->pos.dupID >= 0)
+            targets[bitmap] = bitmaps[bitmap->pos.dupID];
+
+    //Names compare by their place among every interned string, looked up once each
+    vector<pair<uint32_t, Bitmap*>> keyed;
+    for (Bitmap* bitmap : bitmaps)
+        keyed.emplace_back(bitmap->name.SortKey(), bitmap);
+    stable_sort(keyed.begin(), keyed.end(), [](const pair<uint32_t, Bitmap*>& a, const pair<uint32_t, Bitmap*>& b) {
+        if (a.first != b.first)
+            return a.first < b.first;
+
+        return a.second->frameIndex < b.second->frameIndex;
+        });
+    for (size_t i = 0; i < bitmaps.size(); ++i)
+        bitmaps[i] = keyed[i].second;
+
+    unordered_map<const Bitmap*, int> indices;
+    for (size_t i = 0; i < bitmaps.size(); ++i)
+        indices[bitmaps[i]] = static_cast<int>(i);
+    for (Bitmap* bitmap : bitmaps)
+        if (bitmap->pos.dupID >= 0)
+            bitmap->pos.dupID = indices[targets[bitmap]];
+}
+
+void Packer::DrawBitmaps(Bitmap& bitmap)
+{
+    size_t covered = 0;
+    bool planes = false;
 
     for (size_t i = 0, j = bitmaps.size(); i < j; ++i)
     {
+        //Aliases aren't drawn, but still need the slot of their own palette
+        bitmap.FindPaletteSlot(bitmaps[i]);
+
         if (bitmaps[i]->pos.dupID < 0)
         {
-            bitmap.FindPaletteSlot(bitmaps[i]);
+
+            //Rgba sprites bring their color stats to rgba pages, masks packed into the planes
+            //of one don't have any
+            if (bitmap.paletteSize == 0 && !bitmap.mask)
+            {
+                if (bitmaps[i]->mask)
+                    planes = true;
+                else if (bitmaps[i]->paletteSize == 0)
+                {
+                    bitmap.colors.Merge(bitmaps[i]->colors);
+                    covered += static_cast<size_t>(bitmaps[i]->width) * bitmaps[i]->height;
+                }
+            }
+
+            //Spilled sprites are only read back for as long as it takes to draw them
+            bool spilled = !bitmaps[i]->data && bitmaps[i]->spillOffset >= 0;
+            if (spilled)
+                UnspillPixels(*bitmaps[i]);
 
             if (bitmaps[i]->pos.rot)
                 bitmap.CopyPixelsRot(bitmaps[i], bitmaps[i]->pos.x, bitmaps[i]->pos.y);
             else
                 bitmap.CopyPixels(bitmaps[i], bitmaps[i]->pos.x, bitmaps[i]->pos.y);
+
+            if (spilled)
+                bitmaps[i]->FreePixels();
         }
     }
-    bitmap.SaveAs(file);
+
+    //Channel packed colors only exist once the planes are combined
+    if (planes)
+    {
+        bitmap.colors = ColorStats();
+        bitmap.colors.Add(reinterpret_cast<const uint32_t*>(bitmap.data), static_cast<size_t>(width) * height);
+    }
+
+    //Anything the sprites don't cover is left transparent black
+    else if (covered < static_cast<size_t>(width) * height)
+    {
+        uint32_t background = 0;
+        bitmap.colors.Add(&background, 1);
+    }
+}
+
+Bitmap* Packer::DrawPng(uint32_t* palette, int paletteSize, bool mask)
+{
+    //Indexed pages stay 4 bit when every indexed sprite on them is
+    int bitDepth = 8;
+    if (paletteSize > 0)
+    {
+        bool narrow = false;
+        bool wide = false;
+        for (const Bitmap* sprite : bitmaps)
+        {
+            if (sprite->pos.dupID < 0 && sprite->paletteSize > 0)
+            {
+                narrow = narrow || sprite->bitDepth == 4;
+                wide = wide || sprite->bitDepth == 8;
+            }
+        }
+        if (narrow && !wide)
+            bitDepth = 4;
+    }
+
+    Bitmap* page = new Bitmap(width, height, palette, paletteSize, bitDepth, mask);
+    DrawBitmaps(*page);
+    return page;
+}
+
+Bitmap* Packer::DrawTexture(const TextureOptions& options)
+{
+    Bitmap* page = new Bitmap(width, height, nullptr, 0, 8, false);
+    DrawBitmaps(*page);
+
+    //Dither each sprite on its own, so the pattern and the diffused error never cross
+    //into a neighbour
+    if (IsPackedFormat(options.format))
+    {
+        for (size_t i = 0, j = bitmaps.size(); i < j; ++i)
+        {
+            if (bitmaps[i]->pos.dupID < 0)
+            {
+                int w = bitmaps[i]->pos.rot ? bitmaps[i]->height : bitmaps[i]->width;
+                int h = bitmaps[i]->pos.rot ? bitmaps[i]->width : bitmaps[i]->height;
+                QuantizeRect(*page, bitmaps[i]->pos.x, bitmaps[i]->pos.y, w, h, options);
+            }
+        }
+    }
+    return page;
+}
+
+void Packer::SavePng(Bitmap& page, const string& file, Quantize quantize, int compression)
+{
+    if (quantize != QUANTIZE_NONE)
+        QuantizePage(page, quantize == QUANTIZE_LOSSY);
+    page.SaveAs(file, compression);
+}
+
+void Packer::SaveTexture(Bitmap& page, const string& file, const string& preview, const TextureOptions& options, int compression)
+{
+    if (IsPackedFormat(options.format))
+    {
+        //The gaps between sprites still need the format's alpha; rounding is a no-op on the
+        //sprites themselves now
+        TextureOptions gaps = options;
+        gaps.dither = DITHER_NONE;
+        QuantizeRect(page, 0, 0, width, height, gaps);
+
+        //The sprites' color stats no longer match the page
+        if (!preview.empty())
+        {
+            page.colors = ColorStats();
+            page.colors.Add(reinterpret_cast<const uint32_t*>(page.data), static_cast<size_t>(width) * height);
+            page.SaveAs(preview, compression);
+        }
+    }
+
+    ::SaveTexture(file, page, options);
 }
 
-void Packer::SaveXml(const string& name, ofstream& xml, int format, bool trim, bool rotate)
+void Packer::SaveXml(const string& name, ofstream& xml, int format, bool trim, bool rotate, bool channels)
 {
     xml << "\t<tex n=\"" << name << "\" ";
     xml << "w=\"" << width << "\" ";
@@ -143,13 +315,19 @@ void Packer::SaveXml(const string& name, ofstream& xml, int format, bool trim, b
         }
         if (rotate)
             xml << "r=\"" << (bitmaps[i]->pos.rot ? 1 : 0) << "\" ";
+        if (channels)
+            xml << "ch=\"" << bitmaps[i]->channel << "\" ";
         xml << "ps=\"" << bitmaps[i]->paletteSlot << "\" ";
+        if (bitmaps[i]->pos.dupID >= 0)
+            xml << "a=\"" << bitmaps[i]->pos.dupID << "\" ";
+        if (bitmaps[i]->transform != 0)
+            xml << "t=\"" << bitmaps[i]->transform << "\" ";
         xml << "/>" << endl;
     }
     xml << "\t</tex>" << endl;
 }
 
-void Packer::SaveBin(const string& name, ofstream& bin, int format, bool trim, bool rotate, int length)
+void Packer::SaveBin(const string& name, ofstream& bin, int format, bool trim, bool rotate, bool channels, int length)
 {
     WriteString(bin, name, length);
     WriteShort(bin, width);
@@ -159,8 +337,8 @@ void Packer::SaveBin(const string& name, ofstream& bin, int format, bool trim, b
     for (size_t i = 0, j = bitmaps.size(); i < j; ++i)
     {
         WriteShort(bin, (int16_t)bitmaps[i]->frameIndex);
-        WriteString(bin, bitmaps[i]->name, length);
-        WriteString(bin, bitmaps[i]->label, length);
+        WriteString(bin, bitmaps[i]->name.Str(), length);
+        WriteString(bin, bitmaps[i]->label.Str(), length);
         WriteByte(bin, bitmaps[i]->loopDirection);
         WriteShort(bin, (int16_t)bitmaps[i]->duration);
         WriteShort(bin, (int16_t)bitmaps[i]->pos.x);
@@ -176,12 +354,16 @@ void Packer::SaveBin(const string& name, ofstream& bin, int format, bool trim, b
         }
         if (rotate)
             WriteByte(bin, bitmaps[i]->pos.rot ? 1 : 0);
+        if (channels)
+            WriteByte(bin, bitmaps[i]->channel);
         WriteByte(bin, bitmaps[i]->paletteSlot);
+        WriteShort(bin, (int16_t)bitmaps[i]->pos.dupID);
+        WriteByte(bin, bitmaps[i]->transform);
         std::cout << "Saved " << bitmaps[i]->name << " slot " << bitmaps[i]->paletteSlot << std::endl;
     }
 }
 
-void Packer::SaveJson(const string& name, ofstream& json, int format, bool trim, bool rotate)
+void Packer::SaveJson(const string& name, ofstream& json, int format, bool trim, bool rotate, bool channels)
 {
     json << "\t\t\t\"name\":\"" << name << "\"," << endl;
     json << "\t\t\t\"width\":" << width << "," << endl;
@@ -209,7 +391,13 @@ void Packer::SaveJson(const string& name, ofstream& json, int format, bool trim,
         }
         if (rotate)
             json << ", \"r\":" << (bitmaps[i]->pos.rot ? "true" : "false");
+        if (channels)
+            json << ", \"ch\":" << bitmaps[i]->channel;
         json << ", \"ps\":" << bitmaps[i]->paletteSlot;
+        if (bitmaps[i]->pos.dupID >= 0)
+            json << ", \"a\":" << bitmaps[i]->pos.dupID;
+        if (bitmaps[i]->transform != 0)
+            json << ", \"t\":" << bitmaps[i]->transform;
         json << " }";
         if(i != bitmaps.size() -1)
             json << ",";
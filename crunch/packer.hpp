@@ -31,24 +31,51 @@
 #include <fstream>
 #include <unordered_map>
 #include "bitmap.hpp"
+#include "texture.hpp"
+#include "quantize.hpp"
 
 using namespace std;
 
+//Sprites waiting to be packed, kept as a few tight columns so sorting and packing don't
+//chase Bitmap pointers around the heap. The full Bitmap behind an index is only looked
+//at once its sprite has a place on a page.
+struct SpriteTable
+{
+    vector<uint16_t> widths;
+    vector<uint16_t> heights;
+    vector<Bitmap*> bitmaps;
+    vector<uint32_t> order;     //indices still to pack, the next one at the back
+
+    void Add(Bitmap* bitmap);
+    void SortByArea();
+};
+
 struct Packer
 {
     int width;
     int height;
     int pad;
+    int align;
+    float occupancy;    //share of the page the packed rects cover, padding included
     
     vector<Bitmap*> bitmaps;
-    unordered_map<size_t, int> dupLookup;
     
-    Packer(int width, int height, int pad);
-    void Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate);
-    void SavePng(const string& file, uint32_t* palette, int paletteSize);
-    void SaveXml(const string& name, ofstream& xml, int format, bool trim, bool rotate);
-    void SaveBin(const string& name, ofstream& bin, int format, bool trim, bool rotate, int length);
-    void SaveJson(const string& name, ofstream& json, int format, bool trim, bool rotate);
+    Packer(int width, int height, int pad, int align);
+    void Pack(SpriteTable& sprites, bool verbose, bool rotate);
+    void AddAlias(Bitmap* bitmap, int index);
+    void AddChannel(Packer* other, int channel);
+    void SortBitmaps();
+    void DrawBitmaps(Bitmap& bitmap);
+
+    //Drawing a page picks the sprites' palette slots, so it comes before they're sorted and
+    //saved to the atlas data. Saving only reads the page it's given.
+    Bitmap* DrawPng(uint32_t* palette, int paletteSize, bool mask);
+    Bitmap* DrawTexture(const TextureOptions& options);
+    void SavePng(Bitmap& page, const string& file, Quantize quantize, int compression);
+    void SaveTexture(Bitmap& page, const string& file, const string& preview, const TextureOptions& options, int compression);
+    void SaveXml(const string& name, ofstream& xml, int format, bool trim, bool rotate, bool channels);
+    void SaveBin(const string& name, ofstream& bin, int format, bool trim, bool rotate, bool channels, int length);
+    void SaveJson(const string& name, ofstream& json, int format, bool trim, bool rotate, bool channels);
 };
 
 #endif
@@ -12,6 +12,7 @@
 #include <cstdlib>
 #include "palette.h"
 #include "lodepng.h"
+#include "inflate.hpp"
 
 static unsigned char msPalHeader[] = { 'R', 'I', 'F', 'F' };
 static unsigned char jascPalHeader[] = { 'J', 'A', 'S', 'C', '-', 'P', 'A', 'L' };
@@ -51,6 +52,7 @@ int Palette::ReadPng(const char* fileName, Color** colorPalette, int* paletteCou
     lodepng_state_init(&state);
 
     state.decoder.color_convert = 0;
+    UseInflate(state.decoder.zlibsettings, nullptr);
 
     lodepng_load_file(&png, &size, fileName);
     int result = lodepng_decode(&buffer, &width, &height, &state, png, size);
@@ -409,16 +411,19 @@ int Palette::WriteMsPal(const char* fileName, Color* colorPalette, int paletteCo
     unsigned char riffSig[4] = { 'R', 'I', 'F', 'F' };
     unsigned char riffType[4] = { 'P', 'A', 'L', ' ' };
     unsigned char riffChunkSig[4] = { 'd', 'a', 't', 'a' };
-    unsigned char chunkSize[4];
     unsigned char palVer[2] = { 0x00, 0x03 };
 
     short palCount = paletteCount;
 
+    //The data chunk holds the version, count and colors, the riff one adds its type and the data chunk header
+    int dataSize = 4 + palCount * 4;
+    int riffSize = 4 + 8 + dataSize;
+
     file.write(reinterpret_cast<const char*>(riffSig), sizeof(unsigned char) * 4);
-    file.write(reinterpret_cast<const char*>(chunkSize), sizeof(unsigned char) * 4);
+    file.write(reinterpret_cast<const char*>(&riffSize), sizeof(int));
     file.write(reinterpret_cast<const char*>(riffType), sizeof(unsigned char) * 4);
     file.write(reinterpret_cast<const char*>(riffChunkSig), sizeof(unsigned char) * 4);
-    file.write(reinterpret_cast<const char*>(chunkSize), sizeof(unsigned char) * 4);
+    file.write(reinterpret_cast<const char*>(&dataSize), sizeof(int));
     file.write(reinterpret_cast<const char*>(palVer), sizeof(unsigned char) * 2);
     file.write(reinterpret_cast<const char*>(&palCount), sizeof(short));
 
@@ -447,7 +452,7 @@ int Palette::WriteJascPal(const char* fileName, Color* colorPalette, int palette
     file << paletteCount << "\n";
 
     for (int i = 0; i < paletteCount; i++)
-        file << colorPalette[i].R << " " << colorPalette[i].G << " " << colorPalette[i].B << "\n";
+        file << static_cast<int>(colorPalette[i].R) << " " << static_cast<int>(colorPalette[i].G) << " " << static_cast<int>(colorPalette[i].B) << "\n";
 
     file.close();
 
@@ -468,9 +473,9 @@ int Palette::WriteGimpPal(const char* fileName, Color* colorPalette, int palette
 
     for (int i = 0; i < paletteCount; i++)
     {
-        file << std::setw(3) << std::setfill(' ') << colorPalette[i].R << " ";
-        file << std::setw(3) << std::setfill(' ') << colorPalette[i].G << " ";
-        file << std::setw(3) << std::setfill(' ') << colorPalette[i].B << "\tUntitled\n";
+        file << std::setw(3) << std::setfill(' ') << static_cast<int>(colorPalette[i].R) << " ";
+        file << std::setw(3) << std::setfill(' ') << static_cast<int>(colorPalette[i].G) << " ";
+        file << std::setw(3) << std::setfill(' ') << static_cast<int>(colorPalette[i].B) << "\tUntitled\n";
     }
 
     file.close();
@@ -489,7 +494,7 @@ int Palette::WritePaintNetPal(const char* fileName, Color* colorPalette, int pal
     file << "; " << fileName << "\n";
 
     for (int i = 0; i < paletteCount; i++)
-        file << std::hex << std::setfill('0') << std::setw(8) << ((colorPalette[i].R << 16) | (colorPalette[i].G << 8) | colorPalette[i].B) << "\n";
+        file << std::hex << std::setfill('0') << std::setw(8) << (0xFF000000u | (colorPalette[i].R << 16) | (colorPalette[i].G << 8) | colorPalette[i].B) << "\n";
 
     file.close();
 
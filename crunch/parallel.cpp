@@ -0,0 +1,223 @@
+#include "parallel.hpp"
+#include "time.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+static int threadCount = 0;
+
+struct Task
+{
+    function<void()> func;
+    TaskGroup* group;
+};
+
+//Every worker has a deque of its own. The first one belongs to the threads outside the
+//pool, which is only ever the main thread.
+struct Queue
+{
+    mutex lock;
+    deque<Task> tasks;
+};
+
+struct Scheduler
+{
+    vector<Queue*> queues;
+    mutex sleepLock;
+    condition_variable wake;
+    atomic<int> queued;
+
+    Scheduler(int workers);
+    void Push(Task task);
+    bool Take(Task& task);
+    void Execute(Task& task);
+    void Work(int index);
+};
+
+static thread_local int self = 0;
+
+//Never freed: a sprite that fails to load exits from whichever thread it's on, and the
+//workers mustn't be torn down under it
+static Scheduler* GetScheduler()
+{
+    static Scheduler* scheduler = new Scheduler(GetThreadCount() - 1);
+    return scheduler;
+}
+
+Scheduler::Scheduler(int workers)
+    : queued(0)
+{
+    for (int i = 0; i <= workers; ++i)
+        queues.push_back(new Queue());
+    for (int i = 1; i <= workers; ++i)
+        thread(&Scheduler::Work, this, i).detach();
+}
+
+void Scheduler::Push(Task task)
+{
+    {
+        lock_guard<mutex> guard(queues[self]->lock);
+        queues[self]->tasks.push_back(move(task));
+    }
+    {
+        lock_guard<mutex> guard(sleepLock);
+        ++queued;
+    }
+    wake.notify_one();
+}
+
+//The newest task of the thread's own deque is the one most likely still in its cache,
+//the oldest of another's is the one that thread will get to last
+bool Scheduler::Take(Task& task)
+{
+    if (queued <= 0)
+        return false;
+
+    size_t count = queues.size();
+    for (size_t i = 0; i < count; ++i)
+    {
+        Queue* queue = queues[(self + i) % count];
+        lock_guard<mutex> guard(queue->lock);
+        if (queue->tasks.empty())
+            continue;
+        if (i == 0)
+        {
+            task = move(queue->tasks.back());
+            queue->tasks.pop_back();
+        }
+        else
+        {
+            task = move(queue->tasks.front());
+            queue->tasks.pop_front();
+        }
+        --queued;
+        return true;
+    }
+    return false;
+}
+
+void Scheduler::Execute(Task& task)
+{
+    task.func();
+    if (--task.group->pending == 0)
+    {
+        lock_guard<mutex> guard(sleepLock);
+        wake.notify_all();
+    }
+}
+
+void Scheduler::Work(int index)
+{
+    self = index;
+    for (;;)
+    {
+        Task task;
+        if (Take(task))
+        {
+            SetBusy(true);
+            Execute(task);
+            SetBusy(false);
+            continue;
+        }
+
+        unique_lock<mutex> guard(sleepLock);
+        wake.wait(guard, [this]() { return queued > 0; });
+    }
+}
+
+void SetThreadCount(int count)
+{
+    threadCount = count;
+}
+
+int GetThreadCount()
+{
+    if (threadCount > 0)
+        return threadCount;
+    return max(1, static_cast<int>(thread::hardware_concurrency()));
+}
+
+TaskGroup::TaskGroup()
+    : pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    Wait();
+}
+
+void TaskGroup::Run(function<void()> task)
+{
+    ++pending;
+    GetScheduler()->Push(Task{ move(task), this });
+}
+
+void TaskGroup::Wait()
+{
+    Scheduler* scheduler = GetScheduler();
+    while (pending > 0)
+    {
+        Task task;
+        if (scheduler->Take(task))
+        {
+            scheduler->Execute(task);
+            continue;
+        }
+
+        //Nothing left to help with, only the group's running tasks to wait on
+        SetBusy(false);
+        {
+            unique_lock<mutex> guard(scheduler->sleepLock);
+            scheduler->wake.wait(guard, [&]() { return pending == 0 || scheduler->queued > 0; });
+        }
+        SetBusy(true);
+    }
+}
+
+TaskNode::TaskNode(TaskGroup& group, function<void()> task)
+    : group(group), task(move(task)), waiting(1)
+{
+}
+
+void TaskNode::Depend()
+{
+    ++waiting;
+}
+
+void TaskNode::Done()
+{
+    if (--waiting == 0)
+        group.Run(move(task));
+}
+
+void ParallelFor(int count, const function<void(int)>& func)
+{
+    int threads = min(GetThreadCount(), count);
+    if (threads <= 1)
+    {
+        for (int i = 0; i < count; ++i)
+            func(i);
+        return;
+    }
+
+    //Indices are handed out one at a time, so helpers that only get going late, or not
+    //before the caller is done, just find fewer of them
+    atomic<int> next(0);
+    auto work = [&]()
+    {
+        for (int i = next++; i < count; i = next++)
+            func(i);
+    };
+
+    TaskGroup group;
+    for (int i = 1; i < threads; ++i)
+        group.Run(work);
+    work();
+    group.Wait();
+}
@@ -0,0 +1,52 @@
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include <atomic>
+#include <functional>
+
+// Number of worker threads used by ParallelFor, defaults to the hardware thread count.
+// The workers are started the first time there's work for them, later calls change nothing.
+void SetThreadCount(int count);
+int GetThreadCount();
+
+// Tasks that run on the worker threads and can be waited on together. Every thread queues
+// the tasks it starts on its own deque and runs the newest first; threads with nothing
+// left steal the oldest task of another. Tasks may start and wait on groups of their own.
+class TaskGroup
+{
+public:
+    TaskGroup();
+    ~TaskGroup();
+
+    void Run(std::function<void()> task);
+
+    // Runs queued tasks, this group's or not, until every task of the group has finished
+    void Wait();
+
+private:
+    friend struct Scheduler;
+    std::atomic<int> pending;
+};
+
+// A task in a graph, started on its group once every task it depends on is done. It
+// starts out waiting on whoever made it, who adds the rest with Depend and calls Done
+// once there are no more to add.
+class TaskNode
+{
+public:
+    TaskNode(TaskGroup& group, std::function<void()> task);
+
+    void Depend();
+    void Done();
+
+private:
+    TaskGroup& group;
+    std::function<void()> task;
+    std::atomic<int> waiting;
+};
+
+// Runs func(i) for every i in [0, count) across the worker threads and waits for all of
+// them. The calling thread takes part, and calls from inside a task are spread out too.
+void ParallelFor(int count, const std::function<void(int)>& func);
+
+#endif
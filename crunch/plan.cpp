@@ -0,0 +1,104 @@
+#include "plan.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+using namespace std;
+
+static uint32_t ReadBig(const uint8_t* bytes)
+{
+    return (static_cast<uint32_t>(bytes[0]) << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+static uint16_t ReadLittle(const uint8_t* bytes)
+{
+    return static_cast<uint16_t>(bytes[0] | (bytes[1] << 8));
+}
+
+bool ProbeImage(const string& file, ImageHeader& header)
+{
+    uint8_t bytes[32] = {};
+    ifstream stream(file, ios::binary);
+    if (!stream.read(reinterpret_cast<char*>(bytes), sizeof(bytes)) && stream.gcount() < 26)
+        return false;
+
+    //The signature is always followed by the IHDR chunk
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (memcmp(bytes, signature, 8) == 0 && memcmp(bytes + 12, "IHDR", 4) == 0)
+    {
+        header.width = static_cast<int>(ReadBig(bytes + 16));
+        header.height = static_cast<int>(ReadBig(bytes + 20));
+        header.frames = 1;
+        header.indexed = bytes[25] == 3;
+        return true;
+    }
+
+    //Aseprite files start with their size, a magic number, the frame count and the size
+    //and color depth shared by every frame
+    if (ReadLittle(bytes + 4) == 0xa5e0)
+    {
+        header.frames = ReadLittle(bytes + 6);
+        header.width = ReadLittle(bytes + 8);
+        header.height = ReadLittle(bytes + 10);
+        header.indexed = ReadLittle(bytes + 12) == 8;
+        return true;
+    }
+    return false;
+}
+
+//Finds an xml attribute (key="value") or a json field ("key":value or "key":"value")
+static bool FindValue(const string& line, const string& key, string& value)
+{
+    size_t start;
+    size_t end;
+    size_t at = line.find(' ' + key + "=\"");
+    if (at != string::npos)
+    {
+        start = at + key.size() + 3;
+        end = line.find('"', start);
+    }
+    else
+    {
+        at = line.find('"' + key + "\":");
+        if (at == string::npos)
+            return false;
+        start = at + key.size() + 3;
+        if (line[start] == '"')
+            end = line.find('"', ++start);
+        else
+            end = line.find_first_of(",}", start);
+    }
+    if (end == string::npos)
+        return false;
+    value = line.substr(start, end - start);
+    return true;
+}
+
+bool LoadTrimCache(const string& file, TrimCache& cache)
+{
+    ifstream stream(file);
+    if (!stream)
+        return false;
+
+    //Both formats write each sprite on a line of its own
+    string line;
+    while (getline(stream, line))
+    {
+        size_t first = line.find_first_not_of('\t');
+        if (line.find("<img ") == string::npos && (first == string::npos || line[first] != '{'))
+            continue;
+
+        string name, frame, width, height, value;
+        if (!FindValue(line, "n", name) || !FindValue(line, "fi", frame) || !FindValue(line, "w", width) || !FindValue(line, "h", height))
+            continue;
+
+        CachedRect rect = { atoi(width.data()), atoi(height.data()), 0, 0, FindValue(line, "a", value) };
+        if (FindValue(line, "fw", value))
+            rect.frameW = atoi(value.data());
+        if (FindValue(line, "fh", value))
+            rect.frameH = atoi(value.data());
+        cache[make_pair(name, atoi(frame.data()))] = rect;
+    }
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef plan_hpp
+#define plan_hpp
+
+#include <map>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+//As much of an image as --plan needs to lay it out, read from its header alone
+struct ImageHeader
+{
+    int width;
+    int height;
+    int frames;     //aseprite frames are each packed as a sprite, pngs have one
+    bool indexed;
+};
+
+//Reads the size from a png's IHDR chunk or an aseprite file's header, without touching
+//the pixels. Returns false if the file is neither.
+bool ProbeImage(const string& file, ImageHeader& header);
+
+//A sprite as a previous run left it in the atlas data
+struct CachedRect
+{
+    int width;
+    int height;
+    int frameW;     //0 when that run didn't trim
+    int frameH;
+    bool alias;
+};
+
+//Previous results keyed on sprite name and frame index
+typedef map<pair<string, int>, CachedRect> TrimCache;
+
+//Reads the sprites back out of xml or json atlas data written by an earlier run. Returns
+//false if there's no such file.
+bool LoadTrimCache(const string& file, TrimCache& cache);
+
+#endif
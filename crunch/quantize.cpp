@@ -0,0 +1,538 @@
+#include "quantize.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+
+//Rows of the page mapped per task
+#define QUANTIZE_BAND 64
+
+//A cell of the 5 bit per channel histogram the lossy palette is built from
+struct Cell
+{
+    uint8_t color[4];
+    uint32_t count;
+};
+
+//A run of cells median cut treats as one color, split along its widest channel
+struct Box
+{
+    size_t begin;
+    size_t end;
+    uint64_t count;
+    int channel;
+    int range;
+};
+
+//Palette colors as the planes FindNearestColor searches, padded with entries no color
+//can be closer to
+struct SearchPalette
+{
+    vector<float> planes;
+    size_t count;
+
+    SearchPalette(const vector<uint32_t>& colors)
+        : count((colors.size() + 3) & ~static_cast<size_t>(3))
+    {
+        planes.assign(count * 4, 1e9f);
+        for (size_t i = 0; i < colors.size(); ++i)
+            for (int c = 0; c < 4; ++c)
+                planes[c * count + i] = static_cast<float>((colors[i] >> (c * 8)) & 0xff);
+    }
+
+    int Find(uint32_t color) const
+    {
+        return FindNearestColor(planes.data(), count, color);
+    }
+};
+
+static uint32_t CellKey(uint32_t p)
+{
+    return ((p >> 3) & 0x1f) | ((p >> 6) & 0x3e0) | ((p >> 9) & 0x7c00) | ((p >> 12) & 0xf8000);
+}
+
+static uint32_t PackColor(const uint8_t color[4])
+{
+    return color[0] | (color[1] << 8) | (color[2] << 16) | (static_cast<uint32_t>(color[3]) << 24);
+}
+
+static void MeasureBox(Box& box, const vector<Cell>& cells)
+{
+    uint8_t lo[4] = { 255, 255, 255, 255 };
+    uint8_t hi[4] = { 0, 0, 0, 0 };
+    box.count = 0;
+    for (size_t i = box.begin; i < box.end; ++i)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            lo[c] = min(lo[c], cells[i].color[c]);
+            hi[c] = max(hi[c], cells[i].color[c]);
+        }
+        box.count += cells[i].count;
+    }
+
+    box.channel = 0;
+    box.range = 0;
+    for (int c = 0; c < 4; ++c)
+    {
+        if (hi[c] - lo[c] > box.range)
+        {
+            box.channel = c;
+            box.range = hi[c] - lo[c];
+        }
+    }
+}
+
+//Median cut over the histogram cells, then k-means on the cells to pull each color to
+//the middle of the pixels that end up using it
+static vector<uint32_t> BuildPalette(const uint32_t* pixels, size_t count, size_t size)
+{
+    //Counts first, then each used cell's position in cells plus one
+    vector<uint32_t> cellOf(1 << 20, 0);
+    for (size_t i = 0; i < count; ++i)
+        if (pixels[i] != 0)
+            ++cellOf[CellKey(pixels[i])];
+
+    vector<Cell> cells;
+    for (uint32_t key = 0; key < cellOf.size(); ++key)
+    {
+        if (cellOf[key] != 0)
+        {
+            cells.push_back({ { 0, 0, 0, 0 }, cellOf[key] });
+            cellOf[key] = static_cast<uint32_t>(cells.size());
+        }
+    }
+
+    vector<array<uint64_t, 4>> sums(cells.size(), { 0, 0, 0, 0 });
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (pixels[i] == 0)
+            continue;
+        array<uint64_t, 4>& sum = sums[cellOf[CellKey(pixels[i])] - 1];
+        for (int c = 0; c < 4; ++c)
+            sum[c] += (pixels[i] >> (c * 8)) & 0xff;
+    }
+    for (size_t i = 0; i < cells.size(); ++i)
+        for (int c = 0; c < 4; ++c)
+            cells[i].color[c] = static_cast<uint8_t>((sums[i][c] + cells[i].count / 2) / cells[i].count);
+
+    //Keep splitting the box with the most pixels spread over the widest range
+    vector<Box> boxes;
+    if (!cells.empty())
+    {
+        boxes.push_back({ 0, cells.size(), 0, 0, 0 });
+        MeasureBox(boxes.back(), cells);
+    }
+    while (boxes.size() < size)
+    {
+        Box* widest = nullptr;
+        for (Box& box : boxes)
+            if (box.end - box.begin > 1 && box.range > 0 && (widest == nullptr || box.count * box.range > widest->count * widest->range))
+                widest = &box;
+        if (widest == nullptr)
+            break;
+
+        int channel = widest->channel;
+        sort(cells.begin() + widest->begin, cells.begin() + widest->end, [channel](const Cell& a, const Cell& b) { return a.color[channel] < b.color[channel]; });
+
+        uint64_t half = widest->count / 2;
+        uint64_t seen = 0;
+        size_t split = widest->begin;
+        while (split < widest->end - 1 && seen + cells[split].count <= half)
+            seen += cells[split++].count;
+        split = max(split, widest->begin + 1);
+
+        Box upper = { split, widest->end, 0, 0, 0 };
+        widest->end = split;
+        MeasureBox(*widest, cells);
+        MeasureBox(upper, cells);
+        boxes.push_back(upper);
+    }
+
+    vector<uint32_t> palette;
+    for (const Box& box : boxes)
+    {
+        uint64_t sum[4] = { 0, 0, 0, 0 };
+        for (size_t i = box.begin; i < box.end; ++i)
+            for (int c = 0; c < 4; ++c)
+                sum[c] += static_cast<uint64_t>(cells[i].color[c]) * cells[i].count;
+        uint8_t color[4];
+        for (int c = 0; c < 4; ++c)
+            color[c] = static_cast<uint8_t>((sum[c] + box.count / 2) / box.count);
+        palette.push_back(PackColor(color));
+    }
+
+    //A few rounds of k-means, assigning the cells across the workers
+    vector<uint8_t> nearest(cells.size());
+    int tasks = static_cast<int>((cells.size() + 4095) / 4096);
+    for (int iteration = 0; iteration < 8 && !palette.empty(); ++iteration)
+    {
+        SearchPalette search(palette);
+        ParallelFor(tasks, [&](int task)
+        {
+            size_t end = min(cells.size(), static_cast<size_t>(task + 1) * 4096);
+            for (size_t i = static_cast<size_t>(task) * 4096; i < end; ++i)
+                nearest[i] = static_cast<uint8_t>(search.Find(PackColor(cells[i].color)));
+        });
+
+        vector<array<uint64_t, 5>> totals(palette.size(), { 0, 0, 0, 0, 0 });
+        for (size_t i = 0; i < cells.size(); ++i)
+        {
+            array<uint64_t, 5>& total = totals[nearest[i]];
+            for (int c = 0; c < 4; ++c)
+                total[c] += static_cast<uint64_t>(cells[i].color[c]) * cells[i].count;
+            total[4] += cells[i].count;
+        }
+
+        bool moved = false;
+        for (size_t i = 0; i < palette.size(); ++i)
+        {
+            if (totals[i][4] == 0)
+                continue;
+            uint8_t color[4];
+            for (int c = 0; c < 4; ++c)
+                color[c] = static_cast<uint8_t>((totals[i][c] + totals[i][4] / 2) / totals[i][4]);
+            moved = moved || PackColor(color) != palette[i];
+            palette[i] = PackColor(color);
+        }
+        if (!moved)
+            break;
+    }
+
+    return palette;
+}
+
+//Replaces an rgba bitmap's pixels with indices into palette. Few enough colors go in 4
+//bits, like indexed sprites do.
+static void SetIndices(Bitmap& bitmap, const vector<uint32_t>& palette, const vector<uint8_t>& indices)
+{
+    bitmap.paletteSize = static_cast<int>(palette.size());
+    bitmap.palette = reinterpret_cast<uint32_t*>(calloc(palette.size(), sizeof(uint32_t)));
+    memcpy(bitmap.palette, palette.data(), palette.size() * sizeof(uint32_t));
+    bitmap.bitDepth = palette.size() <= 16 ? 4 : 8;
+
+    bitmap.FreePixels();
+    bitmap.data = reinterpret_cast<uint8_t*>(calloc(bitmap.Stride() * bitmap.height, sizeof(uint8_t)));
+    for (int y = 0; y < bitmap.height; ++y)
+    {
+        if (bitmap.bitDepth == 4)
+            PackNibbles(bitmap.data + y * bitmap.Stride(), &indices[static_cast<size_t>(y) * bitmap.width], bitmap.width);
+        else
+            memcpy(bitmap.data + y * bitmap.Stride(), &indices[static_cast<size_t>(y) * bitmap.width], bitmap.width);
+    }
+}
+
+bool QuantizePage(Bitmap& page, bool lossy)
+{
+    if (page.paletteSize > 0 || page.mask)
+        return false;
+
+    const uint32_t* pixels = reinterpret_cast<const uint32_t*>(page.data);
+    size_t count = static_cast<size_t>(page.width) * page.height;
+    vector<uint8_t> indices(count);
+    int bands = (page.height + QUANTIZE_BAND - 1) / QUANTIZE_BAND;
+    vector<uint32_t> palette;
+
+    //The page's color stats already hold every color when there are few enough of them
+    if (page.colors.complete)
+    {
+        palette = page.colors.colors;
+        ParallelFor(bands, [&](int band)
+        {
+            size_t end = min(count, static_cast<size_t>(band + 1) * QUANTIZE_BAND * page.width);
+            uint32_t last = 0;
+            uint8_t index = static_cast<uint8_t>(lower_bound(palette.begin(), palette.end(), last) - palette.begin());
+            for (size_t i = static_cast<size_t>(band) * QUANTIZE_BAND * page.width; i < end; ++i)
+            {
+                if (pixels[i] != last)
+                {
+                    last = pixels[i];
+                    index = static_cast<uint8_t>(lower_bound(palette.begin(), palette.end(), last) - palette.begin());
+                }
+                indices[i] = index;
+            }
+        });
+    }
+    else if (lossy)
+    {
+        //Transparent black is kept exact, so gaps and edges don't pick up a tint
+        bool clear = find(pixels, pixels + count, 0u) != pixels + count;
+        palette = BuildPalette(pixels, count, clear ? 255 : 256);
+        if (clear)
+            palette.insert(palette.begin(), 0);
+
+        SearchPalette search(palette);
+        ParallelFor(bands, [&](int band)
+        {
+            //Atlases repeat a lot of colors, so remember the last few thousand matches
+            static const size_t cacheSize = 4096;
+            vector<uint32_t> cacheColors(cacheSize, 0);
+            vector<uint8_t> cacheIndices(cacheSize, 0);
+            cacheIndices[0] = static_cast<uint8_t>(search.Find(0));
+
+            size_t end = min(count, static_cast<size_t>(band + 1) * QUANTIZE_BAND * page.width);
+            for (size_t i = static_cast<size_t>(band) * QUANTIZE_BAND * page.width; i < end; ++i)
+            {
+                uint32_t p = pixels[i];
+                size_t slot = (p * 0x9e3779b1u) >> 20;
+                if (cacheColors[slot] != p)
+                {
+                    cacheColors[slot] = p;
+                    cacheIndices[slot] = static_cast<uint8_t>(search.Find(p));
+                }
+                indices[i] = cacheIndices[slot];
+            }
+        });
+    }
+    if (palette.empty())
+        return false;
+
+    SetIndices(page, palette, indices);
+    return true;
+}
+
+PaletteLut::PaletteLut(const uint32_t* palette, int paletteSize, int transparentIndex)
+    : bits(paletteSize <= 16 ? 5 : 6), transparentIndex(transparentIndex >= 0 && transparentIndex < paletteSize ? transparentIndex : 0), colors(palette, palette + paletteSize)
+{
+    //The transparent entry is kept for transparent pixels, unless it's all there is
+    SearchPalette search(colors);
+    if (paletteSize > 1)
+        for (int c = 0; c < 4; ++c)
+            search.planes[c * search.count + this->transparentIndex] = 1e9f;
+
+    int size = 1 << bits;
+    int shift = 8 - bits;
+    indices.resize(static_cast<size_t>(size) * size * size);
+    ParallelFor(size, [&](int r)
+    {
+        for (int g = 0; g < size; ++g)
+        {
+            for (int b = 0; b < size; ++b)
+            {
+                //Each cell looks up the color in its middle
+                uint32_t color = ((r << shift) + (1 << shift) / 2) | (((g << shift) + (1 << shift) / 2) << 8) | (((b << shift) + (1 << shift) / 2) << 16) | 0xff000000;
+                indices[(static_cast<size_t>(r) * size + g) * size + b] = static_cast<uint8_t>(search.Find(color));
+            }
+        }
+    });
+}
+
+uint8_t PaletteLut::Find(int r, int g, int b) const
+{
+    int shift = 8 - bits;
+    return indices[((static_cast<size_t>(r >> shift) << bits | (g >> shift)) << bits) | (b >> shift)];
+}
+
+void RemapSprite(Bitmap& sprite, const PaletteLut& lut, Dither dither, bool premultiplied)
+{
+    if (sprite.paletteSize > 0 || sprite.mask)
+        return;
+
+    const uint32_t* pixels = reinterpret_cast<const uint32_t*>(sprite.data);
+    size_t stride = sprite.Stride() / 4;
+    int w = sprite.width;
+    vector<uint8_t> indices(static_cast<size_t>(w) * sprite.height);
+
+    //Ordered dithering spreads by roughly the gap between neighbouring palette colors
+    float gap = 255.0f / cbrtf(static_cast<float>(lut.colors.size()));
+    float spread[3] = { gap, gap, gap };
+
+    auto load = [&](int x, int y, float* v)
+    {
+        uint32_t p = pixels[y * stride + x];
+        uint32_t a = p >> 24;
+        if (a < 128)
+        {
+            indices[y * w + x] = static_cast<uint8_t>(lut.transparentIndex);
+            return false;
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            uint32_t value = (p >> (c * 8)) & 0xff;
+            if (premultiplied && a < 255)
+                value = min(255u, (value * 255 + a / 2) / a);
+            v[c] = static_cast<float>(value);
+        }
+        return true;
+    };
+
+    auto nearest = [&](int x, int y, const float* v, float* chosen)
+    {
+        int level[3];
+        for (int c = 0; c < 3; ++c)
+            level[c] = min(255, max(0, static_cast<int>(floorf(v[c] + 0.5f))));
+
+        uint8_t index = lut.Find(level[0], level[1], level[2]);
+        indices[y * w + x] = index;
+        for (int c = 0; c < 3; ++c)
+            chosen[c] = static_cast<float>((lut.colors[index] >> (c * 8)) & 0xff);
+    };
+
+    DitherRect(w, sprite.height, dither, spread, load, nearest);
+
+    SetIndices(sprite, lut.colors, indices);
+    sprite.colors = ColorStats();
+}
+
+//Indices a sprite uses, unpacked to a byte each
+static vector<uint8_t> GetIndices(const Bitmap& sprite)
+{
+    vector<uint8_t> indices(static_cast<size_t>(sprite.width) * sprite.height);
+    for (int y = 0; y < sprite.height; ++y)
+    {
+        if (sprite.bitDepth == 4)
+            UnpackNibbles(&indices[static_cast<size_t>(y) * sprite.width], sprite.data + y * sprite.Stride(), sprite.width);
+        else
+            memcpy(&indices[static_cast<size_t>(y) * sprite.width], sprite.data + y * sprite.Stride(), sprite.width);
+    }
+    return indices;
+}
+
+static size_t CountShared(const vector<uint32_t>& a, const vector<uint32_t>& b)
+{
+    size_t shared = 0;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();)
+    {
+        if (a[i] == b[j])
+        {
+            ++shared;
+            ++i;
+            ++j;
+        }
+        else if (a[i] < b[j])
+            ++i;
+        else
+            ++j;
+    }
+    return shared;
+}
+
+static void AddColors(vector<uint32_t>& bank, const vector<uint32_t>& colors)
+{
+    vector<uint32_t> merged;
+    set_union(bank.begin(), bank.end(), colors.begin(), colors.end(), back_inserter(merged));
+    bank.swap(merged);
+}
+
+bool AllocatePaletteBanks(const vector<Bitmap*>& sprites, vector<uint32_t>& palette)
+{
+    //Every bank keeps its first entry for transparent pixels
+    static const size_t bankColors = 15;
+
+    //The sorted opaque colors each sprite actually uses
+    vector<vector<uint32_t>> colors(sprites.size());
+    ParallelFor(static_cast<int>(sprites.size()), [&](int i)
+    {
+        bool used[256] = {};
+        for (uint8_t index : GetIndices(*sprites[i]))
+            used[index] = true;
+        for (int j = 0; j < sprites[i]->paletteSize; ++j)
+            if (used[j] && (sprites[i]->palette[j] >> 24) != 0)
+                colors[i].push_back(sprites[i]->palette[j]);
+        sort(colors[i].begin(), colors[i].end());
+        colors[i].erase(unique(colors[i].begin(), colors[i].end()), colors[i].end());
+    });
+
+    for (size_t i = 0; i < sprites.size(); ++i)
+    {
+        if (colors[i].size() > bankColors)
+        {
+            cerr << "sprite uses more than " << bankColors << " colors, can't fit a palette bank: " << sprites[i]->name << endl;
+            return false;
+        }
+    }
+
+    //Biggest color sets first, each into the bank it shares the most colors with and still
+    //fits in, then merge any banks that fit together
+    vector<vector<uint32_t>> sets(colors);
+    sort(sets.begin(), sets.end(), [](const vector<uint32_t>& a, const vector<uint32_t>& b) { return a.size() != b.size() ? a.size() > b.size() : a < b; });
+    sets.erase(unique(sets.begin(), sets.end()), sets.end());
+
+    vector<vector<uint32_t>> banks;
+    for (const vector<uint32_t>& set : sets)
+    {
+        int best = -1;
+        size_t bestShared = 0;
+        for (size_t i = 0; i < banks.size(); ++i)
+        {
+            size_t shared = CountShared(banks[i], set);
+            if (banks[i].size() + set.size() - shared <= bankColors && (best < 0 || shared > bestShared))
+            {
+                best = static_cast<int>(i);
+                bestShared = shared;
+            }
+        }
+        if (best < 0)
+            banks.push_back(set);
+        else
+            AddColors(banks[best], set);
+    }
+
+    for (size_t i = 0; i < banks.size(); ++i)
+    {
+        for (size_t j = i + 1; j < banks.size();)
+        {
+            if (banks[i].size() + banks[j].size() - CountShared(banks[i], banks[j]) <= bankColors)
+            {
+                AddColors(banks[i], banks[j]);
+                banks.erase(banks.begin() + j);
+                j = i + 1;
+            }
+            else
+                ++j;
+        }
+    }
+
+    if (banks.size() > 16)
+    {
+        cerr << "sprites need " << banks.size() << " palette banks, only 16 fit a 256 color palette" << endl;
+        return false;
+    }
+
+    palette.assign(banks.size() * 16, 0);
+    for (size_t i = 0; i < banks.size(); ++i)
+        copy(banks[i].begin(), banks[i].end(), palette.begin() + i * 16 + 1);
+
+    //Each sprite goes to the first bank holding all of its colors
+    ParallelFor(static_cast<int>(sprites.size()), [&](int i)
+    {
+        Bitmap& sprite = *sprites[i];
+        size_t bank = 0;
+        while (!includes(banks[bank].begin(), banks[bank].end(), colors[i].begin(), colors[i].end()))
+            ++bank;
+
+        uint8_t table[256] = {};
+        for (int j = 0; j < sprite.paletteSize; ++j)
+        {
+            uint32_t c = sprite.palette[j];
+            if ((c >> 24) != 0)
+            {
+                auto found = lower_bound(banks[bank].begin(), banks[bank].end(), c);
+                if (found != banks[bank].end() && *found == c)
+                    table[j] = static_cast<uint8_t>(1 + (found - banks[bank].begin()));
+            }
+        }
+
+        vector<uint8_t> indices = GetIndices(sprite);
+        for (uint8_t& index : indices)
+            index = table[index];
+
+        free(sprite.palette);
+        SetIndices(sprite, vector<uint32_t>(palette.begin() + bank * 16, palette.begin() + (bank + 1) * 16), indices);
+        sprite.SetPaletteSlot(static_cast<int>(bank));
+
+        //Sprites only differing in their colors now share their indices, so --unique can
+        //alias them
+        sprite.UpdateHash();
+    });
+
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef quantize_hpp
+#define quantize_hpp
+
+#include <vector>
+#include "bitmap.hpp"
+#include "texture.hpp"
+
+using namespace std;
+
+enum Quantize
+{
+    QUANTIZE_NONE,
+    QUANTIZE_LOSSLESS,
+    QUANTIZE_LOSSY
+};
+
+//Turns an rgba page into an indexed one in place. Pages with at most 256 colors keep
+//them exactly; anything else is only reduced when lossy is set, with median cut
+//refined by k-means. Returns false, leaving the page alone, if it stays rgba.
+bool QuantizePage(Bitmap& page, bool lossy);
+
+//Nearest opaque palette entry for every color, cut to 5 bits a channel for palettes of
+//up to 16 colors and 6 bits for bigger ones. Built across the worker threads.
+struct PaletteLut
+{
+    int bits;
+    int transparentIndex;
+    vector<uint32_t> colors;
+    vector<uint8_t> indices;
+
+    PaletteLut(const uint32_t* palette, int paletteSize, int transparentIndex);
+    uint8_t Find(int r, int g, int b) const;
+};
+
+//Turns an rgba sprite into indices into the lut's palette, dithering it if asked to.
+//Pixels less than half opaque become the transparent index.
+void RemapSprite(Bitmap& sprite, const PaletteLut& lut, Dither dither, bool premultiplied);
+
+//Sorts the colors of indexed sprites into as few 16 color banks as it can, each bank
+//starting with transparent black. Every sprite is remapped to 4 bit indices into its
+//bank, which becomes its palette slot. Fills palette with the banks one after another,
+//or returns false if a sprite has more than 15 opaque colors or 16 banks aren't enough.
+bool AllocatePaletteBanks(const vector<Bitmap*>& sprites, vector<uint32_t>& palette);
+
+#endif
@@ -0,0 +1,988 @@
+#include "simd.hpp"
+#include "lodepng.h"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cfloat>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#if defined(SIMD_X86) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SIMD_SSE2
+#endif
+
+//Lets a function use instructions beyond the build's baseline. It's only ever called
+//after the CPU check below says they're there.
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMD_TARGET(x) __attribute__((target(x)))
+#else
+#define SIMD_TARGET(x)
+#endif
+
+using namespace std;
+
+static struct CpuFeatures
+{
+    bool ssse3;
+    bool sse41;
+    bool pclmul;
+    bool avx2;
+    CpuFeatures();
+} cpu;
+
+CpuFeatures::CpuFeatures()
+    : ssse3(false), sse41(false), pclmul(false), avx2(false)
+{
+#if defined(SIMD_SSE2) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int leaves = info[0];
+    __cpuid(info, 1);
+    ssse3 = (info[2] >> 9) & 1;
+    sse41 = (info[2] >> 19) & 1;
+    pclmul = (info[2] >> 1) & 1;
+    bool osAvx = ((info[2] >> 27) & 1) && ((info[2] >> 28) & 1) && (_xgetbv(0) & 6) == 6;
+    if (leaves >= 7)
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = osAvx && ((info[1] >> 5) & 1);
+    }
+#elif defined(SIMD_SSE2)
+    __builtin_cpu_init();
+    ssse3 = __builtin_cpu_supports("ssse3");
+    sse41 = __builtin_cpu_supports("sse4.1");
+    pclmul = __builtin_cpu_supports("pclmul");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+static inline uint8_t Paeth(int a, int b, int c)
+{
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - c - c);
+    if (pb < pa)
+    {
+        a = b;
+        pa = pb;
+    }
+    return static_cast<uint8_t>(pc < pa ? c : a);
+}
+
+//Scalar unfilter for bytes [from, length), with everything before from already done
+static void UnfilterRange(uint8_t* recon, const uint8_t* scanline, const uint8_t* precon, size_t from, size_t length, uint8_t filterType)
+{
+    size_t i = from;
+    for (; i < length && i < 4; ++i)
+    {
+        int up = precon ? precon[i] : 0;
+        if (filterType == 2 || filterType == 4)
+            recon[i] = scanline[i] + up;
+        else if (filterType == 3)
+            recon[i] = scanline[i] + (up >> 1);
+        else
+            recon[i] = scanline[i];
+    }
+    switch (filterType)
+    {
+        case 0:
+            for (; i < length; ++i)
+                recon[i] = scanline[i];
+            break;
+        case 1:
+            for (; i < length; ++i)
+                recon[i] = scanline[i] + recon[i - 4];
+            break;
+        case 2:
+            for (; i < length; ++i)
+                recon[i] = scanline[i] + (precon ? precon[i] : 0);
+            break;
+        case 3:
+            for (; i < length; ++i)
+                recon[i] = scanline[i] + ((recon[i - 4] + (precon ? precon[i] : 0)) >> 1);
+            break;
+        case 4:
+            for (; i < length; ++i)
+                recon[i] = scanline[i] + (precon ? Paeth(recon[i - 4], precon[i], precon[i - 4]) : recon[i - 4]);
+            break;
+    }
+}
+
+//Scalar filter for bytes [from, length)
+static void FilterRange(uint8_t* out, const uint8_t* scanline, const uint8_t* prevline, size_t from, size_t length, uint8_t filterType)
+{
+    for (size_t i = from; i < length; ++i)
+    {
+        int a = i >= 4 ? scanline[i - 4] : 0;
+        int b = prevline ? prevline[i] : 0;
+        int c = prevline && i >= 4 ? prevline[i - 4] : 0;
+        int predict = 0;
+        if (filterType == 1)
+            predict = a;
+        else if (filterType == 2)
+            predict = b;
+        else if (filterType == 3)
+            predict = (a + b) >> 1;
+        else if (filterType == 4)
+            predict = Paeth(a, b, c);
+        out[i] = static_cast<uint8_t>(scanline[i] - predict);
+    }
+}
+
+#ifdef SIMD_SSE2
+
+static inline __m128i Load4(const uint8_t* p)
+{
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return _mm_cvtsi32_si128(v);
+}
+
+static inline void Store4(uint8_t* p, __m128i v)
+{
+    int32_t x = _mm_cvtsi128_si32(v);
+    memcpy(p, &x, sizeof(x));
+}
+
+static inline __m128i Abs16(__m128i x)
+{
+    __m128i sign = _mm_srai_epi16(x, 15);
+    return _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+}
+
+static inline __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+//Paeth predictor on 16-bit lanes, ties resolved a, b, c like the scalar version
+static inline __m128i Paeth16(__m128i a, __m128i b, __m128i c)
+{
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = Abs16(_mm_add_epi16(pa, pb));
+    pa = Abs16(pa);
+    pb = Abs16(pb);
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    return Select(_mm_cmpeq_epi16(smallest, pa), a, Select(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+
+//PNG wants a truncating average, _mm_avg_epu8 rounds up
+static inline __m128i Average(__m128i a, __m128i b)
+{
+    __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+//Sub is a running sum over pixels: two shifted adds sum the four pixels of a vector,
+//then the last pixel of the previous vector is added to all of them
+static void UnfilterSubSse2(uint8_t* recon, const uint8_t* scanline, size_t length)
+{
+    __m128i last = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(scanline + i));
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+        d = _mm_add_epi8(d, _mm_shuffle_epi32(last, 0xff));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(recon + i), d);
+        last = d;
+    }
+    UnfilterRange(recon, scanline, nullptr, i, length, 1);
+}
+
+static void UnfilterUpSse2(uint8_t* recon, const uint8_t* scanline, const uint8_t* precon, size_t length)
+{
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(scanline + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(precon + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(recon + i), _mm_add_epi8(s, b));
+    }
+    UnfilterRange(recon, scanline, precon, i, length, 2);
+}
+
+SIMD_TARGET("avx2")
+static void UnfilterUpAvx2(uint8_t* recon, const uint8_t* scanline, const uint8_t* precon, size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(scanline + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(precon + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(recon + i), _mm256_add_epi8(s, b));
+    }
+    UnfilterUpSse2(recon + i, scanline + i, precon + i, length - i);
+}
+
+//Average and Paeth depend on the pixel just decoded, so these go a pixel at a time
+//with the four channels side by side
+static void UnfilterAverageSse2(uint8_t* recon, const uint8_t* scanline, const uint8_t* precon, size_t length)
+{
+    __m128i d = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        __m128i b = Load4(precon + i);
+        d = _mm_add_epi8(Load4(scanline + i), Average(d, b));
+        Store4(recon + i, d);
+    }
+    UnfilterRange(recon, scanline, precon, i, length, 3);
+}
+
+static void UnfilterPaethSse2(uint8_t* recon, const uint8_t* scanline, const uint8_t* precon, size_t length)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i b = zero;
+    __m128i d = zero;
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        __m128i c = b;
+        __m128i a = d;
+        b = _mm_unpacklo_epi8(Load4(precon + i), zero);
+        d = _mm_unpacklo_epi8(Load4(scanline + i), zero);
+        d = _mm_add_epi8(d, Paeth16(a, b, c));
+        Store4(recon + i, _mm_packus_epi16(d, d));
+    }
+    UnfilterRange(recon, scanline, precon, i, length, 4);
+}
+
+static void FilterSse2(uint8_t* out, const uint8_t* scanline, const uint8_t* prevline, size_t length, uint8_t filterType)
+{
+    FilterRange(out, scanline, prevline, 0, min(length, (size_t)4), filterType);
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 4;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(scanline + i));
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(scanline + i - 4));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prevline + i));
+        __m128i predict;
+        if (filterType == 1)
+            predict = a;
+        else if (filterType == 2)
+            predict = b;
+        else if (filterType == 3)
+            predict = Average(a, b);
+        else
+        {
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prevline + i - 4));
+            __m128i lo = Paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+            __m128i hi = Paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+            predict = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi8(s, predict));
+    }
+    FilterRange(out, scanline, prevline, i, length, filterType);
+}
+
+SIMD_TARGET("avx2")
+static inline __m256i Paeth16Avx2(__m256i a, __m256i b, __m256i c)
+{
+    __m256i pa = _mm256_sub_epi16(b, c);
+    __m256i pb = _mm256_sub_epi16(a, c);
+    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+    pa = _mm256_abs_epi16(pa);
+    pb = _mm256_abs_epi16(pb);
+    __m256i smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+    __m256i bc = _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb));
+    return _mm256_blendv_epi8(bc, a, _mm256_cmpeq_epi16(smallest, pa));
+}
+
+SIMD_TARGET("avx2")
+static void FilterAvx2(uint8_t* out, const uint8_t* scanline, const uint8_t* prevline, size_t length, uint8_t filterType)
+{
+    FilterRange(out, scanline, prevline, 0, min(length, (size_t)4), filterType);
+    __m256i one = _mm256_set1_epi8(1);
+    size_t i = 4;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(scanline + i));
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(scanline + i - 4));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prevline + i));
+        __m256i predict;
+        if (filterType == 1)
+            predict = a;
+        else if (filterType == 2)
+            predict = b;
+        else if (filterType == 3)
+            predict = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+        else
+        {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prevline + i - 4));
+            __m256i zero = _mm256_setzero_si256();
+            __m256i lo = Paeth16Avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+            __m256i hi = Paeth16Avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+            predict = _mm256_packus_epi16(lo, hi);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_sub_epi8(s, predict));
+    }
+    FilterRange(out, scanline, prevline, i, length, filterType);
+}
+
+static size_t FilterSumSse2(const uint8_t* line, size_t length, bool raw)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i sums = zero;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + i));
+        //Bytes >= 128 count as 255 - v, which is what flipping their bits gives
+        if (!raw)
+            v = _mm_xor_si128(v, _mm_cmplt_epi8(v, zero));
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(v, zero));
+    }
+    size_t sum = static_cast<size_t>(_mm_cvtsi128_si32(sums)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+    for (; i < length; ++i)
+        sum += raw || line[i] < 128 ? line[i] : 255 - line[i];
+    return sum;
+}
+
+#endif
+
+bool UnfilterScanline4(uint8_t* recon, const uint8_t* scanline, const uint8_t* precon, size_t length, uint8_t filterType)
+{
+    if (filterType > 4)
+        return false;
+
+    //Without a line above, Up is a copy and Paeth turns into Sub
+    if (!precon && filterType == 2)
+        filterType = 0;
+    if (!precon && filterType == 4)
+        filterType = 1;
+
+    if (filterType == 0)
+    {
+        if (recon != scanline)
+            memmove(recon, scanline, length);
+        return true;
+    }
+
+#ifdef SIMD_SSE2
+    if (filterType == 1)
+        UnfilterSubSse2(recon, scanline, length);
+    else if (filterType == 2 && cpu.avx2)
+        UnfilterUpAvx2(recon, scanline, precon, length);
+    else if (filterType == 2)
+        UnfilterUpSse2(recon, scanline, precon, length);
+    else if (filterType == 3 && precon)
+        UnfilterAverageSse2(recon, scanline, precon, length);
+    else if (filterType == 4)
+        UnfilterPaethSse2(recon, scanline, precon, length);
+    else
+        UnfilterRange(recon, scanline, precon, 0, length, filterType);
+#else
+    UnfilterRange(recon, scanline, precon, 0, length, filterType);
+#endif
+    return true;
+}
+
+void FilterScanline4(uint8_t* out, const uint8_t* scanline, const uint8_t* prevline, size_t length, uint8_t filterType)
+{
+    if (!prevline && filterType == 2)
+        filterType = 0;
+    if (!prevline && filterType == 4)
+        filterType = 1;
+
+    if (filterType == 0)
+    {
+        memcpy(out, scanline, length);
+        return;
+    }
+
+#ifdef SIMD_SSE2
+    //Sub is the only filter that doesn't look at the line above
+    if (prevline || filterType == 1)
+    {
+        const uint8_t* above = prevline ? prevline : scanline;
+        if (cpu.avx2)
+            FilterAvx2(out, scanline, above, length, filterType);
+        else
+            FilterSse2(out, scanline, above, length, filterType);
+        return;
+    }
+#endif
+    FilterRange(out, scanline, prevline, 0, length, filterType);
+}
+
+size_t FilterSum(const uint8_t* line, size_t length, bool raw)
+{
+#ifdef SIMD_SSE2
+    return FilterSumSse2(line, length, raw);
+#else
+    size_t sum = 0;
+    for (size_t i = 0; i < length; ++i)
+        sum += raw || line[i] < 128 ? line[i] : 255 - line[i];
+    return sum;
+#endif
+}
+
+//Rounds x / 255 for x up to 255 * 255 without a division
+static inline uint32_t Div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static void PackPixelsScalar(uint16_t* out, const uint32_t* pixels, size_t count, const uint8_t bits[4], const uint8_t shifts[4])
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t packed = 0;
+        for (int c = 0; c < 4; ++c)
+            if (bits[c])
+                packed |= Div255(((pixels[i] >> (c * 8)) & 0xff) * ((1u << bits[c]) - 1)) << shifts[c];
+        out[i] = static_cast<uint16_t>(packed);
+    }
+}
+
+#ifdef SIMD_SSE2
+
+//Eight pixels at a time: each channel is gathered into 16-bit lanes, scaled, rounded
+//and shifted into place
+static void PackPixelsSse2(uint16_t* out, const uint32_t* pixels, size_t count, const uint8_t bits[4], const uint8_t shifts[4])
+{
+    const __m128i low = _mm_set1_epi32(0xff);
+    const __m128i half = _mm_set1_epi16(128);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+        __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i + 4));
+        __m128i packed = _mm_setzero_si128();
+        for (int c = 0; c < 4; ++c)
+        {
+            if (!bits[c])
+                continue;
+
+            __m128i channel = _mm_cvtsi32_si128(c * 8);
+            __m128i v = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(p0, channel), low), _mm_and_si128(_mm_srl_epi32(p1, channel), low));
+            __m128i x = _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(static_cast<short>((1 << bits[c]) - 1))), half);
+            x = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+            packed = _mm_or_si128(packed, _mm_sll_epi16(x, _mm_cvtsi32_si128(shifts[c])));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+    }
+    PackPixelsScalar(out + i, pixels + i, count - i, bits, shifts);
+}
+
+#endif
+
+void PackPixels16(uint16_t* out, const uint32_t* pixels, size_t count, const uint8_t bits[4], const uint8_t shifts[4])
+{
+#ifdef SIMD_SSE2
+    PackPixelsSse2(out, pixels, count, bits, shifts);
+#else
+    PackPixelsScalar(out, pixels, count, bits, shifts);
+#endif
+}
+
+//Truncates like the float multiply sprites have always been premultiplied with, or
+//rounds exactly
+static void PremultiplyScalar(uint32_t* pixels, size_t count, bool rounded)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t c = pixels[i];
+        uint32_t a = c >> 24;
+        uint32_t r, g, b;
+        if (rounded)
+        {
+            r = Div255((c & 0xff) * a);
+            g = Div255(((c >> 8) & 0xff) * a);
+            b = Div255(((c >> 16) & 0xff) * a);
+        }
+        else
+        {
+            float m = static_cast<float>(a) / 255.0f;
+            r = static_cast<uint32_t>((c & 0xff) * m);
+            g = static_cast<uint32_t>(((c >> 8) & 0xff) * m);
+            b = static_cast<uint32_t>(((c >> 16) & 0xff) * m);
+        }
+        pixels[i] = (a << 24) | (b << 16) | (g << 8) | r;
+    }
+}
+
+#ifdef SIMD_SSE2
+
+//Four pixels at a time with a channel in each 32-bit lane. The float path does the
+//same single precision divide and multiply as the scalar one, so it truncates the same.
+static void PremultiplySse2(uint32_t* pixels, size_t count, bool rounded)
+{
+    const __m128i low = _mm_set1_epi32(0xff);
+    const __m128i half = _mm_set1_epi32(128);
+    const __m128 scale = _mm_set1_ps(255.0f);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+        __m128i a = _mm_srli_epi32(p, 24);
+        __m128i rgb[3];
+        for (int c = 0; c < 3; ++c)
+            rgb[c] = _mm_and_si128(_mm_srli_epi32(p, c * 8), low);
+
+        if (rounded)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                //Every product fits in 16 bits, so the low halves of the lanes are enough
+                __m128i x = _mm_add_epi32(_mm_mullo_epi16(rgb[c], a), half);
+                rgb[c] = _mm_srli_epi32(_mm_add_epi32(x, _mm_srli_epi32(x, 8)), 8);
+            }
+        }
+        else
+        {
+            __m128 m = _mm_div_ps(_mm_cvtepi32_ps(a), scale);
+            for (int c = 0; c < 3; ++c)
+                rgb[c] = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(rgb[c]), m));
+        }
+
+        __m128i out = _mm_or_si128(_mm_slli_epi32(a, 24), rgb[0]);
+        out = _mm_or_si128(out, _mm_slli_epi32(rgb[1], 8));
+        out = _mm_or_si128(out, _mm_slli_epi32(rgb[2], 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i), out);
+    }
+    PremultiplyScalar(pixels + i, count - i, rounded);
+}
+
+#endif
+
+void Premultiply(uint32_t* pixels, size_t count, bool rounded)
+{
+#ifdef SIMD_SSE2
+    PremultiplySse2(pixels, count, rounded);
+#else
+    PremultiplyScalar(pixels, count, rounded);
+#endif
+}
+
+size_t FindVisible(const uint32_t* pixels, size_t count)
+{
+    size_t i = 0;
+#ifdef SIMD_SSE2
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i p = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i)), alpha);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(p, zero)) != 0xffff)
+            break;
+    }
+#endif
+    for (; i < count; ++i)
+        if (pixels[i] >> 24)
+            return i;
+    return count;
+}
+
+size_t FindNonZero(const uint8_t* bytes, size_t count)
+{
+    size_t i = 0;
+#ifdef SIMD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            break;
+    }
+#endif
+    for (; i < count; ++i)
+        if (bytes[i])
+            return i;
+    return count;
+}
+
+static inline uint8_t GetNibble(const uint8_t* row, size_t x)
+{
+    return (x & 1) ? row[x >> 1] & 0x0f : row[x >> 1] >> 4;
+}
+
+static inline void SetNibble(uint8_t* row, size_t x, uint8_t value)
+{
+    uint8_t& b = row[x >> 1];
+    b = (x & 1) ? static_cast<uint8_t>((b & 0xf0) | value) : static_cast<uint8_t>((b & 0x0f) | (value << 4));
+}
+
+void UnpackNibbles(uint8_t* out, const uint8_t* in, size_t count)
+{
+    size_t i = 0;
+#ifdef SIMD_SSE2
+    const __m128i low = _mm_set1_epi8(0x0f);
+    for (; i + 32 <= count; i += 32)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i / 2));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low);
+        __m128i lo = _mm_and_si128(v, low);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (; i < count; ++i)
+        out[i] = GetNibble(in, i);
+}
+
+void PackNibbles(uint8_t* out, const uint8_t* in, size_t count)
+{
+    size_t i = 0;
+#ifdef SIMD_SSE2
+    //Each 16 bit lane holds a pair of pixels, the first in its low byte
+    const __m128i high = _mm_set1_epi16(0x00f0);
+    for (; i + 32 <= count; i += 32)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 16));
+        a = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(a, 4), high), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(b, 4), high), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i / 2), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i + 2 <= count; i += 2)
+        out[i / 2] = static_cast<uint8_t>((in[i] << 4) | in[i + 1]);
+    if (i < count)
+        out[i / 2] = static_cast<uint8_t>(in[i] << 4);
+}
+
+void CopyNibbles(uint8_t* dst, size_t dstX, const uint8_t* src, size_t srcX, size_t count)
+{
+    //Line the destination up on a whole byte, the trailing pixel is done the same way
+    if (count > 0 && (dstX & 1))
+    {
+        SetNibble(dst, dstX++, GetNibble(src, srcX++));
+        --count;
+    }
+    if (count & 1)
+        SetNibble(dst, dstX + count - 1, GetNibble(src, srcX + count - 1));
+
+    uint8_t* out = dst + dstX / 2;
+    const uint8_t* in = src + srcX / 2;
+    size_t bytes = count / 2;
+    if ((srcX & 1) == 0)
+    {
+        memcpy(out, in, bytes);
+        return;
+    }
+
+    //The source is half a byte off, so each byte takes the low nibble of one and the
+    //high nibble of the next
+    size_t i = 0;
+#ifdef SIMD_SSE2
+    const __m128i low = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 1));
+        __m128i v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, low), 4), _mm_and_si128(_mm_srli_epi16(b, 4), low));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+    }
+#endif
+    for (; i < bytes; ++i)
+        out[i] = static_cast<uint8_t>((in[i] << 4) | (in[i + 1] >> 4));
+}
+
+int FindNearestColor(const float* planes, size_t count, uint32_t color)
+{
+    const float* red = planes;
+    const float* green = planes + count;
+    const float* blue = planes + count * 2;
+    const float* alpha = planes + count * 3;
+    float r = static_cast<float>(color & 0xff);
+    float g = static_cast<float>((color >> 8) & 0xff);
+    float b = static_cast<float>((color >> 16) & 0xff);
+    float a = static_cast<float>(color >> 24);
+
+#ifdef SIMD_SSE2
+    //Four entries at a time, each lane keeping its own best so far
+    __m128 pr = _mm_set1_ps(r);
+    __m128 pg = _mm_set1_ps(g);
+    __m128 pb = _mm_set1_ps(b);
+    __m128 pa = _mm_set1_ps(a);
+    __m128 best = _mm_set1_ps(FLT_MAX);
+    __m128i bestIndex = _mm_setzero_si128();
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i four = _mm_set1_epi32(4);
+    for (size_t i = 0; i < count; i += 4)
+    {
+        __m128 dr = _mm_sub_ps(_mm_loadu_ps(red + i), pr);
+        __m128 dg = _mm_sub_ps(_mm_loadu_ps(green + i), pg);
+        __m128 db = _mm_sub_ps(_mm_loadu_ps(blue + i), pb);
+        __m128 da = _mm_sub_ps(_mm_loadu_ps(alpha + i), pa);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_add_ps(_mm_mul_ps(db, db), _mm_mul_ps(da, da)));
+        __m128i closer = _mm_castps_si128(_mm_cmplt_ps(d, best));
+        best = _mm_min_ps(d, best);
+        bestIndex = _mm_or_si128(_mm_and_si128(closer, index), _mm_andnot_si128(closer, bestIndex));
+        index = _mm_add_epi32(index, four);
+    }
+
+    alignas(16) float distances[4];
+    alignas(16) int32_t indices[4];
+    _mm_store_ps(distances, best);
+    _mm_store_si128(reinterpret_cast<__m128i*>(indices), bestIndex);
+    int nearest = indices[0];
+    float nearestDistance = distances[0];
+    for (int i = 1; i < 4; ++i)
+    {
+        if (distances[i] < nearestDistance || (distances[i] == nearestDistance && indices[i] < nearest))
+        {
+            nearest = indices[i];
+            nearestDistance = distances[i];
+        }
+    }
+    return nearest;
+#else
+    int nearest = 0;
+    float nearestDistance = FLT_MAX;
+    for (size_t i = 0; i < count; ++i)
+    {
+        float dr = red[i] - r;
+        float dg = green[i] - g;
+        float db = blue[i] - b;
+        float da = alpha[i] - a;
+        float d = dr * dr + dg * dg + db * db + da * da;
+        if (d < nearestDistance)
+        {
+            nearest = static_cast<int>(i);
+            nearestDistance = d;
+        }
+    }
+    return nearest;
+#endif
+}
+
+//Slicing-by-8 tables for the scalar CRC, table[0] is the usual byte-wise one
+static struct CrcTables
+{
+    uint32_t table[8][256];
+    CrcTables();
+} crcTables;
+
+CrcTables::CrcTables()
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i)
+        for (int t = 1; t < 8; ++t)
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+}
+
+//Works on the inverted register, like the rest of the CRC code below
+static uint32_t CrcScalar(uint32_t c, const uint8_t* data, size_t size)
+{
+    const uint32_t (*t)[256] = crcTables.table;
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= c;
+        c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    while (size--)
+        c = t[0][(c ^ *data++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+#ifdef SIMD_SSE2
+
+//Carry-less multiply folding from Intel's "Fast CRC Computation for Generic
+//Polynomials Using PCLMULQDQ", with the bit-reflected constants for the PNG/zlib
+//polynomial. Folds four 16-byte lanes at once, then down to one and Barrett-reduces
+//to 32 bits. size must be a multiple of 16 and at least 64.
+SIMD_TARGET("sse4.1,pclmul")
+static uint32_t CrcPclmul(uint32_t c, const uint8_t* data, size_t size)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0));
+    __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+    __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32));
+    __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(c)));
+    data += 64;
+    size -= 64;
+
+    for (; size >= 64; size -= 64, data += 64)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)));
+    }
+
+    //Fold the four lanes into one, then any remaining 16-byte blocks into that
+    __m128i lanes[3] = { x2, x3, x4 };
+    for (int i = 0; i < 3; ++i)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+    }
+    for (; size >= 16; size -= 16, data += 16)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data))), x5);
+    }
+
+    //128 to 64 bits
+    __m128i x2b = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2b);
+    x2b = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2b);
+
+    //Barrett reduction to 32 bits
+    x2b = _mm_and_si128(x1, mask32);
+    x2b = _mm_clmulepi64_si128(x2b, poly, 0x10);
+    x2b = _mm_and_si128(x2b, mask32);
+    x2b = _mm_clmulepi64_si128(x2b, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2b);
+    return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+#endif
+
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+    uint32_t c = ~crc;
+#ifdef SIMD_SSE2
+    if (size >= 64 && cpu.pclmul && cpu.sse41)
+    {
+        size_t bulk = size & ~static_cast<size_t>(15);
+        c = CrcPclmul(c, data, bulk);
+        data += bulk;
+        size -= bulk;
+    }
+#endif
+    return ~CrcScalar(c, data, size);
+}
+
+#define ADLER_BASE 65521
+//Most bytes that can be summed before the second sum may overflow 32 bits
+#define ADLER_MAX 5552
+
+static uint32_t AdlerScalar(uint32_t a, uint32_t b, const uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t n = min(size, (size_t)ADLER_MAX);
+        size -= n;
+        for (; n >= 4; n -= 4, data += 4)
+        {
+            a += data[0];
+            b += a;
+            a += data[1];
+            b += a;
+            a += data[2];
+            b += a;
+            a += data[3];
+            b += a;
+        }
+        while (n--)
+        {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return (b << 16) | a;
+}
+
+#ifdef SIMD_SSE2
+
+//32 bytes per step: the byte sums come from _mm_sad_epu8, the position-weighted sums
+//from _mm_maddubs_epi16 against 32..1. Each byte also adds the running first sum to
+//the second once per remaining step, which is gathered up in prefix and added as
+//32 * prefix at the end of the chunk.
+SIMD_TARGET("ssse3")
+static uint32_t AdlerSsse3(uint32_t a, uint32_t b, const uint8_t* data, size_t size)
+{
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    size_t blocks = size / 32;
+    size -= blocks * 32;
+    while (blocks)
+    {
+        size_t n = min(blocks, (size_t)(ADLER_MAX / 32));
+        blocks -= n;
+
+        __m128i prefix = _mm_cvtsi32_si128(static_cast<int>(a * n));
+        __m128i sumB = _mm_cvtsi32_si128(static_cast<int>(b));
+        __m128i sumA = zero;
+        for (size_t i = 0; i < n; ++i, data += 32)
+        {
+            __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+            __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+            prefix = _mm_add_epi32(prefix, sumA);
+            sumA = _mm_add_epi32(sumA, _mm_sad_epu8(bytes1, zero));
+            sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            sumA = _mm_add_epi32(sumA, _mm_sad_epu8(bytes2, zero));
+            sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+        }
+        sumB = _mm_add_epi32(sumB, _mm_slli_epi32(prefix, 5));
+
+        sumA = _mm_add_epi32(sumA, _mm_shuffle_epi32(sumA, _MM_SHUFFLE(2, 3, 0, 1)));
+        sumA = _mm_add_epi32(sumA, _mm_shuffle_epi32(sumA, _MM_SHUFFLE(1, 0, 3, 2)));
+        sumB = _mm_add_epi32(sumB, _mm_shuffle_epi32(sumB, _MM_SHUFFLE(2, 3, 0, 1)));
+        sumB = _mm_add_epi32(sumB, _mm_shuffle_epi32(sumB, _MM_SHUFFLE(1, 0, 3, 2)));
+        a = (a + static_cast<uint32_t>(_mm_cvtsi128_si32(sumA))) % ADLER_BASE;
+        b = static_cast<uint32_t>(_mm_cvtsi128_si32(sumB)) % ADLER_BASE;
+    }
+    return AdlerScalar(a, b, data, size);
+}
+
+#endif
+
+uint32_t Adler32(uint32_t adler, const uint8_t* data, size_t size)
+{
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+#ifdef SIMD_SSE2
+    if (cpu.ssse3)
+        return AdlerSsse3(a, b, data, size);
+#endif
+    return AdlerScalar(a, b, data, size);
+}
+
+unsigned lodepng_crc32(const unsigned char* data, size_t length)
+{
+    return Crc32(0, data, length);
+}
@@ -0,0 +1,50 @@
+#ifndef simd_hpp
+#define simd_hpp
+
+#include <cstddef>
+#include <cstdint>
+
+// Reconstructs a scanline of 4-byte pixels with the same contract as lodepng's
+// unfilterScanline: recon may alias scanline, precon is the previous reconstructed line
+// or null for the first one. Returns false for an unknown filter type.
+bool UnfilterScanline4(uint8_t* recon, const uint8_t* scanline, const uint8_t* precon, size_t length, uint8_t filterType);
+
+// Applies a PNG filter to a scanline of 4-byte pixels, like lodepng's filterScanline
+void FilterScanline4(uint8_t* out, const uint8_t* scanline, const uint8_t* prevline, size_t length, uint8_t filterType);
+
+// Score used by the minimum sum filter heuristic. Filtered bytes count as signed
+// distances from zero; with raw set (filter type None) they're summed as is.
+size_t FilterSum(const uint8_t* line, size_t length, bool raw);
+
+// Packs 8 bit rgba pixels into 16 bit ones, rounding each channel to bits[c] bits and
+// placing it at shifts[c]. Channels with zero bits are dropped.
+void PackPixels16(uint16_t* out, const uint32_t* pixels, size_t count, const uint8_t bits[4], const uint8_t shifts[4]);
+
+// Premultiplies rgba pixels by their alpha in place. By default each channel is
+// truncated, exactly like the float multiply crunch has always used; rounded gives the
+// nearest value instead.
+void Premultiply(uint32_t* pixels, size_t count, bool rounded);
+
+// Index of the first pixel with any alpha, or of the first nonzero byte, or count if
+// there isn't one
+size_t FindVisible(const uint32_t* pixels, size_t count);
+size_t FindNonZero(const uint8_t* bytes, size_t count);
+
+// 4 bit indexed rows, two pixels a byte with the first in the high nibble like png.
+// UnpackNibbles widens count pixels to a byte each, PackNibbles narrows them back (the
+// values must be below 16) and CopyNibbles copies count pixels between rows at any
+// pixel offset, leaving the destination's other nibbles alone.
+void UnpackNibbles(uint8_t* out, const uint8_t* in, size_t count);
+void PackNibbles(uint8_t* out, const uint8_t* in, size_t count);
+void CopyNibbles(uint8_t* dst, size_t dstX, const uint8_t* src, size_t srcX, size_t count);
+
+// Index of the palette entry closest to an rgba color by squared distance, the first
+// on ties. The palette is four planes of count floats (red, green, blue, alpha) with
+// count a multiple of 4; padding entries should be far away from every color.
+int FindNearestColor(const float* planes, size_t count, uint32_t color);
+
+// Running checksums in zlib's convention: start from Crc32(0, ...) and Adler32(1, ...)
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size);
+uint32_t Adler32(uint32_t adler, const uint8_t* data, size_t size);
+
+#endif
@@ -0,0 +1,66 @@
+#include "spill.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+
+#ifdef _WIN32
+#define SeekFile _fseeki64
+#else
+#define SeekFile fseeko
+#endif
+
+static FILE* spillFile = nullptr;
+static int64_t spillSize = 0;
+static mutex spillLock;
+
+void SpillPixels(Bitmap& bitmap)
+{
+    size_t rowBytes = bitmap.RowBytes();
+    lock_guard<mutex> guard(spillLock);
+    if (!spillFile)
+    {
+        spillFile = tmpfile();
+        spillSize = 0;
+    }
+
+    bool written = spillFile && SeekFile(spillFile, spillSize, SEEK_SET) == 0;
+    for (int y = 0; y < bitmap.height && written; ++y)
+        written = fwrite(bitmap.data + y * bitmap.Stride(), 1, rowBytes, spillFile) == rowBytes;
+    if (!written)
+    {
+        cerr << "failed to write the scratch file for: " << bitmap.name << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    bitmap.FreePixels();
+    bitmap.spillOffset = spillSize;
+    spillSize += static_cast<int64_t>(rowBytes) * bitmap.height;
+}
+
+void UnspillPixels(Bitmap& bitmap)
+{
+    size_t size = bitmap.RowBytes() * bitmap.height;
+    uint8_t* pixels = reinterpret_cast<uint8_t*>(malloc(size));
+
+    lock_guard<mutex> guard(spillLock);
+    if (!pixels || !spillFile || SeekFile(spillFile, bitmap.spillOffset, SEEK_SET) != 0 || fread(pixels, 1, size, spillFile) != size)
+    {
+        cerr << "failed to read the scratch file for: " << bitmap.name << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    bitmap.FreePixels();
+    bitmap.data = pixels;
+}
+
+void CloseSpillFile()
+{
+    lock_guard<mutex> guard(spillLock);
+    if (spillFile)
+        fclose(spillFile);
+    spillFile = nullptr;
+    spillSize = 0;
+}
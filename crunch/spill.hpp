@@ -0,0 +1,17 @@
+#ifndef spill_hpp
+#define spill_hpp
+
+#include "bitmap.hpp"
+
+//Writes a sprite's pixels to the end of a scratch file and frees them, so only its
+//geometry, hash and metadata stay in memory. The file is created on first use and
+//removed when it's closed or crunch exits.
+void SpillPixels(Bitmap& bitmap);
+
+//Reads a spilled sprite's pixels back in, tightly packed. They stay in the scratch file,
+//so they can be let go of again with FreePixels.
+void UnspillPixels(Bitmap& bitmap);
+
+void CloseSpillFile();
+
+#endif
@@ -0,0 +1,430 @@
+#include "texture.hpp"
+#include "bcn.hpp"
+#include "binary.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+//One mip level of a page, as rgba pixels and encoded
+struct Level
+{
+    int width;
+    int height;
+    const uint32_t* pixels;
+    vector<uint32_t> storage;
+    vector<uint8_t> data;
+};
+
+//Where each channel (r, g, b, a) of a packed format goes
+struct PackedLayout
+{
+    int format;
+    uint8_t bits[4];
+    uint8_t shifts[4];
+    int vkFormat;
+};
+
+static const PackedLayout packedLayouts[] =
+{
+    { TEXTURE_RGB565, { 5, 6, 5, 0 }, { 11, 5, 0, 0 }, 4 },
+    { TEXTURE_RGBA5551, { 5, 5, 5, 1 }, { 10, 5, 0, 15 }, 8 },
+    { TEXTURE_RGBA4444, { 4, 4, 4, 4 }, { 12, 8, 4, 0 }, 2 }
+};
+
+static const PackedLayout* GetPackedLayout(int format)
+{
+    for (const PackedLayout& layout : packedLayouts)
+        if (layout.format == format)
+            return &layout;
+    return nullptr;
+}
+
+bool IsBlockFormat(int format)
+{
+    return format == TEXTURE_BC1 || format == TEXTURE_BC3 || format == TEXTURE_BC7;
+}
+
+bool IsPackedFormat(int format)
+{
+    return GetPackedLayout(format) != nullptr;
+}
+
+int GetMaskChannel(int format)
+{
+    if (format == TEXTURE_R8)
+        return 0;
+    if (format == TEXTURE_A8)
+        return 3;
+    return -1;
+}
+
+size_t GetTextureBytes(int format, int width, int height, bool mips)
+{
+    size_t bytes = 0;
+    for (;;)
+    {
+        size_t pixels = static_cast<size_t>(width) * height;
+        if (IsBlockFormat(format))
+            bytes += static_cast<size_t>((width + 3) / 4) * ((height + 3) / 4) * (format == TEXTURE_BC1 ? 8 : 16);
+        else if (IsPackedFormat(format))
+            bytes += pixels * 2;
+        else if (GetMaskChannel(format) >= 0)
+            bytes += pixels;
+        else
+            bytes += pixels * 4;
+
+        if (!mips || (width == 1 && height == 1))
+            return bytes;
+        width = max(1, width / 2);
+        height = max(1, height / 2);
+    }
+}
+
+const char* GetContainerExtension(TextureContainer container)
+{
+    return container == KTX2 ? ".ktx2" : ".dds";
+}
+
+static int GetBlockSize(int format)
+{
+    if (IsPackedFormat(format))
+        return 2;
+    return format == TEXTURE_BC1 ? 8 : 16;
+}
+
+void QuantizeRect(Bitmap& bitmap, int x, int y, int w, int h, const TextureOptions& options)
+{
+    const PackedLayout& layout = *GetPackedLayout(options.format);
+    uint32_t* pixels = reinterpret_cast<uint32_t*>(bitmap.data);
+
+    //Channels are dithered in steps of their own precision. A single bit of alpha is only
+    //ever thresholded, dithering it frays edges.
+    int max[4];
+    float spread[4];
+    for (int c = 0; c < 4; ++c)
+    {
+        max[c] = (1 << layout.bits[c]) - 1;
+        spread[c] = layout.bits[c] > 1 ? 1.0f : 0.0f;
+    }
+
+    auto load = [&](int i, int j, float* v)
+    {
+        uint32_t p = pixels[(y + j) * bitmap.width + x + i];
+        for (int c = 0; c < 4; ++c)
+            v[c] = ((p >> (c * 8)) & 0xff) * max[c] / 255.0f;
+        return true;
+    };
+
+    auto nearest = [&](int i, int j, const float* v, float* chosen)
+    {
+        int level[4];
+        for (int c = 0; c < 4; ++c)
+            level[c] = min(max[c], std::max(0, static_cast<int>(floorf(v[c] + 0.5f))));
+
+        //Formats without alpha are opaque, and premultiplied colors can't outshine their alpha
+        int alpha = layout.bits[3] ? (level[3] * 255 + max[3] / 2) / max[3] : 255;
+        if (options.premultiplied)
+            for (int c = 0; c < 3; ++c)
+                level[c] = min(level[c], alpha * max[c] / 255);
+
+        uint32_t result = static_cast<uint32_t>(alpha) << 24;
+        for (int c = 0; c < 3; ++c)
+            result |= static_cast<uint32_t>((level[c] * 255 + max[c] / 2) / max[c]) << (c * 8);
+        for (int c = 0; c < 4; ++c)
+            chosen[c] = static_cast<float>(level[c]);
+        pixels[(y + j) * bitmap.width + x + i] = result;
+    };
+
+    DitherRect(w, h, options.dither, spread, load, nearest);
+}
+
+//Averages each 2x2 square of pixels. Straight alpha colors are weighted by their alpha
+//so transparent pixels don't darken the edges of sprites.
+static void Downsample(const Level& src, Level& dst, bool premultiplied)
+{
+    dst.width = max(1, src.width / 2);
+    dst.height = max(1, src.height / 2);
+    dst.storage.resize(static_cast<size_t>(dst.width) * dst.height);
+    dst.pixels = dst.storage.data();
+
+    ParallelFor(dst.height, [&](int y)
+    {
+        int y0 = min(y * 2, src.height - 1);
+        int y1 = min(y * 2 + 1, src.height - 1);
+        for (int x = 0; x < dst.width; ++x)
+        {
+            int x0 = min(x * 2, src.width - 1);
+            int x1 = min(x * 2 + 1, src.width - 1);
+            uint32_t p[4] = { src.pixels[y0 * src.width + x0], src.pixels[y0 * src.width + x1], src.pixels[y1 * src.width + x0], src.pixels[y1 * src.width + x1] };
+
+            uint32_t sum[4] = {};
+            for (int i = 0; i < 4; ++i)
+            {
+                uint32_t a = p[i] >> 24;
+                uint32_t w = premultiplied ? 1 : a;
+                sum[0] += (p[i] & 0xff) * w;
+                sum[1] += ((p[i] >> 8) & 0xff) * w;
+                sum[2] += ((p[i] >> 16) & 0xff) * w;
+                sum[3] += a;
+            }
+
+            uint32_t total = premultiplied ? 4 : sum[3];
+            uint32_t c = (sum[3] + 2) / 4 << 24;
+            if (total > 0)
+                for (int i = 0; i < 3; ++i)
+                    c |= (sum[i] + total / 2) / total << (i * 8);
+            dst.storage[static_cast<size_t>(y) * dst.width + x] = c;
+        }
+    });
+}
+
+static void EncodeLevel(Level& level, int format)
+{
+    const PackedLayout* layout = GetPackedLayout(format);
+    if (layout)
+    {
+        level.data.resize(static_cast<size_t>(level.width) * level.height * 2);
+        ParallelFor(level.height, [&](int y)
+        {
+            size_t offset = static_cast<size_t>(y) * level.width;
+            PackPixels16(reinterpret_cast<uint16_t*>(level.data.data()) + offset, level.pixels + offset, level.width, layout->bits, layout->shifts);
+        });
+        return;
+    }
+
+    int bw = (level.width + 3) / 4;
+    int bh = (level.height + 3) / 4;
+    int blockSize = GetBlockSize(format);
+    level.data.resize(static_cast<size_t>(bw) * bh * blockSize);
+
+    ParallelFor(bh, [&](int by)
+    {
+        uint32_t block[16];
+        for (int bx = 0; bx < bw; ++bx)
+        {
+            //Levels smaller than a block repeat their last row and column
+            for (int y = 0; y < 4; ++y)
+            {
+                int sy = min(by * 4 + y, level.height - 1);
+                for (int x = 0; x < 4; ++x)
+                    block[y * 4 + x] = level.pixels[sy * level.width + min(bx * 4 + x, level.width - 1)];
+            }
+
+            uint8_t* out = &level.data[(static_cast<size_t>(by) * bw + bx) * blockSize];
+            if (format == TEXTURE_BC1)
+                EncodeBC1(out, block, true);
+            else if (format == TEXTURE_BC3)
+                EncodeBC3(out, block);
+            else
+                EncodeBC7(out, block);
+        }
+    });
+}
+
+static uint32_t ChannelMask(const PackedLayout& layout, int c)
+{
+    return ((1u << layout.bits[c]) - 1) << layout.shifts[c];
+}
+
+static void SaveDds(ofstream& out, const vector<Level>& levels, const TextureOptions& options)
+{
+    const PackedLayout* layout = GetPackedLayout(options.format);
+    bool dx10 = options.format == TEXTURE_BC7;
+    bool mips = levels.size() > 1;
+
+    //Packed pixels are described by a row pitch and channel masks, blocks by their total
+    //size and a four character code
+    WriteInt(out, 0x20534444); //"DDS "
+    WriteInt(out, 124);
+    WriteInt(out, 0x1 | 0x2 | 0x4 | 0x1000 | (layout ? 0x8 : 0x80000) | (mips ? 0x20000 : 0)); //caps, height, width, pixel format, pitch or linear size, mip count
+    WriteInt(out, levels[0].height);
+    WriteInt(out, levels[0].width);
+    WriteInt(out, layout ? levels[0].width * 2 : static_cast<int32_t>(levels[0].data.size()));
+    WriteInt(out, 0);
+    WriteInt(out, static_cast<int32_t>(levels.size()));
+    for (int i = 0; i < 11; ++i)
+        WriteInt(out, 0);
+
+    WriteInt(out, 32);
+    if (layout)
+    {
+        WriteInt(out, 0x40 | (layout->bits[3] ? 0x1 : 0)); //rgb, alpha
+        WriteInt(out, 0);
+        WriteInt(out, 16);
+        for (int c = 0; c < 4; ++c)
+            WriteInt(out, layout->bits[c] ? ChannelMask(*layout, c) : 0);
+    }
+    else
+    {
+        WriteInt(out, 0x4); //four character code
+        WriteInt(out, dx10 ? 0x30315844 : (options.format == TEXTURE_BC1 ? 0x31545844 : 0x35545844)); //"DX10", "DXT1", "DXT5"
+        for (int i = 0; i < 5; ++i)
+            WriteInt(out, 0);
+    }
+
+    WriteInt(out, 0x1000 | (mips ? 0x8 | 0x400000 : 0)); //texture, complex, mipmap
+    for (int i = 0; i < 4; ++i)
+        WriteInt(out, 0);
+
+    if (dx10)
+    {
+        WriteInt(out, options.format);
+        WriteInt(out, 3); //2d texture
+        WriteInt(out, 0);
+        WriteInt(out, 1);
+        WriteInt(out, options.premultiplied ? 2 : 1); //alpha mode
+    }
+
+    for (const Level& level : levels)
+        out.write(reinterpret_cast<const char*>(level.data.data()), level.data.size());
+}
+
+//A sample of a KTX2 data format descriptor: which bits of a texel block hold which channel
+struct DfdSample
+{
+    int bitOffset;
+    int bitLength;
+    int channel;
+    uint32_t upper;
+};
+
+static void SaveKtx2(ofstream& out, const vector<Level>& levels, const TextureOptions& options)
+{
+    static const uint8_t identifier[12] = { 0xab, 0x4b, 0x54, 0x58, 0x20, 0x32, 0x30, 0xbb, 0x0d, 0x0a, 0x1a, 0x0a };
+
+    //Vulkan format and the data format descriptor's color model and samples
+    const PackedLayout* layout = GetPackedLayout(options.format);
+    int vkFormat, colorModel;
+    vector<DfdSample> samples;
+    if (layout)
+    {
+        vkFormat = layout->vkFormat;
+        colorModel = 1; //rgbsda
+        for (int c = 0; c < 4; ++c)
+            if (layout->bits[c])
+                samples.push_back({ layout->shifts[c], layout->bits[c], c == 3 ? 15 : c, (1u << layout->bits[c]) - 1 });
+        sort(samples.begin(), samples.end(), [](const DfdSample& a, const DfdSample& b) { return a.bitOffset < b.bitOffset; });
+    }
+    else if (options.format == TEXTURE_BC1)
+    {
+        vkFormat = 133;
+        colorModel = 128;
+        samples.push_back({ 0, 64, 1, 0xffffffff });
+    }
+    else if (options.format == TEXTURE_BC3)
+    {
+        vkFormat = 137;
+        colorModel = 130;
+        samples.push_back({ 0, 64, 15, 0xffffffff });
+        samples.push_back({ 64, 64, 0, 0xffffffff });
+    }
+    else
+    {
+        vkFormat = 145;
+        colorModel = 134;
+        samples.push_back({ 0, 128, 0, 0xffffffff });
+    }
+
+    int blockSize = GetBlockSize(options.format);
+    int alignment = max(blockSize, 4);
+    int levelCount = static_cast<int>(levels.size());
+    int dfdOffset = 80 + levelCount * 24;
+    int dfdSize = 4 + 24 + 16 * static_cast<int>(samples.size());
+
+    //Level data goes smallest first, each aligned to the block size
+    vector<int64_t> offsets(levelCount);
+    int64_t offset = dfdOffset + dfdSize;
+    for (int i = levelCount - 1; i >= 0; --i)
+    {
+        offset = (offset + alignment - 1) / alignment * alignment;
+        offsets[i] = offset;
+        offset += levels[i].data.size();
+    }
+
+    out.write(reinterpret_cast<const char*>(identifier), sizeof(identifier));
+    WriteInt(out, vkFormat);
+    WriteInt(out, layout ? 2 : 1); //type size
+    WriteInt(out, levels[0].width);
+    WriteInt(out, levels[0].height);
+    WriteInt(out, 0); //depth
+    WriteInt(out, 0); //layers
+    WriteInt(out, 1); //faces
+    WriteInt(out, levelCount);
+    WriteInt(out, 0); //supercompression
+    WriteInt(out, dfdOffset);
+    WriteInt(out, dfdSize);
+    WriteInt(out, 0); //key/value data
+    WriteInt(out, 0);
+    WriteLong(out, 0); //supercompression global data
+    WriteLong(out, 0);
+
+    for (int i = 0; i < levelCount; ++i)
+    {
+        WriteLong(out, offsets[i]);
+        WriteLong(out, static_cast<int64_t>(levels[i].data.size()));
+        WriteLong(out, static_cast<int64_t>(levels[i].data.size()));
+    }
+
+    //Basic data format descriptor
+    WriteInt(out, dfdSize);
+    WriteInt(out, 0);
+    WriteInt(out, 2 | ((dfdSize - 4) << 16));
+    WriteByte(out, static_cast<char>(colorModel));
+    WriteByte(out, 1); //bt709 primaries
+    WriteByte(out, 1); //linear transfer
+    WriteByte(out, options.premultiplied ? 1 : 0);
+    WriteInt(out, layout ? 0 : 3 | (3 << 8)); //texel block size minus one
+    WriteInt(out, blockSize);
+    WriteInt(out, 0);
+    for (const DfdSample& sample : samples)
+    {
+        WriteShort(out, static_cast<int16_t>(sample.bitOffset));
+        WriteByte(out, static_cast<char>(sample.bitLength - 1));
+        WriteByte(out, static_cast<char>(sample.channel));
+        WriteInt(out, 0);
+        WriteInt(out, 0);
+        WriteInt(out, static_cast<int32_t>(sample.upper));
+    }
+
+    for (int i = levelCount - 1; i >= 0; --i)
+    {
+        while (static_cast<int64_t>(out.tellp()) < offsets[i])
+            out.put(0);
+        out.write(reinterpret_cast<const char*>(levels[i].data.data()), levels[i].data.size());
+    }
+}
+
+void SaveTexture(const string& file, const Bitmap& bitmap, const TextureOptions& options)
+{
+    vector<Level> levels(1);
+    levels[0].width = bitmap.width;
+    levels[0].height = bitmap.height;
+    levels[0].pixels = reinterpret_cast<const uint32_t*>(bitmap.data);
+
+    while (options.mips && (levels.back().width > 1 || levels.back().height > 1))
+    {
+        levels.emplace_back();
+        Downsample(levels[levels.size() - 2], levels.back(), options.premultiplied);
+    }
+
+    for (Level& level : levels)
+        EncodeLevel(level, options.format);
+
+    ofstream out(file, ios::binary);
+    if (options.container == KTX2)
+        SaveKtx2(out, levels, options);
+    else
+        SaveDds(out, levels, options);
+
+    if (!out)
+    {
+        cerr << "failed to save texture: " << file << endl;
+        exit(EXIT_FAILURE);
+    }
+}
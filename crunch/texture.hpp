@@ -0,0 +1,61 @@
+#ifndef texture_hpp
+#define texture_hpp
+
+#include <string>
+#include "bitmap.hpp"
+#include "dither.hpp"
+
+using namespace std;
+
+//Texture formats crunch can encode pages to. The values follow DXGI_FORMAT, and the
+//pixels are laid out exactly like that format, so they can be written to the atlas
+//metadata as is; any other --format number just saves png.
+enum TextureFormat
+{
+    TEXTURE_PNG = 0,
+    TEXTURE_BC1 = 71,
+    TEXTURE_BC3 = 77,
+    TEXTURE_BC7 = 98,
+    TEXTURE_RGB565 = 85,        //B5G6R5: red in the top bits
+    TEXTURE_RGBA5551 = 86,      //B5G5R5A1: alpha in the top bit, red below it
+    TEXTURE_RGBA4444 = 191,     //A4B4G4R4: red in the top bits, alpha in the bottom ones
+    TEXTURE_R8 = 61,            //single channel pages holding the sprites' red
+    TEXTURE_A8 = 65             //single channel pages holding the sprites' alpha
+};
+
+enum TextureContainer
+{
+    DDS,
+    KTX2
+};
+
+struct TextureOptions
+{
+    int format;
+    TextureContainer container;
+    bool mips;
+    bool premultiplied;
+    Dither dither;
+};
+
+bool IsBlockFormat(int format);
+bool IsPackedFormat(int format);
+
+//Which rgba channel a single channel format keeps of each sprite, or -1 for other formats
+int GetMaskChannel(int format);
+const char* GetContainerExtension(TextureContainer container);
+
+//Bytes a page of this size takes in the format once it's on the gpu, every mip level
+//included if asked for. Png pages count as rgba.
+size_t GetTextureBytes(int format, int width, int height, bool mips);
+
+//Rounds a rect of an rgba page to the precision of a packed format, dithering it if
+//asked to. The result stays 8 bits per channel, so it can be saved as a png preview
+//and then packed without any further loss.
+void QuantizeRect(Bitmap& bitmap, int x, int y, int w, int h, const TextureOptions& options);
+
+//Encodes an rgba page, optionally with a full mip chain, and saves it. Blocks and
+//pixels are encoded across the worker threads.
+void SaveTexture(const string& file, const Bitmap& bitmap, const TextureOptions& options);
+
+#endif
@@ -0,0 +1,137 @@
+#include "tiles.hpp"
+#include "binary.hpp"
+#include "parallel.hpp"
+
+using namespace std;
+
+//A tile cut from a sheet before it's looked up, with the hash it's keyed on
+struct Cell
+{
+    Bitmap* tile;
+    size_t hash;
+    int canonical;
+};
+
+void CutTiles(vector<Bitmap*>& sheets, int tileSize, DedupIndex& index, vector<Bitmap*>& tiles, vector<Tilemap>& tilemaps)
+{
+    //Cutting and hashing every cell is the slow part, and doesn't touch the index
+    vector<vector<Cell>> cells(sheets.size());
+    ParallelFor(static_cast<int>(sheets.size()), [&](int i)
+    {
+        const Bitmap* sheet = sheets[i];
+        int columns = (sheet->width + tileSize - 1) / tileSize;
+        int rows = (sheet->height + tileSize - 1) / tileSize;
+        cells[i].reserve(static_cast<size_t>(columns) * rows);
+        for (int y = 0; y < rows; ++y)
+        {
+            for (int x = 0; x < columns; ++x)
+            {
+                Bitmap* tile = new Bitmap(tileSize, tileSize, sheet->palette, sheet->paletteSize, sheet->bitDepth, sheet->mask);
+                tile->name = sheet->name;
+                tile->label = sheet->label;
+                tile->frameIndex = static_cast<int>(cells[i].size());
+                tile->frameX = 0;
+                tile->frameY = 0;
+                tile->frameW = tileSize;
+                tile->frameH = tileSize;
+                tile->paletteSlot = sheet->paletteSlot;
+                tile->CopyRegion(sheet, x * tileSize, y * tileSize);
+                tile->UpdateHash();
+
+                Cell cell = { tile, 0, 0 };
+                cell.hash = index.Hash(tile, cell.canonical);
+                cells[i].push_back(cell);
+            }
+        }
+    });
+
+    //Looking them up in sheet order keeps the first copy of every tile
+    size_t first = tiles.size();
+    for (size_t i = 0; i < sheets.size(); ++i)
+    {
+        Tilemap tilemap;
+        tilemap.name = sheets[i]->name;
+        tilemap.frameIndex = sheets[i]->frameIndex;
+        tilemap.columns = (sheets[i]->width + tileSize - 1) / tileSize;
+        tilemap.rows = (sheets[i]->height + tileSize - 1) / tileSize;
+        tilemap.paletteSlot = sheets[i]->paletteSlot;
+        for (Cell& cell : cells[i])
+        {
+            int transform;
+            Bitmap* original = index.Insert(cell.tile, cell.hash, cell.canonical, transform);
+            if (original)
+            {
+                delete cell.tile;
+                tilemap.tiles.push_back(original);
+            }
+            else
+            {
+                tiles.push_back(cell.tile);
+                tilemap.tiles.push_back(cell.tile);
+            }
+            tilemap.transforms.push_back(static_cast<uint8_t>(transform));
+        }
+        tilemaps.push_back(move(tilemap));
+        delete sheets[i];
+    }
+    sheets.clear();
+
+    //Remember what the png encoder will want to know about the tiles that are kept
+    ParallelFor(static_cast<int>(tiles.size() - first), [&](int i)
+    {
+        Bitmap* tile = tiles[first + i];
+        if (tile->paletteSize == 0 && !tile->mask)
+            tile->colors.Add(reinterpret_cast<uint32_t*>(tile->data), static_cast<size_t>(tile->width) * tile->height);
+    });
+}
+
+void Tilemap::SaveXml(ofstream& xml, const unordered_map<const Bitmap*, int>& indices)
+{
+    xml << "\t<map n=\"" << name << "\" fi=\"" << frameIndex << "\" w=\"" << columns << "\" h=\"" << rows << "\" ps=\"" << paletteSlot << "\">" << endl;
+    for (int y = 0; y < rows; ++y)
+    {
+        xml << "\t\t<row>";
+        for (int x = 0; x < columns; ++x)
+        {
+            size_t i = static_cast<size_t>(y) * columns + x;
+            if (x > 0)
+                xml << ' ';
+            xml << indices.at(tiles[i]);
+            if (transforms[i] != 0)
+                xml << ':' << static_cast<int>(transforms[i]);
+        }
+        xml << "</row>" << endl;
+    }
+    xml << "\t</map>" << endl;
+}
+
+void Tilemap::SaveBin(ofstream& bin, const unordered_map<const Bitmap*, int>& indices, int length)
+{
+    WriteString(bin, name.Str(), length);
+    WriteShort(bin, (int16_t)frameIndex);
+    WriteShort(bin, (int16_t)columns);
+    WriteShort(bin, (int16_t)rows);
+    WriteByte(bin, paletteSlot);
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        WriteShort(bin, (int16_t)indices.at(tiles[i]));
+        WriteByte(bin, transforms[i]);
+    }
+}
+
+void Tilemap::SaveJson(ofstream& json, const unordered_map<const Bitmap*, int>& indices)
+{
+    json << "\t\t\t\"n\":\"" << name << "\"," << endl;
+    json << "\t\t\t\"fi\":" << frameIndex << "," << endl;
+    json << "\t\t\t\"w\":" << columns << "," << endl;
+    json << "\t\t\t\"h\":" << rows << "," << endl;
+    json << "\t\t\t\"ps\":" << paletteSlot << "," << endl;
+    json << "\t\t\t\"tiles\":[";
+    for (size_t i = 0; i < tiles.size(); ++i)
+        json << (i > 0 ? "," : "") << indices.at(tiles[i]);
+    json << "]," << endl;
+    json << "\t\t\t\"t\":[";
+    for (size_t i = 0; i < transforms.size(); ++i)
+        json << (i > 0 ? "," : "") << static_cast<int>(transforms[i]);
+    json << "]" << endl;
+}
@@ -0,0 +1,37 @@
+#ifndef tiles_hpp
+#define tiles_hpp
+
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bitmap.hpp"
+#include "dedup.hpp"
+
+using namespace std;
+
+//A sheet cut into a grid of tiles, row by row. Each cell points at the unique tile it
+//shows and how that tile is flipped to look like the cell, see TRANSFORM_ flags.
+struct Tilemap
+{
+    Interned name;
+    int frameIndex;
+    int columns;
+    int rows;
+    int paletteSlot;
+    vector<Bitmap*> tiles;
+    vector<uint8_t> transforms;
+
+    void SaveXml(ofstream& xml, const unordered_map<const Bitmap*, int>& indices);
+    void SaveBin(ofstream& bin, const unordered_map<const Bitmap*, int>& indices, int length);
+    void SaveJson(ofstream& json, const unordered_map<const Bitmap*, int>& indices);
+};
+
+//Cuts every sheet into tileSize tiles, the last row and column padded with transparent
+//pixels, and deletes the sheets. Tiles matching an earlier one, as far as the index's
+//transforms go, are dropped; the rest are added to tiles in the order they were first
+//seen, so the result doesn't depend on the thread count. Cutting and hashing are spread
+//across the worker threads.
+void CutTiles(vector<Bitmap*>& sheets, int tileSize, DedupIndex& index, vector<Bitmap*>& tiles, vector<Tilemap>& tilemaps);
+
+#endif
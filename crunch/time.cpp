@@ -1,7 +1,9 @@
 #include "time.hpp"
+#include "parallel.hpp"
 #include <unordered_map>
 #include <chrono>
 #include <iostream>
+#include <mutex>
 
 // Uncomment line below if needed
 // #define MEASURE_TIME 
@@ -10,21 +12,63 @@ using namespace std;
 
 static unordered_map<std::string, long long> funcs;
 static unordered_map<std::string, long long> starts;
+static unordered_map<std::string, long long> busyFuncs;
+static unordered_map<std::string, long long> busyStarts;
+
+#ifdef MEASURE_TIME
+//Thread time spent working, added up every time a thread starts or stops
+static mutex busyLock;
+static int busyThreads = 1;
+static long long busySince = 0;
+static long long busyTotal = 0;
+
+static long long Now()
+{
+    auto now = chrono::high_resolution_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+static long long BusyTime(long long now, int change = 0)
+{
+    lock_guard<mutex> guard(busyLock);
+    if (busySince > 0)
+        busyTotal += busyThreads * (now - busySince);
+    busySince = now;
+    busyThreads += change;
+    return busyTotal;
+}
+
+//How much of the time every worker thread could have given the timer went into work
+static double Saturation(const string& func)
+{
+    return funcs[func] > 0 ? 100.0 * busyFuncs[func] / (static_cast<double>(funcs[func]) * GetThreadCount()) : 0.0;
+}
+#endif
+
+void SetBusy(bool busy)
+{
+#ifdef MEASURE_TIME
+    BusyTime(Now(), busy ? 1 : -1);
+#else
+    (void)busy;
+#endif
+}
 
 void StartTimer(const string& func)
 {
 #ifdef MEASURE_TIME
-    auto now = chrono::high_resolution_clock::now();
-    starts[func] = chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+    long long now = Now();
+    starts[func] = now;
+    busyStarts[func] = BusyTime(now);
 #endif
 }
 
 void StopTimer(const string& func)
 {
 #ifdef MEASURE_TIME
-    auto now = chrono::high_resolution_clock::now();
-    auto timeNow = chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
-    funcs[func] += timeNow - starts[func];
+    long long now = Now();
+    funcs[func] += now - starts[func];
+    busyFuncs[func] += BusyTime(now) - busyStarts[func];
 #endif
 }
 
@@ -35,12 +79,12 @@ void WriteAllTimers()
     cout << "Time measured:" << endl;
     for (auto &kv : funcs) 
         if(kv.first != "total" && !kv.first.ends_with('/'))
-            cout << "\t" << kv.first << ": " << kv.second / 1000000.0 << " ms" << endl;
+            cout << "\t" << kv.first << ": " << kv.second / 1000000.0 << " ms, " << Saturation(kv.first) << "% cpu" << endl;
     
     for (auto &kv : funcs) 
         if(kv.first != "total" && kv.first.ends_with('/'))
-            cout << "\tsubdir " << kv.first.substr(0, kv.first.length() - 1) << ": " << kv.second / 1000000.0 << " ms" << endl;
+            cout << "\tsubdir " << kv.first.substr(0, kv.first.length() - 1) << ": " << kv.second / 1000000.0 << " ms, " << Saturation(kv.first) << "% cpu" << endl;
     
-    cout << "\ttotal: " << funcs["total"] / 1000000.0 << " ms" << endl;
+    cout << "\ttotal: " << funcs["total"] / 1000000.0 << " ms, " << Saturation("total") << "% cpu of " << GetThreadCount() << " threads" << endl;
 #endif
 }
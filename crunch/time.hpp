@@ -7,4 +7,8 @@ void StartTimer(const std::string& func);
 void StopTimer(const std::string& func);
 void WriteAllTimers();
 
+// Called by a thread as it starts or stops running tasks, so the timers can tell how busy
+// the worker threads kept the cpu. The main thread counts as busy unless it says otherwise.
+void SetBusy(bool busy);
+
 #endif